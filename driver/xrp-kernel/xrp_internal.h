@@ -34,13 +34,13 @@
 #include <linux/miscdevice.h>
 #include <linux/mutex.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 #include "xrp_address_map.h"
 #include "xrp_kernel_report.h"
 struct device;
 struct firmware;
 struct xrp_hw_ops;
 struct xrp_allocation_pool;
-struct xrp_dma_buf_list;
 struct xrp_panic_log ;
 struct xrp_comm {
 	struct mutex lock;
@@ -77,8 +77,8 @@ struct xvp {
 	int nodeid;
 	 
 	struct xrp_reporter *reporter;
-    
-    struct list_head  dma_buf_list;
+	/* woken when reports are queued, see xvp_poll */
+	wait_queue_head_t report_wait;
 
      struct proc_dir_entry *proc_dir;
 
@@ -45,6 +45,13 @@
 #define XRP_IOCTL_DMABUF_RELEASE   _IO(XRP_IOCTL_MAGIC, 9)
 
 #define XRP_IOCTL_DMABUF_SYNC  _IO(XRP_IOCTL_MAGIC, 10)
+
+#define XRP_IOCTL_QUEUE_BATCH	_IO(XRP_IOCTL_MAGIC, 11)
+#define XRP_IOCTL_QUEUE_ASYNC	_IO(XRP_IOCTL_MAGIC, 12)
+#define XRP_IOCTL_RING_SETUP	_IO(XRP_IOCTL_MAGIC, 13)
+#define XRP_IOCTL_RING_ENTER	_IO(XRP_IOCTL_MAGIC, 14)
+#define XRP_IOCTL_BUFFER_REGISTER	_IO(XRP_IOCTL_MAGIC, 15)
+#define XRP_IOCTL_BUFFER_UNREGISTER	_IO(XRP_IOCTL_MAGIC, 16)
 struct xrp_ioctl_alloc {
 	__u32 size;
 	__u32 align;
@@ -64,6 +71,75 @@ struct xrp_ioctl_buffer {
 	__u64 addr;
 };
 
+/*
+ * Set in xrp_ioctl_buffer::flags when addr holds a handle returned by
+ * XRP_IOCTL_BUFFER_REGISTER instead of a virtual address. size may be 0
+ * or the registered size.
+ */
+enum {
+	XRP_FLAG_REGISTERED = 0x100,
+};
+
+/*
+ * Set in xrp_dma_buf::flags for XRP_IOCTL_DMABUF_IMPORT of buffers only the
+ * DSP accesses: no CPU mapping is created and addr is returned as 0.
+ */
+enum {
+	XRP_FLAG_DMABUF_NO_MAP = 0x200,
+	XRP_FLAG_DMABUF_SG = 0x400,
+};
+
+/*
+ * XRP_IOCTL_DMABUF_SYNC operation. FOR_DEVICE hands the buffer to the DSP
+ * (cleans for READ), FOR_CPU hands it back (invalidates for WRITE), with
+ * the direction taken from XRP_FLAG_READ/WRITE. With RANGE only size bytes
+ * from offset addr into the buffer are synced. Without an operation flag
+ * the legacy behaviour applies.
+ */
+enum {
+	XRP_FLAG_DMABUF_SYNC_FOR_DEVICE = 0x800,
+	XRP_FLAG_DMABUF_SYNC_FOR_CPU = 0x1000,
+	XRP_FLAG_DMABUF_SYNC_RANGE = 0x2000,
+};
+
+/*
+ * A dma-buf made of more than one physically contiguous segment can only
+ * be imported with XRP_FLAG_DMABUF_SG. The driver then describes it with
+ * a struct xrp_dsp_sg_list in DSP memory and returns the list's physical
+ * address in xrp_dma_buf::paddr, tagged with XRP_DMABUF_PADDR_SG. The tag
+ * travels with the address, e.g. in csi_dsp_plane::buf_phy, so the DSP
+ * side can tell a descriptor list from the data itself. Contiguous
+ * buffers are returned untagged either way.
+ */
+#define XRP_DMABUF_PADDR_SG	(1ull << 63)
+
+struct xrp_dsp_sg_entry {
+	__u64 paddr;
+	__u32 size;
+	__u32 reserved;
+};
+
+struct xrp_dsp_sg_list {
+	__u32 n_entries;
+	__u32 size;		/* sum of the entry sizes */
+	__u64 reserved;
+	struct xrp_dsp_sg_entry entry[0];
+};
+
+/*
+ * Argument of XRP_IOCTL_BUFFER_REGISTER: buffer_addr points to n_buffers
+ * struct xrp_ioctl_buffer describing the memory, handle_addr to n_buffers
+ * __u32 that receive the handles. Registration is all or nothing.
+ * XRP_IOCTL_BUFFER_UNREGISTER takes the same structure, only n_buffers
+ * and handle_addr are used.
+ */
+struct xrp_ioctl_register_buffers {
+	__u32 n_buffers;
+	__u32 reserved;
+	__u64 buffer_addr;
+	__u64 handle_addr;
+};
+
 enum {
 	XRP_QUEUE_FLAG_NSID = 0x4,
 	XRP_QUEUE_FLAG_PRIO = 0xff00,
@@ -85,12 +161,135 @@ struct xrp_ioctl_queue {
 	__u64 nsid_addr;
 };
 
+#define XRP_QUEUE_BATCH_MAX	32
+#define XRP_QUEUE_BATCH_NOT_RUN	1
+
+/*
+ * Argument of XRP_IOCTL_QUEUE_BATCH: queue_addr points to n_queues
+ * struct xrp_ioctl_queue, status_addr to n_queues __s32 that receive
+ * per-command result (0 or negative errno). Commands that were not
+ * passed to the DSP are left at XRP_QUEUE_BATCH_NOT_RUN, which is all
+ * of them when the ioctl fails before the first one was started.
+ */
+struct xrp_ioctl_queue_batch {
+	__u32 n_queues;
+	__u32 reserved;
+	__u64 queue_addr;
+	__u64 status_addr;
+};
+
+/*
+ * Argument of XRP_IOCTL_QUEUE_ASYNC. The ioctl returns as soon as the
+ * command is queued, seq is filled with its sequence number.
+ */
+struct xrp_ioctl_queue_async {
+	struct xrp_ioctl_queue queue;
+	__u64 seq;
+};
+
+/*
+ * Completion record of an async command, read(2) from the device file.
+ * The file is readable (poll/epoll) when completions are available.
+ */
+struct xrp_ioctl_completion {
+	__u64 seq;
+	__s32 status;
+	__u32 reserved;
+};
+
+/*
+ * Shared submission/completion rings, set up with XRP_IOCTL_RING_SETUP.
+ *
+ * The ring area starts with struct xrp_ring_header, followed by the SQE
+ * array at sq_off and the CQE array at cq_off. User space fills SQEs and
+ * advances sq_tail, the driver consumes them in order and posts exactly one
+ * CQE per SQE, so the CQE of the n-th submitted SQE is the n-th CQE.
+ * Head/tail values are free running counters, masks give the array index.
+ */
+enum {
+	XRP_RING_SETUP_SQPOLL = 0x1,	/* driver thread polls sq_tail */
+	XRP_RING_SETUP_VALID_FLAGS = XRP_RING_SETUP_SQPOLL,
+};
+
+enum {
+	XRP_RING_SQ_NEED_WAKEUP = 0x1,	/* polling thread sleeps, use RING_ENTER */
+};
+
+enum {
+	XRP_RING_ENTER_WAIT = 0x1,	/* wait until cq_tail reaches cq_target */
+};
+
+#define XRP_RING_MAX_ENTRIES	256
+
+struct xrp_ring_header {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 sq_mask;
+	__u32 sq_flags;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 cq_mask;
+	__u32 reserved;
+};
+
+struct xrp_ring_sqe {
+	struct xrp_ioctl_queue queue;
+	__u64 user_data;
+};
+
+struct xrp_ring_cqe {
+	__u64 user_data;
+	__s32 status;
+	__u32 reserved;
+};
+
+struct xrp_ioctl_ring_setup {
+	__u32 sq_entries;	/* in, power of 2 */
+	__u32 cq_entries;	/* out */
+	__u32 flags;		/* in, XRP_RING_SETUP_* */
+	__u32 sq_thread_idle;	/* in, ms the polling thread spins when idle */
+	__u32 sq_off;		/* out */
+	__u32 cq_off;		/* out */
+	__u32 size;		/* out */
+	__u32 reserved;
+	__u64 addr;		/* out, ring area in the caller address space */
+};
+
+struct xrp_ioctl_ring_enter {
+	__u32 flags;		/* XRP_RING_ENTER_* */
+	__u32 cq_target;
+};
+
 struct xrp_report_buffer
 {
 	__u32 report_id;
 	__u32 data[1];
 };
 
+/*
+ * Report ring at the start of the area mapped by XRP_IOCTL_REPORT_CREATE.
+ * The align field of struct xrp_ioctl_alloc passed to that ioctl is the
+ * requested ring depth, 0 selects the report_ring_depth module parameter;
+ * the depth is rounded up to a power of two.
+ * The driver copies every DSP report into entry (head & mask) and bumps
+ * head, the consumer processes entries up to head and then advances tail.
+ * When the ring is full the new report is discarded and dropped is
+ * incremented. Entries are entry_size bytes apart and start entry_offset
+ * bytes from the ring, each one is a struct xrp_report_buffer followed by
+ * the report payload.
+ */
+struct xrp_report_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 mask;
+	__u32 dropped;
+	__u32 entry_size;
+	__u32 entry_offset;
+	__u32 reserved[2];
+};
+
+#define XRP_REPORT_RING_DEPTH_MAX 1024
+
 
 struct xrp_dma_buf{
     int fd;
@@ -32,12 +32,22 @@
 struct xrp_reporter {
 
     struct fasync_struct *fasync;
+	/* file that created the reporter */
+	struct file *filp;
 	struct tasklet_struct  report_task;
 	__u64 buffer_virt;
 
 	phys_addr_t buffer_phys;
 	size_t buffer_size;
 
+	/* report ring at buffer_virt, DSP report slot at dsp_slot */
+	void __iomem *entries;
+	void __iomem *dsp_slot;
+	size_t map_size;
+	__u32 head;
+	__u32 mask;
+	__u32 entry_size;
+	__u32 dropped;
 };
 
 #endif
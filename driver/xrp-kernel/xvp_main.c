@@ -44,18 +44,24 @@
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_device.h>
 #include <linux/of_reserved_mem.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
 #include <linux/pm_runtime.h>
 #include <linux/property.h>
 #include <linux/sched.h>
+#include <linux/sched/mm.h>
 #include <linux/slab.h>
 #include <linux/sort.h>
 #include <linux/timer.h>
+#include <linux/vmalloc.h>
 #include <linux/dma-mapping.h>
 #include <linux/dma-buf.h>
 #include <asm/mman.h>
@@ -69,6 +75,12 @@
 #include "xrp_kernel_dsp_interface.h"
 #include "xrp_private_alloc.h"
 #include "xrp_debug.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
+#define kthread_use_mm use_mm
+#define kthread_unuse_mm unuse_mm
+#endif
 #define DRIVER_NAME "xrp"
 #define XRP_DEFAULT_TIMEOUT 60
 
@@ -93,6 +105,7 @@ struct xrp_mapping {
 		XRP_MAPPING_NONE,
 		XRP_MAPPING_NATIVE,
 		XRP_MAPPING_ALIEN,
+		XRP_MAPPING_REGISTERED,
 		XRP_MAPPING_KERNEL = 0x4,
 	} type;
 	union {
@@ -101,13 +114,55 @@ struct xrp_mapping {
 			unsigned long vaddr;
 		} native;
 		struct xrp_alien_mapping alien_mapping;
+		struct xrp_registered_buffer *registered;
 	};
 };
 
+/*
+ * Buffer shared once with XRP_IOCTL_BUFFER_REGISTER and referenced by
+ * handle afterwards. Requests hold a reference while they use it.
+ */
+struct xrp_registered_buffer {
+	struct kref ref;
+	struct file *filp;
+	struct xrp_mapping mapping;
+	unsigned long vaddr;
+	unsigned long size;
+	phys_addr_t phys;
+	u32 flags;
+	bool do_cache;
+};
+
+struct xrp_ring;
+
 struct xvp_file {
 	struct xvp *xvp;
 	spinlock_t busy_list_lock;
 	struct xrp_allocation *busy_list;
+
+	/* XRP_IOCTL_QUEUE_ASYNC state, see xrp_ioctl_submit_async */
+	spinlock_t async_lock;
+	struct list_head async_pending;
+	struct list_head async_done;
+	wait_queue_head_t async_wait;
+	struct work_struct async_work;
+	/* orders seq assignment with publishing, see xrp_ioctl_submit_async */
+	struct mutex async_submit_lock;
+	u64 async_seq;
+
+	/* XRP_IOCTL_BUFFER_REGISTER handles */
+	spinlock_t registered_lock;
+	struct idr registered;
+
+	/* XRP_IOCTL_RING_SETUP state, ring is published once it's usable */
+	struct xrp_ring *ring_pending;
+	struct xrp_ring *ring;
+
+	/* XRP_IOCTL_DMABUF_IMPORT state, see struct xrp_dma_buf_item */
+	struct mutex dma_buf_lock;
+	DECLARE_HASHTABLE(dma_bufs, 6);
+	struct list_head dma_buf_lru;
+	unsigned int dma_buf_idle;
 };
 
 struct xrp_known_file {
@@ -115,13 +170,22 @@ struct xrp_known_file {
 	struct hlist_node node;
 };
 
+/*
+ * dma-buf imported by a file, hashed by struct dma_buf. The attachment and
+ * its sg table stay mapped after the last XRP_IOCTL_DMABUF_RELEASE, idle
+ * items are on the file's LRU and detached beyond dma_buf_cache_max.
+ */
 struct xrp_dma_buf_item{
-
-	struct list_head  link;
-    struct dma_buf *dmabuf;
-    struct sg_table *sgt;
-    struct dma_buf_attachment * attachment;
-    int ref;
+	struct hlist_node node;
+	struct list_head lru;
+	struct dma_buf *dmabuf;
+	struct sg_table *sgt;
+	struct dma_buf_attachment *attachment;
+	enum dma_data_direction dir;
+	phys_addr_t paddr;	/* as returned, tagged for a descriptor list */
+	unsigned long size;
+	struct xrp_allocation *sg_list;
+	int ref;
 };
 static int firmware_command_timeout = XRP_DEFAULT_TIMEOUT;
 module_param(firmware_command_timeout, int, 0644);
@@ -156,13 +220,20 @@ static int heartbeat_period = 0;
 module_param(heartbeat_period, int, 0644);
 MODULE_PARM_DESC(heartbeat_period, "Firmware command timeout in seconds.");
 
+static int report_ring_depth = 16;
+module_param(report_ring_depth, int, 0644);
+MODULE_PARM_DESC(report_ring_depth, "Default number of entries in the report ring.");
+
+static int dma_buf_cache_max = 16;
+module_param(dma_buf_cache_max, int, 0644);
+MODULE_PARM_DESC(dma_buf_cache_max, "Idle dma-buf attachments kept per file for reimport.");
+
 static int dsp_fw_log_mode = 1;
 module_param(dsp_fw_log_mode, int, 0644);
 MODULE_PARM_DESC(dsp_fw_log_mode, "Firmware LOG MODE.0:disable,1:ERROR(DEFAULT),2:WRNING,3:INFO,4:DEUBG,5:TRACE");
 static DEFINE_HASHTABLE(xrp_known_files, 10);
 static DEFINE_SPINLOCK(xrp_known_files_lock);
 
-static DEFINE_SPINLOCK(xrp_dma_buf_lock);
 static DEFINE_IDA(xvp_nodeid);
 
 static int xrp_boot_firmware(struct xvp *xvp);
@@ -558,6 +629,33 @@ static bool xrp_cmd_complete(struct xrp_comm *xvp)
 		 XRP_DSP_CMD_FLAG_RESPONSE_VALID);
 }
 
+/*
+ * Copy the report in the DSP slot into the next free ring entry.
+ * Only called from the interrupt handler, which is the only writer
+ * of the ring head, so no locking is needed against the consumer.
+ */
+static void xrp_report_ring_push(struct xrp_reporter *reporter, u32 id)
+{
+	struct xrp_report_ring __iomem *ring = (void __iomem *)reporter->buffer_virt;
+	struct xrp_report_buffer __iomem *entry;
+	u32 tail = xrp_comm_read32(&ring->tail);
+	u32 head = reporter->head;
+	size_t i;
+
+	if (head - tail > reporter->mask) {
+		xrp_comm_write32(&ring->dropped, ++reporter->dropped);
+		return;
+	}
+	entry = reporter->entries + (head & reporter->mask) * reporter->entry_size;
+	xrp_comm_write32(&entry->report_id, id);
+	for (i = 0; i < reporter->buffer_size; i += sizeof(u32))
+		xrp_comm_write32(&entry->data[0] + i / sizeof(u32),
+				 xrp_comm_read32(reporter->dsp_slot + i));
+	wmb();
+	reporter->head = head + 1;
+	xrp_comm_write32(&ring->head, reporter->head);
+}
+
 static inline int xrp_report_comlete(struct xvp *xvp)
 {
 	struct xrp_dsp_cmd __iomem *cmd = xvp->comm;
@@ -569,10 +667,14 @@ static inline int xrp_report_comlete(struct xvp *xvp)
 
 	if(flags& XRP_DSP_REPORT_TO_HOST_FLAG )
 	{
-        // dev_err(xvp->dev, "%s,report_flag %x\n", __func__,flags);
-	    flags &= (~XRP_DSP_REPORT_TO_HOST_FLAG);
-
-        xrp_comm_write32(&cmd->report_id,flags);
+		/*
+		 * The report is in the ring once copied, so the DSP slot
+		 * is handed back right away instead of after user space
+		 * has been signalled.
+		 */
+		rmb();
+		xrp_report_ring_push(xvp->reporter, flags & 0xffff);
+		xrp_comm_write32(&cmd->report_id, 0);
 		tasklet_schedule(&xvp->reporter->report_task);
 		return 0;
 	}
@@ -707,52 +809,14 @@ static long xrp_ioctl_alloc(struct file *filp,
 static void xrp_report_tasklet(unsigned long arg)
 {
 	struct xvp *xvp=(struct xvp *)arg;
-		struct xrp_dsp_cmd __iomem *cmd=xvp->comm;
-	struct xrp_report_buffer *p_buf = xvp->reporter->buffer_virt;
-	// pr_debug("%s,addr:%lx\n",__func__,arg);
+
+	wake_up_interruptible(&xvp->report_wait);
 	if(!xvp->reporter->fasync)
 	{
 		pr_debug("%s:fasync is not register in user space\n",__func__);
 		return;
 	}
-	// pr_debug("%s,%d\n",__func__,xvp->reporter->fasync->magic);
-	// if(!xvp->reporter->user_buffer_virt &&
-	// 	!xvp->reporter->buffer_size)
-	// {
-	// 	pr_debug("%s:user_buffer_virt and buffer size is invalid\n",__func__);
-	// 	return;
-	// }
-	// size_t s= xrp_comm_read32(&cmd->report_paylad_size);
-
-	// unsigned int id = xrp_comm_read32(&cmd->report_id);
-	// if(copy_to_user(&p_buf_user->report_id,&id,sizeof(p_buf_user->report_id)));
-	// {
-	// 	pr_debug("%s:copy report id to user fail\n",__func__);
-	// 	return;
-	// }
-
-    // if(xvp->reporter->buffer_size>XRP_DSP_CMD_INLINE_DATA_SIZE)
-	// {
-	// 	if(xrp_copy_user_from_phys(xvp,&p_buf_user->data[0],s,xvp->reporter->buffer_phys,XRP_FLAG_READ_WRITE))
-	// 		return;			 
-	// }
-	// else
-	// {
-	// 	char temp_buf[XRP_DSP_CMD_INLINE_DATA_SIZE];
-	// 	xrp_comm_read(&cmd->report_data,temp_buf,s);
-	// 	if(copy_to_user(&p_buf_user->data[0],temp_buf,s))
-	// 	{
-	// 		pr_debug("%s:copy report data to user fail\n",__func__);
-	// 		return;
-	// 	}
-	// }
-	/*****clear report*********************/
-	p_buf->report_id = xrp_comm_read32(&cmd->report_id)&0xffff;
-
-	//xrp_dma_sync_for_cpu(xvp,xvp->reporter->buffer_virt,xvp->reporter->buffer_phys,xvp->reporter->buffer_size,XRP_FLAG_WRITE);	
 	kill_fasync(&(xvp->reporter->fasync), SIGIO, POLL_IN);
-	xrp_comm_write32(&cmd->report_id,0x0);
-    // pr_debug("%s,report_id:%d,report_data:%x\n",__func__,p_buf->report_id,p_buf->data[0]);
 }
 static long xrp_map_phy_to_virt(phys_addr_t paddr,unsigned long size,__u64 *vaddr)
 {
@@ -823,7 +887,11 @@ static long xrp_ioctl_alloc_report(struct file *filp,
 		struct xvp *xvp = xvp_file->xvp;
 		struct xrp_ioctl_alloc xrp_ioctl_alloc;
 		struct xrp_dsp_cmd __iomem *cmd=xvp->comm;
+		struct xrp_report_ring __iomem *ring;
+		struct xrp_reporter *reporter;
+		size_t entry_size, entry_offset, slot_offset;
 		unsigned long vaddr;
+		int depth;
 		long err;
 
 		pr_debug("%s: %p\n", __func__, p);
@@ -836,17 +904,36 @@ static long xrp_ioctl_alloc_report(struct file *filp,
 		// {
 		// 	return -EFAULT;
 		// }
-		xvp->reporter= kmalloc(sizeof(*(xvp->reporter)), GFP_KERNEL);
-		if (!xvp->reporter)
+		depth = xrp_ioctl_alloc.align ? xrp_ioctl_alloc.align : report_ring_depth;
+		if (depth <= 0 || depth > XRP_REPORT_RING_DEPTH_MAX ||
+		    !xrp_ioctl_alloc.size)
+			return -EINVAL;
+		depth = roundup_pow_of_two(depth);
+		entry_size = ALIGN(offsetof(struct xrp_report_buffer, data) +
+				   xrp_ioctl_alloc.size, 8);
+		entry_offset = ALIGN(sizeof(struct xrp_report_ring), 8);
+		slot_offset = entry_offset + depth * entry_size;
+
+		reporter = kzalloc(sizeof(*reporter), GFP_KERNEL);
+		if (!reporter)
 			return -EFAULT;
+		/* the DSP has a single report slot, one reporter per device */
+		if (cmpxchg(&xvp->reporter, NULL, reporter)) {
+			kfree(reporter);
+			return -EBUSY;
+		}
 		xvp->reporter->fasync=NULL;
+		xvp->reporter->filp = filp;
 		err = xrp_allocate(xvp_file->xvp->pool,
-			xrp_ioctl_alloc.size,
-			xrp_ioctl_alloc.align,
+			slot_offset + ALIGN(xrp_ioctl_alloc.size, 8),
+			0,
 			&xrp_allocation);
 
-		if (err)
+		if (err) {
+			kfree(xvp->reporter);
+			xvp->reporter = NULL;
 			return err;
+		}
 		xrp_allocation_queue(xvp_file, xrp_allocation);
 
 		vaddr = vm_mmap(filp, 0, xrp_allocation->size,
@@ -855,15 +942,28 @@ static long xrp_ioctl_alloc_report(struct file *filp,
 		xrp_ioctl_alloc.addr=vaddr;		
 		xvp->reporter->buffer_phys = xrp_allocation->start;
 
-		if(xrp_map_phy_to_virt(xvp->reporter->buffer_phys,sizeof(__u32),&xvp->reporter->buffer_virt))
+		xvp->reporter->map_size = xrp_allocation->size;
+		if(xrp_map_phy_to_virt(xvp->reporter->buffer_phys,xvp->reporter->map_size,&xvp->reporter->buffer_virt))
 		{
 			pr_debug("%s: map to kernel virt fail\n", __func__);
 			kfree(xvp->reporter);
+			xvp->reporter = NULL;
 			return -EFAULT;
 		}
+		ring = (void __iomem *)xvp->reporter->buffer_virt;
+		xvp->reporter->entries = (void __iomem *)ring + entry_offset;
+		xvp->reporter->dsp_slot = (void __iomem *)ring + slot_offset;
+		xvp->reporter->mask = depth - 1;
+		xvp->reporter->entry_size = entry_size;
+		xrp_comm_write32(&ring->head, 0);
+		xrp_comm_write32(&ring->tail, 0);
+		xrp_comm_write32(&ring->mask, depth - 1);
+		xrp_comm_write32(&ring->dropped, 0);
+		xrp_comm_write32(&ring->entry_size, entry_size);
+		xrp_comm_write32(&ring->entry_offset, entry_offset);
 
 		xrp_comm_write32(&cmd->report_addr, 
-					xrp_translate_to_dsp(&xvp->address_map,xvp->reporter->buffer_phys+sizeof(__u32)));
+					xrp_translate_to_dsp(&xvp->address_map,xvp->reporter->buffer_phys+slot_offset));
 		unsigned int dsp_addr = xrp_comm_read32(&cmd->report_addr);		
 		pr_debug("%s: alloc_report buffer user virt:%llx,kernel virt:%lx, phys:%llx,dsp_addr:%x,size:%d\n", __func__,
 					vaddr,xvp->reporter->buffer_virt,xvp->reporter->buffer_phys,dsp_addr,xrp_allocation->size);
@@ -893,14 +993,16 @@ static long xrp_ioctl_alloc_report(struct file *filp,
 		// }
         /*save the user addr ,which kernel copy the report to */
 		// xvp->reporter->user_buffer_virt = xrp_ioctl_alloc.addr;	
-		xvp->reporter->buffer_size = xrp_ioctl_alloc.size;
-		xrp_comm_write32(&cmd->report_buffer_size,xvp->reporter->buffer_size);
+		xvp->reporter->buffer_size = ALIGN(xrp_ioctl_alloc.size, sizeof(__u32));
+		xrp_comm_write32(&cmd->report_buffer_size,xrp_ioctl_alloc.size);
 		xrp_comm_write32(&cmd->report_status,XRP_DSP_REPORT_WORKING);
 		xrp_comm_write32(&cmd->report_id,0);
 		tasklet_init(&xvp->reporter->report_task,xrp_report_tasklet,(unsigned long)xvp);
 		if (copy_to_user(p, &xrp_ioctl_alloc, sizeof(*p))) {
-			vm_munmap(vaddr, xrp_ioctl_alloc.size);
+			vm_munmap(vaddr, xrp_allocation->size);
+			iounmap((void __iomem *)xvp->reporter->buffer_virt);
 			kfree(xvp->reporter);
+			xvp->reporter = NULL;
 			pr_debug("%s: copy to user fail\n", __func__);
 			return -EFAULT;
 		}
@@ -943,6 +1045,8 @@ static long xrp_ioctl_release_report(struct file *filp,
 	unsigned long start;
 	struct xrp_dsp_cmd __iomem *cmd=xvp->comm;
 
+	if (!xvp->reporter || xvp->reporter->filp != filp)
+		return -EINVAL;
 	tasklet_kill(&xvp->reporter->report_task);
 	xrp_comm_write32(&cmd->report_status,XRP_DSP_REPORT_INVALID);
 
@@ -984,6 +1088,7 @@ static long xrp_ioctl_release_report(struct file *filp,
 	}
 
 	xrp_report_fasync_release(filp);	
+	iounmap((void __iomem *)xvp->reporter->buffer_virt);
 	kfree(xvp->reporter);
 	xvp->reporter =NULL;
 	
@@ -1395,7 +1500,7 @@ static bool vma_needs_cache_ops(struct vm_area_struct *vma)
 static long __xrp_share_block(struct file *filp,
 			      unsigned long virt, unsigned long size,
 			      unsigned long flags, phys_addr_t *paddr,
-			      struct xrp_mapping *mapping)
+			      struct xrp_mapping *mapping, bool *cached)
 {
 	phys_addr_t phys = ~0ul;
 	struct xvp_file *xvp_file = filp->private_data;
@@ -1557,6 +1662,8 @@ static long __xrp_share_block(struct file *filp,
 		xrp_dma_sync_for_device(xvp,
 					virt, phys, size,
 					flags);
+	if (cached)
+		*cached = do_cache;
 	return 0;
 }
 
@@ -1604,6 +1711,9 @@ static long xrp_writeback_alien_mapping(struct xvp_file *xvp_file,
 	return ret;
 }
 
+static void xrp_put_registered_buffer(struct xrp_registered_buffer *reg,
+				      unsigned long flags);
+
 /*
  *
  */
@@ -1645,6 +1755,10 @@ static long __xrp_unshare_block(struct file *filp, struct xrp_mapping *mapping,
 		xrp_alien_mapping_destroy(&mapping->alien_mapping);
 		break;
 
+	case XRP_MAPPING_REGISTERED:
+		xrp_put_registered_buffer(mapping->registered, flags);
+		break;
+
 	case XRP_MAPPING_KERNEL:
 		break;
 
@@ -1664,6 +1778,247 @@ static long __xrp_unshare_block(struct file *filp, struct xrp_mapping *mapping,
 	return ret;
 }
 
+#define XRP_REGISTER_BUFFERS_MAX	64
+
+static void xrp_registered_buffer_free(struct kref *ref)
+{
+	struct xrp_registered_buffer *reg =
+		container_of(ref, struct xrp_registered_buffer, ref);
+
+	__xrp_unshare_block(reg->filp, &reg->mapping, reg->flags);
+	kfree(reg);
+}
+
+/* Drop request reference, flags are the access flags of that request */
+static void xrp_put_registered_buffer(struct xrp_registered_buffer *reg,
+				      unsigned long flags)
+{
+	if ((flags & XRP_FLAG_WRITE) && reg->do_cache) {
+		struct xvp_file *xvp_file = reg->filp->private_data;
+
+		xrp_dma_sync_for_cpu(xvp_file->xvp, reg->vaddr, reg->phys,
+				     reg->size, flags);
+	}
+	kref_put(&reg->ref, xrp_registered_buffer_free);
+}
+
+/*
+ * Resolve XRP_FLAG_REGISTERED buffer of a request. Only cache maintenance
+ * is left to do here, the memory is pinned and translated already.
+ */
+static long xrp_use_registered_buffer(struct file *filp,
+				      struct xrp_ioctl_buffer *ioctl_buffer,
+				      phys_addr_t *paddr,
+				      struct xrp_mapping *mapping)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	unsigned long access = ioctl_buffer->flags & XRP_FLAG_READ_WRITE;
+	struct xrp_registered_buffer *reg = NULL;
+
+	if (ioctl_buffer->addr > INT_MAX)
+		return -EINVAL;
+
+	spin_lock(&xvp_file->registered_lock);
+	reg = idr_find(&xvp_file->registered, ioctl_buffer->addr);
+	if (reg)
+		kref_get(&reg->ref);
+	spin_unlock(&xvp_file->registered_lock);
+	if (!reg)
+		return -EINVAL;
+
+	if ((access & ~reg->flags) ||
+	    (ioctl_buffer->size && ioctl_buffer->size != reg->size)) {
+		xrp_put_registered_buffer(reg, 0);
+		return -EINVAL;
+	}
+	if (access && reg->do_cache)
+		xrp_dma_sync_for_device(xvp_file->xvp, reg->vaddr, reg->phys,
+					reg->size, access);
+
+	mapping->type = XRP_MAPPING_REGISTERED;
+	mapping->registered = reg;
+	ioctl_buffer->size = reg->size;
+	*paddr = reg->phys;
+	return 0;
+}
+
+static long xrp_register_buffer(struct file *filp,
+				struct xrp_ioctl_buffer *ioctl_buffer,
+				struct xrp_registered_buffer **preg)
+{
+	struct mm_struct *mm = current->mm;
+	struct xrp_registered_buffer *reg;
+	long ret;
+
+	if (!(ioctl_buffer->flags & XRP_FLAG_READ_WRITE) ||
+	    !ioctl_buffer->size)
+		return -EINVAL;
+
+	reg = kzalloc(sizeof(*reg), GFP_KERNEL);
+	if (!reg)
+		return -ENOMEM;
+	kref_init(&reg->ref);
+	reg->filp = filp;
+	reg->vaddr = ioctl_buffer->addr;
+	reg->size = ioctl_buffer->size;
+	reg->flags = ioctl_buffer->flags & XRP_FLAG_READ_WRITE;
+
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	down_read(&mm->mmap_sem);
+	#else
+	down_read(&mm->mmap_lock);
+	#endif
+	ret = __xrp_share_block(filp, reg->vaddr, reg->size, reg->flags,
+				&reg->phys, &reg->mapping, &reg->do_cache);
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+	up_read(&mm->mmap_sem);
+	#else
+	up_read(&mm->mmap_lock);
+	#endif
+	if (ret < 0) {
+		kfree(reg);
+		return ret;
+	}
+
+	/*
+	 * A shadow copy would have to be refreshed for every request, and
+	 * a PFN mapping holds no page references: once the user unmaps it
+	 * the memory may go elsewhere while the handle still names it.
+	 */
+	if (reg->mapping.type == XRP_MAPPING_ALIEN &&
+	    (reg->mapping.alien_mapping.type == ALIEN_COPY ||
+	     reg->mapping.alien_mapping.type == ALIEN_PFN_MAP)) {
+		pr_debug("%s: 0x%08lx can't be pinned, not registered\n",
+			 __func__, reg->vaddr);
+		__xrp_unshare_block(filp, &reg->mapping, 0);
+		kfree(reg);
+		return -EINVAL;
+	}
+	*preg = reg;
+	return 0;
+}
+
+static long xrp_ioctl_register_buffers(struct file *filp,
+				       struct xrp_ioctl_register_buffers __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ioctl_register_buffers arg;
+	struct xrp_ioctl_buffer __user *buffer;
+	struct xrp_registered_buffer **reg;
+	u32 *handle;
+	u32 i, n_idr = 0;
+	long ret = 0;
+
+	if (copy_from_user(&arg, p, sizeof(arg)))
+		return -EFAULT;
+	if (!arg.n_buffers || arg.n_buffers > XRP_REGISTER_BUFFERS_MAX)
+		return -EINVAL;
+
+	reg = kcalloc(arg.n_buffers, sizeof(*reg), GFP_KERNEL);
+	handle = kcalloc(arg.n_buffers, sizeof(*handle), GFP_KERNEL);
+	if (!reg || !handle) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	buffer = (void __user *)(unsigned long)arg.buffer_addr;
+	for (i = 0; i < arg.n_buffers; ++i) {
+		struct xrp_ioctl_buffer ioctl_buffer;
+
+		if (copy_from_user(&ioctl_buffer, buffer + i,
+				   sizeof(ioctl_buffer))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		ret = xrp_register_buffer(filp, &ioctl_buffer, reg + i);
+		if (ret < 0) {
+			pr_debug("%s: buffer %u could not be registered\n",
+				 __func__, i);
+			goto out;
+		}
+	}
+
+	for (n_idr = 0; n_idr < arg.n_buffers; ++n_idr) {
+		int id;
+
+		idr_preload(GFP_KERNEL);
+		spin_lock(&xvp_file->registered_lock);
+		id = idr_alloc(&xvp_file->registered, reg[n_idr], 1, 0,
+			       GFP_NOWAIT);
+		spin_unlock(&xvp_file->registered_lock);
+		idr_preload_end();
+		if (id < 0) {
+			ret = id;
+			goto out;
+		}
+		handle[n_idr] = id;
+	}
+
+	if (copy_to_user((void __user *)(unsigned long)arg.handle_addr,
+			 handle, arg.n_buffers * sizeof(*handle)))
+		ret = -EFAULT;
+out:
+	if (ret < 0 && reg) {
+		spin_lock(&xvp_file->registered_lock);
+		for (i = 0; i < n_idr; ++i)
+			idr_remove(&xvp_file->registered, handle[i]);
+		spin_unlock(&xvp_file->registered_lock);
+		for (i = 0; i < arg.n_buffers && reg[i]; ++i)
+			kref_put(&reg[i]->ref, xrp_registered_buffer_free);
+	}
+	kfree(handle);
+	kfree(reg);
+	return ret;
+}
+
+static long xrp_ioctl_unregister_buffers(struct file *filp,
+					 struct xrp_ioctl_register_buffers __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ioctl_register_buffers arg;
+	u32 __user *handle;
+	u32 i;
+	long ret = 0;
+
+	if (copy_from_user(&arg, p, sizeof(arg)))
+		return -EFAULT;
+	if (arg.n_buffers > XRP_REGISTER_BUFFERS_MAX)
+		return -EINVAL;
+
+	handle = (void __user *)(unsigned long)arg.handle_addr;
+	for (i = 0; i < arg.n_buffers; ++i) {
+		struct xrp_registered_buffer *reg = NULL;
+		u32 id;
+
+		if (get_user(id, handle + i)) {
+			ret = -EFAULT;
+			break;
+		}
+		spin_lock(&xvp_file->registered_lock);
+		if (id <= INT_MAX)
+			reg = idr_remove(&xvp_file->registered, id);
+		spin_unlock(&xvp_file->registered_lock);
+		if (!reg) {
+			ret = -EINVAL;
+			continue;
+		}
+		/* in-flight requests keep it until they complete */
+		kref_put(&reg->ref, xrp_registered_buffer_free);
+	}
+	return ret;
+}
+
+static void xrp_registered_release(struct file *filp)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_registered_buffer *reg;
+	int id;
+
+	idr_for_each_entry(&xvp_file->registered, reg, id)
+		kref_put(&reg->ref, xrp_registered_buffer_free);
+	idr_destroy(&xvp_file->registered);
+}
+
 static long xrp_ioctl_free(struct file *filp,
 			   struct xrp_ioctl_alloc __user *p)
 {
@@ -1848,18 +2203,15 @@ static long xrp_unmap_request(struct file *filp, struct xrp_request *rq)
 	return ret;
 }
 
-static long xrp_map_request(struct file *filp, struct xrp_request *rq,
-			    struct mm_struct *mm)
+/*
+ * First half of xrp_map_request: everything that does not need mmap lock.
+ * Nothing is left allocated when it fails.
+ */
+static long xrp_prepare_request(struct file *filp, struct xrp_request *rq)
 {
-	struct xvp_file *xvp_file = filp->private_data;
-	struct xvp *xvp = xvp_file->xvp;
-	struct xrp_ioctl_buffer __user *buffer;
 	size_t n_buffers = rq->ioctl_queue.buffer_size /
 						sizeof(struct xrp_ioctl_buffer);
 
-	size_t i;
-	long ret = 0;
-
 	if ((rq->ioctl_queue.flags & XRP_QUEUE_FLAG_NSID) &&
 	    copy_from_user(rq->nsid,
 			   (void __user *)(unsigned long)rq->ioctl_queue.nsid_addr,
@@ -1872,6 +2224,8 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 		rq->buffer_mapping =
 			kzalloc(n_buffers * sizeof(*rq->buffer_mapping),
 				GFP_KERNEL);
+		if (!rq->buffer_mapping)
+			return -ENOMEM;
 		if (n_buffers > XRP_DSP_CMD_INLINE_BUFFER_COUNT) {
 			rq->dsp_buffer =
 				kmalloc(n_buffers * sizeof(*rq->dsp_buffer),
@@ -1884,17 +2238,27 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 			rq->dsp_buffer = rq->buffer_data;
 		}
 	}
-	#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)	
-	down_read(&mm->mmap_sem);
-	#else
-	down_read(&mm->mmap_lock);
-	#endif
+	return 0;
+}
+
+/*
+ * Second half of xrp_map_request, called with mmap lock held for reading.
+ * On failure the caller is responsible for xrp_unmap_request_nowb.
+ */
+static long __xrp_map_request(struct file *filp, struct xrp_request *rq)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_ioctl_buffer __user *buffer;
+	size_t n_buffers = rq->n_buffers;
+	size_t i;
+	long ret = 0;
 
 	if (rq->ioctl_queue.in_data_size > XRP_DSP_CMD_INLINE_DATA_SIZE) {
 		ret = __xrp_share_block(filp, rq->ioctl_queue.in_data_addr,
 					rq->ioctl_queue.in_data_size,
 					XRP_FLAG_READ, &rq->in_data_phys,
-					&rq->in_data_mapping);
+					&rq->in_data_mapping, NULL);
 		if(ret < 0) {
 			pr_debug("%s: in_data could not be shared\n",
 				 __func__);
@@ -1915,7 +2279,7 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 		ret = __xrp_share_block(filp, rq->ioctl_queue.out_data_addr,
 					rq->ioctl_queue.out_data_size,
 					XRP_FLAG_WRITE, &rq->out_data_phys,
-					&rq->out_data_mapping);
+					&rq->out_data_mapping, NULL);
 		if (ret < 0) {
 			pr_debug("%s: out_data could not be shared\n",
 				 __func__);
@@ -1934,12 +2298,21 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 			ret = -EFAULT;
 			goto share_err;
 		}
-		if (ioctl_buffer.flags & XRP_FLAG_READ_WRITE) {
+		if (ioctl_buffer.flags & XRP_FLAG_REGISTERED) {
+			ret = xrp_use_registered_buffer(filp, &ioctl_buffer,
+							&buffer_phys,
+							rq->buffer_mapping + i);
+			if (ret < 0) {
+				pr_debug("%s: buffer %zd bad handle %llu\n",
+					 __func__, i, ioctl_buffer.addr);
+				goto share_err;
+			}
+		} else if (ioctl_buffer.flags & XRP_FLAG_READ_WRITE) {
 			ret = __xrp_share_block(filp, ioctl_buffer.addr,
 						ioctl_buffer.size,
 						ioctl_buffer.flags,
 						&buffer_phys,
-						rq->buffer_mapping + i);
+						rq->buffer_mapping + i, NULL);
 			if (ret < 0) {
 				pr_debug("%s: buffer %zd could not be shared\n",
 					 __func__, i);
@@ -1948,7 +2321,7 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 		}
 
 		rq->dsp_buffer[i] = (struct xrp_dsp_buffer){
-			.flags = ioctl_buffer.flags,
+			.flags = ioctl_buffer.flags & XRP_FLAG_READ_WRITE,
 			.size = ioctl_buffer.size,
 			.addr = xrp_translate_to_dsp(&xvp->address_map,
 						     buffer_phys),
@@ -1967,6 +2340,22 @@ static long xrp_map_request(struct file *filp, struct xrp_request *rq,
 		}
 	}
 share_err:
+	return ret;
+}
+
+static long xrp_map_request(struct file *filp, struct xrp_request *rq,
+			    struct mm_struct *mm)
+{
+	long ret = xrp_prepare_request(filp, rq);
+
+	if (ret < 0)
+		return ret;
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)	
+	down_read(&mm->mmap_sem);
+	#else
+	down_read(&mm->mmap_lock);
+	#endif
+	ret = __xrp_map_request(filp, rq);
 	#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)	
 	up_read(&mm->mmap_sem);
 	#else
@@ -2040,27 +2429,12 @@ static long xrp_complete_hw_request(struct xrp_dsp_cmd __iomem *cmd,
 	return (flags & XRP_DSP_CMD_FLAG_RESPONSE_DELIVERY_FAIL) ? -ENXIO : 0;
 }
 
-static long xrp_ioctl_submit_sync(struct file *filp,
-				  struct xrp_ioctl_queue __user *p)
+static struct xrp_comm *xrp_select_queue(struct xvp *xvp, __u32 flags)
 {
-	struct xvp_file *xvp_file = filp->private_data;
-	struct xvp *xvp = xvp_file->xvp;
 	struct xrp_comm *queue = xvp->queue;
-	struct xrp_request xrp_rq, *rq = &xrp_rq;
-	long ret = 0;
-	bool went_off = false;
-
-	if (copy_from_user(&rq->ioctl_queue, p, sizeof(*p)))
-		return -EFAULT;
-
-	if (rq->ioctl_queue.flags & ~XRP_QUEUE_VALID_FLAGS) {
-		dev_dbg(xvp->dev, "%s: invalid flags 0x%08x\n",
-			__func__, rq->ioctl_queue.flags);
-		return -EINVAL;
-	}
 
 	if (xvp->n_queues > 1) {
-		unsigned n = (rq->ioctl_queue.flags & XRP_QUEUE_FLAG_PRIO) >>
+		unsigned n = (flags & XRP_QUEUE_FLAG_PRIO) >>
 			XRP_QUEUE_FLAG_PRIO_SHIFT;
 
 		if (n >= xvp->n_queues)
@@ -2069,10 +2443,18 @@ static long xrp_ioctl_submit_sync(struct file *filp,
 		dev_dbg(xvp->dev, "%s: priority: %d -> %d\n",
 			__func__, n, queue->priority);
 	}
+	return queue;
+}
 
-	ret = xrp_map_request(filp, rq, current->mm);
-	if (ret < 0)
-		return ret;
+/*
+ * Pass a mapped request to the DSP through the hardware queue and wait for
+ * its completion. *went_off is set when the DSP could not be recovered and
+ * the request buffers must not be touched anymore.
+ */
+static long xrp_submit_hw_request(struct xvp *xvp, struct xrp_comm *queue,
+				  struct xrp_request *rq, bool *went_off)
+{
+	long ret = 0;
 
 	if (loopback < LOOPBACK_NOIO) {
 		int reboot_cycle;
@@ -2124,13 +2506,18 @@ retry:
 						mutex_unlock(&xvp->queue[i].lock);
 				if (rc < 0) {
 					ret = rc;
-					went_off = xvp->off;
+					*went_off = xvp->off;
 				}
 			}
 		}
 		mutex_unlock(&queue->lock);
 	}
+	return ret;
+}
 
+static long xrp_finish_request(struct file *filp, struct xrp_request *rq,
+			       long ret, bool went_off)
+{
 	if (ret == 0)
 		ret = xrp_unmap_request(filp, rq);
 	else if (!went_off)
@@ -2141,31 +2528,605 @@ retry:
 	 * going on with the DSP; the DSP may still be reading and writing
 	 * this memory.
 	 */
-
 	return ret;
 }
-// static void xrp_dam_buf_free(struct xrp_allocation *xrp_allocation) 
-// {
-//     dev_dbg(xvp->dev,"%s: release dma_buf allocation n",
-// 					 __func__);
-//     kfree(xrp_allocation->pool);
-//     kfree(xrp_allocation);
-//     return
-// }
 
-// static void xrp_dam_buf_offset(struct xrp_allocation *xrp_allocation)
-// {
-//     return 0;
-// }
-// static const struct xrp_allocation_ops xrp_dma_buf_pool_ops = {
-// 	.alloc = NULL,
-// 	.free = xrp_dam_buf_free,
-// 	.free_pool = NULL,
-// 	.offset = xrp_dam_buf_offset,
-// };
+static long xrp_ioctl_submit_sync(struct file *filp,
+				  struct xrp_ioctl_queue __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_comm *queue;
+	struct xrp_request xrp_rq, *rq = &xrp_rq;
+	long ret = 0;
+	bool went_off = false;
 
-// static inline struct xrp_dma_buf_item * xrp_get_dma_buf_tail(struct xrp_dma_buf_item **list)
-// {
+	if (copy_from_user(&rq->ioctl_queue, p, sizeof(*p)))
+		return -EFAULT;
+
+	if (rq->ioctl_queue.flags & ~XRP_QUEUE_VALID_FLAGS) {
+		dev_dbg(xvp->dev, "%s: invalid flags 0x%08x\n",
+			__func__, rq->ioctl_queue.flags);
+		return -EINVAL;
+	}
+
+	queue = xrp_select_queue(xvp, rq->ioctl_queue.flags);
+
+	ret = xrp_map_request(filp, rq, current->mm);
+	if (ret < 0)
+		return ret;
+
+	ret = xrp_submit_hw_request(xvp, queue, rq, &went_off);
+
+	return xrp_finish_request(filp, rq, ret, went_off);
+}
+
+/*
+ * Run a vector of commands with a single syscall, passed to the DSP in
+ * order. Each request is mapped right before it runs and unmapped right
+ * after, so bounce buffers see what earlier commands wrote. Per-command
+ * results are stored in the status array as the commands complete, the
+ * ioctl itself fails when the batch descriptor can't be processed or a
+ * result can't be stored, commands not started are left at
+ * XRP_QUEUE_BATCH_NOT_RUN.
+ */
+static long xrp_ioctl_submit_batch(struct file *filp,
+				   struct xrp_ioctl_queue_batch __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_ioctl_queue_batch batch;
+	struct xrp_ioctl_queue __user *ioctl_queue;
+	__s32 __user *status;
+	struct xrp_request *rq = NULL;
+	size_t i;
+	long ret = 0;
+
+	if (copy_from_user(&batch, p, sizeof(*p)))
+		return -EFAULT;
+
+	if (!batch.n_queues || batch.n_queues > XRP_QUEUE_BATCH_MAX) {
+		dev_dbg(xvp->dev, "%s: invalid batch size %u\n",
+			__func__, batch.n_queues);
+		return -EINVAL;
+	}
+
+	rq = kcalloc(batch.n_queues, sizeof(*rq), GFP_KERNEL);
+	if (!rq)
+		return -ENOMEM;
+
+	ioctl_queue = (void __user *)(unsigned long)batch.queue_addr;
+	status = (void __user *)(unsigned long)batch.status_addr;
+	for (i = 0; i < batch.n_queues; ++i) {
+		if (copy_from_user(&rq[i].ioctl_queue, ioctl_queue + i,
+				   sizeof(*ioctl_queue)) ||
+		    put_user(XRP_QUEUE_BATCH_NOT_RUN, status + i)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (rq[i].ioctl_queue.flags & ~XRP_QUEUE_VALID_FLAGS) {
+			dev_dbg(xvp->dev, "%s: invalid flags 0x%08x\n",
+				__func__, rq[i].ioctl_queue.flags);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < batch.n_queues; ++i) {
+		bool went_off = false;
+		long rc;
+
+		rc = xrp_map_request(filp, rq + i, current->mm);
+		if (rc == 0) {
+			rc = xrp_submit_hw_request(xvp,
+						   xrp_select_queue(xvp,
+								    rq[i].ioctl_queue.flags),
+						   rq + i, &went_off);
+			rc = xrp_finish_request(filp, rq + i, rc, went_off);
+		}
+		if (put_user((__s32)rc, status + i)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+out:
+	kfree(rq);
+	return ret;
+}
+struct xrp_async_request {
+	struct list_head link;
+	struct xrp_comm *queue;
+	u64 seq;
+	long ret;
+	bool went_off;
+	struct xrp_request rq;
+};
+
+struct xrp_ring {
+	struct xrp_ring_header *hdr;
+	struct xrp_ring_sqe *sqe;
+	struct xrp_ring_cqe *cqe;
+	size_t size;
+	u32 sq_entries;
+	u32 cq_entries;
+	u32 flags;
+	unsigned long idle;
+	bool mmap_pending;
+	bool kick;
+	/* private copies, the header is writable by user space */
+	u32 sq_head;
+	u32 cq_tail;
+	struct mm_struct *mm;
+	struct task_struct *thread;
+	wait_queue_head_t wait;
+	struct xrp_request rq;
+};
+
+/*
+ * Runs queued async requests on the DSP one at a time, in submission order.
+ * Unmapping is left to the reader because copying results back needs the
+ * submitter's mm.
+ */
+static void xrp_async_work(struct work_struct *work)
+{
+	struct xvp_file *xvp_file = container_of(work, struct xvp_file,
+						 async_work);
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_async_request *arq;
+
+	for (;;) {
+		spin_lock(&xvp_file->async_lock);
+		arq = list_first_entry_or_null(&xvp_file->async_pending,
+					       struct xrp_async_request, link);
+		if (arq)
+			list_del(&arq->link);
+		spin_unlock(&xvp_file->async_lock);
+		if (!arq)
+			break;
+
+		arq->ret = xrp_submit_hw_request(xvp, arq->queue, &arq->rq,
+						 &arq->went_off);
+
+		spin_lock(&xvp_file->async_lock);
+		list_add_tail(&arq->link, &xvp_file->async_done);
+		spin_unlock(&xvp_file->async_lock);
+		wake_up_interruptible(&xvp_file->async_wait);
+	}
+}
+
+/*
+ * Map the request and hand it to the async worker. The sequence number
+ * returned in the argument identifies the completion record read from the
+ * file later; numbers are consecutive and completions arrive in order.
+ */
+static long xrp_ioctl_submit_async(struct file *filp,
+				   struct xrp_ioctl_queue_async __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_async_request *arq;
+	long ret;
+
+	arq = kzalloc(sizeof(*arq), GFP_KERNEL);
+	if (!arq)
+		return -ENOMEM;
+
+	if (copy_from_user(&arq->rq.ioctl_queue, &p->queue,
+			   sizeof(p->queue))) {
+		ret = -EFAULT;
+		goto err;
+	}
+
+	if (arq->rq.ioctl_queue.flags & ~XRP_QUEUE_VALID_FLAGS) {
+		dev_dbg(xvp->dev, "%s: invalid flags 0x%08x\n",
+			__func__, arq->rq.ioctl_queue.flags);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	arq->queue = xrp_select_queue(xvp, arq->rq.ioctl_queue.flags);
+
+	ret = xrp_map_request(filp, &arq->rq, current->mm);
+	if (ret < 0)
+		goto err;
+
+	/*
+	 * The sequence number is written back before the request is
+	 * published: once on async_pending its completion will be delivered,
+	 * and the caller must not free a request it was told failed.
+	 * Holding async_submit_lock keeps async_pending in seq order.
+	 */
+	mutex_lock(&xvp_file->async_submit_lock);
+	arq->seq = xvp_file->async_seq;
+	if (put_user(arq->seq, &p->seq)) {
+		mutex_unlock(&xvp_file->async_submit_lock);
+		xrp_unmap_request_nowb(filp, &arq->rq);
+		ret = -EFAULT;
+		goto err;
+	}
+	spin_lock(&xvp_file->async_lock);
+	xvp_file->async_seq++;
+	list_add_tail(&arq->link, &xvp_file->async_pending);
+	spin_unlock(&xvp_file->async_lock);
+	mutex_unlock(&xvp_file->async_submit_lock);
+
+	queue_work(system_unbound_wq, &xvp_file->async_work);
+	return 0;
+err:
+	kfree(arq);
+	return ret;
+}
+
+static ssize_t xvp_read(struct file *filp, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ioctl_completion __user *completion = (void __user *)buf;
+	size_t n = count / sizeof(*completion);
+	size_t i;
+
+	if (!n)
+		return -EINVAL;
+
+	spin_lock(&xvp_file->async_lock);
+	while (list_empty(&xvp_file->async_done)) {
+		long rc;
+
+		spin_unlock(&xvp_file->async_lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		rc = wait_event_interruptible(xvp_file->async_wait,
+					      !list_empty(&xvp_file->async_done));
+		if (rc)
+			return rc;
+		spin_lock(&xvp_file->async_lock);
+	}
+
+	for (i = 0; i < n; ++i) {
+		struct xrp_async_request *arq;
+		struct xrp_ioctl_completion c;
+
+		arq = list_first_entry_or_null(&xvp_file->async_done,
+					       struct xrp_async_request, link);
+		if (!arq)
+			break;
+		list_del(&arq->link);
+		spin_unlock(&xvp_file->async_lock);
+
+		c = (struct xrp_ioctl_completion){
+			.seq = arq->seq,
+			.status = xrp_finish_request(filp, &arq->rq, arq->ret,
+						     arq->went_off),
+		};
+		kfree(arq);
+		if (copy_to_user(completion + i, &c, sizeof(c)))
+			return i ? i * sizeof(*completion) : -EFAULT;
+
+		spin_lock(&xvp_file->async_lock);
+	}
+	spin_unlock(&xvp_file->async_lock);
+
+	return i * sizeof(*completion);
+}
+
+static __poll_t xvp_poll(struct file *filp, poll_table *wait)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_reporter *reporter;
+	struct xrp_ring *ring;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &xvp_file->async_wait, wait);
+
+	spin_lock(&xvp_file->async_lock);
+	if (!list_empty(&xvp_file->async_done))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock(&xvp_file->async_lock);
+
+	/*
+	 * Ring completions are not read(), keep them off EPOLLRDNORM so a
+	 * blocking reader can poll for async completions alone.
+	 */
+	ring = smp_load_acquire(&xvp_file->ring);
+	if (ring && READ_ONCE(ring->hdr->cq_head) != READ_ONCE(ring->cq_tail))
+		mask |= EPOLLIN | EPOLLRDBAND;
+
+	/* queued reports are signalled as priority data */
+	poll_wait(filp, &xvp_file->xvp->report_wait, wait);
+	reporter = READ_ONCE(xvp_file->xvp->reporter);
+	if (reporter && reporter->filp == filp &&
+	    xrp_comm_read32(&((struct xrp_report_ring __iomem *)
+			      reporter->buffer_virt)->tail) != reporter->head)
+		mask |= EPOLLPRI;
+	return mask;
+}
+
+static void xrp_async_release(struct file *filp)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_async_request *arq, *tmp;
+
+	/* pending requests are run to completion by the work */
+	flush_work(&xvp_file->async_work);
+
+	list_for_each_entry_safe(arq, tmp, &xvp_file->async_done, link) {
+		list_del(&arq->link);
+		if (!arq->went_off)
+			xrp_unmap_request_nowb(filp, &arq->rq);
+		kfree(arq);
+	}
+}
+
+static void xrp_ring_post(struct xvp_file *xvp_file, struct xrp_ring *ring,
+			  u64 user_data, long status)
+{
+	u32 tail = ring->cq_tail;
+
+	/* user space keeps no more than cq_entries in flight, so rarely hit */
+	while (tail - READ_ONCE(ring->hdr->cq_head) >= ring->cq_entries &&
+	       !kthread_should_stop())
+		msleep(1);
+
+	ring->cqe[tail & (ring->cq_entries - 1)] = (struct xrp_ring_cqe){
+		.user_data = user_data,
+		.status = status,
+	};
+	ring->cq_tail = tail + 1;
+	smp_store_release(&ring->hdr->cq_tail, ring->cq_tail);
+	wake_up_interruptible(&xvp_file->async_wait);
+}
+
+static void xrp_ring_run(struct file *filp, struct xrp_ring *ring,
+			 const struct xrp_ring_sqe *sqe, bool have_mm)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_request *rq = &ring->rq;
+	bool went_off = false;
+	long ret;
+
+	memset(rq, 0, sizeof(*rq));
+	rq->ioctl_queue = sqe->queue;
+	if (!have_mm) {
+		ret = -ESRCH;
+	} else if (rq->ioctl_queue.flags & ~XRP_QUEUE_VALID_FLAGS) {
+		ret = -EINVAL;
+	} else {
+		ret = xrp_map_request(filp, rq, ring->mm);
+		if (ret == 0) {
+			ret = xrp_submit_hw_request(xvp,
+						    xrp_select_queue(xvp,
+								     rq->ioctl_queue.flags),
+						    rq, &went_off);
+			ret = xrp_finish_request(filp, rq, ret, went_off);
+		}
+	}
+	xrp_ring_post(xvp_file, ring, sqe->user_data, ret);
+}
+
+/*
+ * Consumes SQEs in the context of the ring owner mm. Without
+ * XRP_RING_SETUP_SQPOLL it sleeps until kicked by XRP_IOCTL_RING_ENTER,
+ * with it it keeps polling sq_tail for ring->idle before going to sleep
+ * and raising XRP_RING_SQ_NEED_WAKEUP.
+ */
+static int xrp_ring_thread(void *arg)
+{
+	struct file *filp = arg;
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ring *ring = xvp_file->ring_pending;
+	struct xrp_ring_header *hdr = ring->hdr;
+	unsigned long idle_until = jiffies + ring->idle;
+	bool have_mm = false;
+	bool used_mm = false;
+
+	while (!kthread_should_stop()) {
+		u32 head = ring->sq_head;
+		struct xrp_ring_sqe sqe;
+
+		if (head == smp_load_acquire(&hdr->sq_tail)) {
+			if ((ring->flags & XRP_RING_SETUP_SQPOLL) &&
+			    time_before(jiffies, idle_until)) {
+				cond_resched();
+				continue;
+			}
+			if (used_mm) {
+				kthread_unuse_mm(ring->mm);
+				mmput(ring->mm);
+				used_mm = false;
+			}
+			WRITE_ONCE(hdr->sq_flags,
+				   hdr->sq_flags | XRP_RING_SQ_NEED_WAKEUP);
+			smp_mb();
+			wait_event_interruptible(ring->wait,
+						 kthread_should_stop() ||
+						 READ_ONCE(ring->kick) ||
+						 smp_load_acquire(&hdr->sq_tail) !=
+						 ring->sq_head);
+			WRITE_ONCE(ring->kick, false);
+			WRITE_ONCE(hdr->sq_flags,
+				   hdr->sq_flags & ~XRP_RING_SQ_NEED_WAKEUP);
+			idle_until = jiffies + ring->idle;
+			continue;
+		}
+
+		if (!used_mm) {
+			have_mm = mmget_not_zero(ring->mm);
+			if (have_mm) {
+				kthread_use_mm(ring->mm);
+				used_mm = true;
+			}
+		}
+
+		sqe = ring->sqe[head & (ring->sq_entries - 1)];
+		ring->sq_head = head + 1;
+		smp_store_release(&hdr->sq_head, ring->sq_head);
+
+		xrp_ring_run(filp, ring, &sqe, have_mm);
+		idle_until = jiffies + ring->idle;
+	}
+	if (used_mm) {
+		kthread_unuse_mm(ring->mm);
+		mmput(ring->mm);
+	}
+	return 0;
+}
+
+static void xrp_ring_free(struct xrp_ring *ring)
+{
+	if (ring->mm)
+		mmdrop(ring->mm);
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+static long xrp_ioctl_ring_setup(struct file *filp,
+				 struct xrp_ioctl_ring_setup __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_ioctl_ring_setup setup;
+	struct xrp_ring *ring;
+	unsigned long addr;
+	long ret;
+
+	if (copy_from_user(&setup, p, sizeof(*p)))
+		return -EFAULT;
+
+	if (!setup.sq_entries || setup.sq_entries > XRP_RING_MAX_ENTRIES ||
+	    !is_power_of_2(setup.sq_entries) ||
+	    (setup.flags & ~XRP_RING_SETUP_VALID_FLAGS)) {
+		dev_dbg(xvp->dev, "%s: invalid ring setup %u/0x%x\n",
+			__func__, setup.sq_entries, setup.flags);
+		return -EINVAL;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->sq_entries = setup.sq_entries;
+	ring->cq_entries = setup.sq_entries * 2;
+	ring->flags = setup.flags;
+	ring->idle = msecs_to_jiffies(setup.sq_thread_idle ?
+				      setup.sq_thread_idle : 1000);
+	init_waitqueue_head(&ring->wait);
+
+	setup.sq_off = ALIGN(sizeof(struct xrp_ring_header), 64);
+	setup.cq_off = setup.sq_off +
+		ring->sq_entries * sizeof(struct xrp_ring_sqe);
+	ring->size = PAGE_ALIGN(setup.cq_off +
+				ring->cq_entries * sizeof(struct xrp_ring_cqe));
+
+	ring->hdr = vmalloc_user(ring->size);
+	if (!ring->hdr) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->sqe = (void *)ring->hdr + setup.sq_off;
+	ring->cqe = (void *)ring->hdr + setup.cq_off;
+	ring->hdr->sq_mask = ring->sq_entries - 1;
+	ring->hdr->cq_mask = ring->cq_entries - 1;
+
+	if (xvp_file->ring || cmpxchg(&xvp_file->ring_pending, NULL, ring)) {
+		xrp_ring_free(ring);
+		return -EBUSY;
+	}
+
+	mmgrab(current->mm);
+	ring->mm = current->mm;
+
+	ring->mmap_pending = true;
+	addr = vm_mmap(filp, 0, ring->size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, 0);
+	ring->mmap_pending = false;
+	if (IS_ERR_VALUE(addr)) {
+		ret = addr;
+		goto err;
+	}
+
+	ring->thread = kthread_run(xrp_ring_thread, filp, "xrp_ring/%d",
+				   task_pid_nr(current));
+	if (IS_ERR(ring->thread)) {
+		ret = PTR_ERR(ring->thread);
+		vm_munmap(addr, ring->size);
+		goto err;
+	}
+
+	setup.cq_entries = ring->cq_entries;
+	setup.size = ring->size;
+	setup.addr = addr;
+	/* user space can't find a ring it was not told about, don't keep it */
+	if (copy_to_user(p, &setup, sizeof(*p))) {
+		ret = -EFAULT;
+		kthread_stop(ring->thread);
+		vm_munmap(addr, ring->size);
+		goto err;
+	}
+	smp_store_release(&xvp_file->ring, ring);
+	return 0;
+err:
+	xvp_file->ring_pending = NULL;
+	xrp_ring_free(ring);
+	return ret;
+}
+
+static long xrp_ioctl_ring_enter(struct file *filp,
+				 struct xrp_ioctl_ring_enter __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ring *ring = smp_load_acquire(&xvp_file->ring);
+	struct xrp_ioctl_ring_enter enter;
+
+	if (!ring)
+		return -EINVAL;
+	if (copy_from_user(&enter, p, sizeof(*p)))
+		return -EFAULT;
+
+	WRITE_ONCE(ring->kick, true);
+	wake_up_interruptible(&ring->wait);
+
+	if (enter.flags & XRP_RING_ENTER_WAIT)
+		return wait_event_interruptible(xvp_file->async_wait,
+						(s32)(READ_ONCE(ring->cq_tail) -
+						      enter.cq_target) >= 0);
+	return 0;
+}
+
+static void xrp_ring_release(struct file *filp)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_ring *ring = xvp_file->ring;
+
+	if (!ring)
+		return;
+	/* SQEs not consumed yet have nothing mapped, just drop them */
+	kthread_stop(ring->thread);
+	xrp_ring_free(ring);
+}
+
+// static void xrp_dam_buf_free(struct xrp_allocation *xrp_allocation) 
+// {
+//     dev_dbg(xvp->dev,"%s: release dma_buf allocation n",
+// 					 __func__);
+//     kfree(xrp_allocation->pool);
+//     kfree(xrp_allocation);
+//     return
+// }
+
+// static void xrp_dam_buf_offset(struct xrp_allocation *xrp_allocation)
+// {
+//     return 0;
+// }
+// static const struct xrp_allocation_ops xrp_dma_buf_pool_ops = {
+// 	.alloc = NULL,
+// 	.free = xrp_dam_buf_free,
+// 	.free_pool = NULL,
+// 	.offset = xrp_dam_buf_offset,
+// };
+
+// static inline struct xrp_dma_buf_item * xrp_get_dma_buf_tail(struct xrp_dma_buf_item **list)
+// {
 //     struct xrp_dma_buf_item ** item;
 
 //     if(*list == NULLL)
@@ -2202,288 +3163,483 @@ retry:
 //         if();
 //     }
 // }
-static void xrp_release_dma_buf_item(struct xrp_dma_buf_item * item)
+static struct xrp_dma_buf_item *xrp_dma_buf_lookup(struct xvp_file *xvp_file,
+						   struct dma_buf *dmabuf)
 {
-    spin_lock(&xrp_dma_buf_lock);
-    if(--item->ref==0)
-    {
-        list_del(&item->link);
-        kfree(item);
-    }
-    spin_unlock(&xrp_dma_buf_lock);
-}
-static long xrp_ioctl_dma_buf_import(struct file *filp,
-			                struct xrp_dma_buf __user *p)
-{
-    long ret;
-    struct xvp_file *xvp_file = filp->private_data;
-	struct xvp *xvp = xvp_file->xvp;
-    struct xrp_dma_buf  xrp_dma_buf;
-    struct dma_buf *dmabuf = NULL;
-    struct sg_table *sgt = NULL;
-    struct xrp_dma_buf_item *dma_buf_item=NULL;
-    struct xrp_dma_buf_item *temp=NULL;
-    struct dma_buf_attachment *attachment = NULL;
-    // struct xrp_allocation *xrp_allocation;
-    // struct xrp_private_pool *pool;
-    int npages = 0;
-    int i;
-    struct scatterlist *s;
-    unsigned int size = 0;
-
-    dev_dbg(xvp->dev,"%s: entry\n", __func__);
-	if (copy_from_user(&xrp_dma_buf, p, sizeof(*p)))
-    {
-		return -EFAULT;
-    }
-
-    dmabuf = dma_buf_get(xrp_dma_buf.fd);
+	struct xrp_dma_buf_item *item;
 
-    if(!dmabuf)
-    {
-        return -EFAULT;
-    }
+	hash_for_each_possible(xvp_file->dma_bufs, item, node,
+			       (unsigned long)dmabuf) {
+		if (item->dmabuf == dmabuf)
+			return item;
+	}
+	return NULL;
+}
 
-    spin_lock(&xrp_dma_buf_lock);
-    list_for_each_entry(temp,&xvp->dma_buf_list, link)
-    {
-        if(temp->dmabuf == dmabuf)
-        {
-            dma_buf_item = temp;
-            dma_buf_item->ref++;
-            break;
-        } 
-    }
+static void xrp_dma_buf_item_free(struct xrp_dma_buf_item *item)
+{
+	if (item->sgt)
+		dma_buf_unmap_attachment(item->attachment, item->sgt, item->dir);
+	dma_buf_detach(item->dmabuf, item->attachment);
+	dma_buf_put(item->dmabuf);
+	if (item->sg_list)
+		xrp_allocation_put(item->sg_list);
+	kfree(item);
+}
 
-   spin_unlock(&xrp_dma_buf_lock);
+/* Detach idle dma-bufs, least recently released first, down to max */
+static void xrp_dma_buf_trim(struct xvp_file *xvp_file, unsigned int max)
+{
+	struct xrp_dma_buf_item *item;
+
+	while (xvp_file->dma_buf_idle > max) {
+		item = list_last_entry(&xvp_file->dma_buf_lru,
+				       struct xrp_dma_buf_item, lru);
+		list_del(&item->lru);
+		hash_del(&item->node);
+		xvp_file->dma_buf_idle--;
+		xrp_dma_buf_item_free(item);
+	}
+}
 
-    if(dma_buf_item == NULL)
-    {
-        dev_dbg(xvp->dev,
-					"%s: no exit same dma buf\n", __func__);
-        attachment = dma_buf_attach(dmabuf, xvp->dev);
-        if (!attachment)
-        {
-            goto One_Err;
-        }
+static struct sg_table *xrp_dma_buf_map(struct xvp *xvp,
+					struct dma_buf_attachment *attachment,
+					enum dma_data_direction dir)
+{
+	struct sg_table *sgt = dma_buf_map_attachment(attachment, dir);
 
-        sgt = dma_buf_map_attachment(attachment, xrp_dma_direction(xrp_dma_buf.flags));
-        if (!sgt)
-        {
-        goto One_Err;
-        }
+	if (IS_ERR_OR_NULL(sgt))
+		return sgt ? sgt : ERR_PTR(-ENOMEM);
+	return sgt;
+}
 
-        dma_buf_item = kzalloc(sizeof(*dma_buf_item),GFP_KERNEL);
-        if(dma_buf_item == NULL)
-        {
-            goto One_Err;
-        }
-        
-        dma_buf_item->attachment = attachment;
-        dma_buf_item->dmabuf = dmabuf;
-        dma_buf_item->sgt = sgt;
-        dma_buf_item->ref = 1;
-        spin_lock(&xrp_dma_buf_lock);
-        list_add_tail(&dma_buf_item->link, &xvp->dma_buf_list);
-        spin_unlock(&xrp_dma_buf_lock);
-    }
-    else
-    {
-        dev_dbg(xvp->dev,
-					"%s: exit same dma buf\n", __func__);
-        attachment = dma_buf_item->attachment;
-        sgt = dma_buf_item->sgt;
-        spin_lock(&xrp_dma_buf_lock);
-        dma_buf_item->ref++;
-        spin_unlock(&xrp_dma_buf_lock);
-    }
+/*
+ * Collect the physical segments of sgt, merging adjacent ones. Returns the
+ * number of segments, a buffer that is contiguous after merging needs no
+ * descriptor list.
+ */
+static unsigned int xrp_dma_buf_segments(struct sg_table *sgt,
+					 struct xrp_dsp_sg_list *list)
+{
+	struct scatterlist *s;
+	unsigned int n = 0;
+	int i;
 
-    if(sgt->nents != 1)
-    {
-        dev_dbg(xvp->dev,
-					"%s: sg table number (%d) is not 1, unspoort.\n",
-					 __func__,sgt->nents);
-        goto Two_Err;
-    }
-    /* Prepare page array. */
-    /* Get number of pages. */
-    for_each_sg(sgt->sgl, s, sgt->orig_nents, i)
-    {
-        npages += (sg_dma_len(s) + PAGE_SIZE - 1) / PAGE_SIZE;
-        size += sg_dma_len(s);
-    }
- 
-    xrp_dma_buf.size = size;
 #ifdef VIDMEM_DMA_MAP
-    xrp_dma_buf. = sg_dma_address(s) + j * PAGE_SIZE;
+	for_each_sg(sgt->sgl, s, sgt->nents, i) {
+		phys_addr_t phys = sg_dma_address(s);
+		unsigned int len = sg_dma_len(s);
 #else
-    // xrp_dma_buf.paddr = page_to_phys(nth_page(sg_page(s), 0));
-    xrp_dma_buf.paddr = sg_phys(sgt->sgl);
+	for_each_sg(sgt->sgl, s, sgt->orig_nents, i) {
+		phys_addr_t phys = sg_phys(s);
+		unsigned int len = s->length;
 #endif
-    // dev_dbg(xvp->dev,
-	// 				"%s: import dma-buf phy addr:0x%lx,size:%d\n",
-	// 				 __func__,xrp_dma_buf.paddr,xrp_dma_buf.size);
-//    xrp_allocation = kzalloc(sizeof(*xrp_allocation), GFP_KERNEL | __GFP_NORETRY);
-//    if(!xrp_allocation)
-//    {
-//        return -ENOMEM;
-//    }
-//    pool = kmalloc(sizeof(*pool), GFP_KERNEL);
-//    if(!pool)
-//    {
-//        kfree(xrp_allocation);
-//        return -ENOMEM;
-//    }
-//    *pool = (struct xrp_private_pool){
-// 		.pool = {
-// 			.ops = &xrp_dma_buf_pool_ops,
-// 		},
-// 		.start = xrp_dma_buf.paddr ,
-// 		.size = xrp_dma_buf.size,
-// 		.free_list = NULL,
-// 	};
-//    xrp_allocation->pool = pool;
-//    xrp_allocation->start = xrp_dma_buf.paddr;
-//    xrp_allocation->size = xrp_dma_buf.size;
-   
-//    xrp_allocation_queue(xvp_file, xrp_allocation);
+		struct xrp_dsp_sg_entry *prev = n ? &list->entry[n - 1] : NULL;
 
-//    xrp_dma_buf.addr = vm_mmap(filp, 0, xrp_allocation->size,
-// 			PROT_READ | PROT_WRITE, MAP_SHARED,
-// 			xrp_dam_buf_offset(xrp_allocation));
+		if (prev && prev->paddr + prev->size == phys &&
+		    prev->size + len > prev->size) {
+			prev->size += len;
+		} else {
+			list->entry[n++] = (struct xrp_dsp_sg_entry){
+				.paddr = phys,
+				.size = len,
+			};
+		}
+		list->size += len;
+	}
+	list->n_entries = n;
+	return n;
+}
 
+/* Describe a multi-segment buffer to the DSP, see XRP_FLAG_DMABUF_SG */
+static long xrp_dma_buf_sg_list(struct xvp *xvp, struct xrp_dma_buf_item *item,
+				const struct xrp_dsp_sg_list *list)
+{
+	size_t list_size = struct_size(list, entry, list->n_entries);
+	void __iomem *p;
+	long rc;
 
-    struct file *export_filp = fget(xrp_dma_buf.fd);
-    xrp_dma_buf.addr = vm_mmap(export_filp, 0, xrp_dma_buf.size,
-			            PROT_READ | PROT_WRITE, MAP_SHARED,0); 
-    
-    fput(export_filp);
-    dev_dbg(xvp->dev,
-					"%s: import dma-buf phy addr:0x%lx,user addr:0x%lx,size:%d\n",
-					 __func__,xrp_dma_buf.paddr,xrp_dma_buf.addr,xrp_dma_buf.size);
+	rc = xrp_allocate(xvp->pool, list_size, 64, &item->sg_list);
+	if (rc < 0)
+		return rc;
+	p = ioremap(item->sg_list->start, list_size);
+	if (!p) {
+		xrp_allocation_put(item->sg_list);
+		item->sg_list = NULL;
+		return -ENOMEM;
+	}
+	memcpy_toio(p, list, list_size);
+	iounmap(p);
+	item->paddr = item->sg_list->start | XRP_DMABUF_PADDR_SG;
+	return 0;
+}
 
+/* Set the device address and size of item from its mapping sgt */
+static long xrp_dma_buf_item_addr(struct xvp *xvp, struct xrp_dma_buf_item *item,
+				  struct sg_table *sgt, bool sg)
+{
+	struct xrp_dsp_sg_list *list;
+	long rc = 0;
 
-    if (copy_to_user(p, &xrp_dma_buf, sizeof(*p))) {
-        dma_buf_put(dmabuf);
-		vm_munmap(xrp_dma_buf.addr , xrp_dma_buf.size);
-		goto Two_Err;
+	list = kzalloc(struct_size(list, entry, sgt->orig_nents), GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+	if (xrp_dma_buf_segments(sgt, list) == 1) {
+		item->paddr = list->entry[0].paddr;
+	} else if (!sg) {
+		dev_dbg(xvp->dev,
+			"%s: %d segments, import without XRP_FLAG_DMABUF_SG\n",
+			__func__, list->n_entries);
+		rc = -EINVAL;
+	} else {
+		rc = xrp_dma_buf_sg_list(xvp, item, list);
 	}
+	if (!rc)
+		item->size = list->size;
+	kfree(list);
+	return rc;
+}
+
+/* Takes over the caller's reference to dmabuf on success */
+static struct xrp_dma_buf_item *xrp_dma_buf_item_create(struct xvp_file *xvp_file,
+							struct dma_buf *dmabuf,
+							enum dma_data_direction dir,
+							bool sg)
+{
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_dma_buf_item *item;
+	struct dma_buf_attachment *attachment;
+	struct sg_table *sgt;
+	long rc;
+
+	item = kzalloc(sizeof(*item), GFP_KERNEL);
+	if (!item)
+		return ERR_PTR(-ENOMEM);
 
-    return 0;
+	attachment = dma_buf_attach(dmabuf, xvp->dev);
+	if (IS_ERR(attachment)) {
+		kfree(item);
+		return ERR_CAST(attachment);
+	}
+	sgt = xrp_dma_buf_map(xvp, attachment, dir);
+	if (IS_ERR(sgt)) {
+		dma_buf_detach(dmabuf, attachment);
+		kfree(item);
+		return ERR_CAST(sgt);
+	}
 
-Two_Err:
-    xrp_release_dma_buf_item(dma_buf_item);
-One_Err:
-    dma_buf_put(dmabuf);
-    return -EINVAL;
+	rc = xrp_dma_buf_item_addr(xvp, item, sgt, sg);
+	if (rc) {
+		dma_buf_unmap_attachment(attachment, sgt, dir);
+		dma_buf_detach(dmabuf, attachment);
+		kfree(item);
+		return ERR_PTR(rc);
+	}
+	item->dmabuf = dmabuf;
+	item->attachment = attachment;
+	item->sgt = sgt;
+	item->dir = dir;
+	INIT_LIST_HEAD(&item->lru);
+	hash_add(xvp_file->dma_bufs, &item->node, (unsigned long)dmabuf);
+	return item;
 }
 
-static struct xrp_dma_buf_item * xrp_search_dma_buf( struct list_head *list,int fd)
+/*
+ * The cached mapping was made for the direction of the first import,
+ * widen it when the buffer is now used the other way too. Called with
+ * dma_buf_lock held. The old mapping goes first: exporters that cache
+ * the attachment mapping refuse a second one with -EBUSY.
+ *
+ * Behind an IOMMU the new mapping may have another device address, so
+ * the item is only remapped while a single import holds it, and that
+ * importer gets the new address back. An item left without a mapping
+ * is mapped again by its next import.
+ */
+static long xrp_dma_buf_item_dir(struct xvp_file *xvp_file,
+				 struct xrp_dma_buf_item *item,
+				 enum dma_data_direction dir, bool sg)
 {
-    struct xrp_dma_buf_item *loop;
-    struct xrp_dma_buf_item *dma_buf_item=NULL;
-    struct dma_buf *dmabuf = NULL;
-    // pr_debug("%s: fd %d,entry\n", __func__,fd);
-    dmabuf = dma_buf_get(fd);
-    spin_lock(&xrp_dma_buf_lock);
-    list_for_each_entry(loop,list, link)
-    {
-        if(loop->dmabuf == dmabuf)
-        {
-            dma_buf_item = loop;
-            break;
-        }
+	struct xvp *xvp = xvp_file->xvp;
+	struct xrp_allocation *sg_list = item->sg_list;
+	struct sg_table *sgt;
+	long rc;
 
-    }
-    spin_unlock(&xrp_dma_buf_lock);
-    dma_buf_put(dmabuf);
-    pr_debug("%s: %p exit\n", __func__,fd,dma_buf_item);
-    return dma_buf_item;
+	if (item->sgt &&
+	    (item->dir == dir || item->dir == DMA_BIDIRECTIONAL || dir == DMA_NONE))
+		return 0;
+	if (item->ref > 1) {
+		dev_dbg(xvp->dev, "%s: %d imports still use the old address\n",
+			__func__, item->ref);
+		return -EBUSY;
+	}
+	if (item->sgt)
+		dma_buf_unmap_attachment(item->attachment, item->sgt, item->dir);
+	item->sgt = NULL;
+	sgt = xrp_dma_buf_map(xvp, item->attachment, DMA_BIDIRECTIONAL);
+	if (IS_ERR(sgt)) {
+		dev_err(xvp->dev, "%s: dma-buf lost its mapping\n", __func__);
+		return PTR_ERR(sgt);
+	}
+	item->sg_list = NULL;
+	rc = xrp_dma_buf_item_addr(xvp, item, sgt, sg);
+	if (rc) {
+		item->sg_list = sg_list;
+		dma_buf_unmap_attachment(item->attachment, sgt, DMA_BIDIRECTIONAL);
+		return rc;
+	}
+	if (sg_list)
+		xrp_allocation_put(sg_list);
+	item->sgt = sgt;
+	item->dir = DMA_BIDIRECTIONAL;
+	return 0;
 }
 
-static long xrp_ioctl_dma_buf_release(struct file *filp,
-			                        int __user *p)
+static void xrp_dma_buf_item_put(struct xvp_file *xvp_file,
+				 struct xrp_dma_buf_item *item)
+{
+	if (--item->ref)
+		return;
+	list_add(&item->lru, &xvp_file->dma_buf_lru);
+	xvp_file->dma_buf_idle++;
+	xrp_dma_buf_trim(xvp_file, max(dma_buf_cache_max, 0));
+}
+
+static long xrp_ioctl_dma_buf_import(struct file *filp,
+				     struct xrp_dma_buf __user *p)
 {
-    int fd;
-    struct xvp_file *xvp_file = filp->private_data;
+	struct xvp_file *xvp_file = filp->private_data;
 	struct xvp *xvp = xvp_file->xvp;
-    struct dma_buf *dmabuf = NULL;
-    struct xrp_dma_buf_item *dma_buf_item=NULL;
-    struct xrp_dma_buf_item *loop,*temp;
-    
-    if (copy_from_user(&fd, p, sizeof(*p)))
-    {
+	struct xrp_dma_buf xrp_dma_buf;
+	struct xrp_dma_buf_item *item;
+	struct dma_buf *dmabuf;
+	unsigned long addr = 0;
+	long ret = 0;
+
+	if (copy_from_user(&xrp_dma_buf, p, sizeof(*p)))
 		return -EFAULT;
-    }
 
-    // dmabuf = dma_buf_get(fd);
-    // spin_lock(&xrp_dma_buf_lock);
-    // list_for_each_entry_safe(loop, temp, &xvp->dma_buf_list, link)
-    // {
-    //     if(loop->dmabuf == dmabuf)
-    //     {
-    //         dma_buf_item = loop;
-    //         if((--dma_buf_item->ref)==0)
-    //             list_del(&dma_buf_item);
-    //         break;
-    //     }
- 
-    // }
-    // spin_unlock(&xrp_dma_buf_lock);
-    // dma_buf_put(dmabuf);
-    dma_buf_item = xrp_search_dma_buf(&xvp->dma_buf_list,fd);
-    if(dma_buf_item == NULL)
-    {
-        return -EFAULT;
-    }
-    
-    dma_buf_unmap_attachment(dma_buf_item->attachment, dma_buf_item->sgt, DMA_BIDIRECTIONAL);
-    dma_buf_detach(dma_buf_item->dmabuf, dma_buf_item->attachment);
-    dma_buf_put(dma_buf_item->dmabuf);
-    xrp_release_dma_buf_item(dma_buf_item);
-    return 0;
+	dmabuf = dma_buf_get(xrp_dma_buf.fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	mutex_lock(&xvp_file->dma_buf_lock);
+	item = xrp_dma_buf_lookup(xvp_file, dmabuf);
+	if (item) {
+		/* the cached item holds its own reference */
+		dma_buf_put(dmabuf);
+		if (item->sg_list && !(xrp_dma_buf.flags & XRP_FLAG_DMABUF_SG))
+			ret = -EINVAL;
+		else
+			ret = xrp_dma_buf_item_dir(xvp_file, item,
+						   xrp_dma_direction(xrp_dma_buf.flags),
+						   xrp_dma_buf.flags & XRP_FLAG_DMABUF_SG);
+	} else {
+		item = xrp_dma_buf_item_create(xvp_file, dmabuf,
+					       xrp_dma_direction(xrp_dma_buf.flags),
+					       xrp_dma_buf.flags & XRP_FLAG_DMABUF_SG);
+		if (IS_ERR(item)) {
+			ret = PTR_ERR(item);
+			dma_buf_put(dmabuf);
+		}
+	}
+	if (ret) {
+		mutex_unlock(&xvp_file->dma_buf_lock);
+		return ret;
+	}
+	if (!list_empty(&item->lru)) {
+		list_del_init(&item->lru);
+		xvp_file->dma_buf_idle--;
+	}
+	item->ref++;
+	xrp_dma_buf.paddr = item->paddr;
+	xrp_dma_buf.size = item->size;
+	mutex_unlock(&xvp_file->dma_buf_lock);
+
+	/* DSP-only buffers don't need a CPU mapping */
+	if (!(xrp_dma_buf.flags & XRP_FLAG_DMABUF_NO_MAP)) {
+		addr = vm_mmap(item->dmabuf->file, 0, xrp_dma_buf.size,
+			       PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+		if (IS_ERR_VALUE(addr)) {
+			ret = (long)addr;
+			goto err_put;
+		}
+	}
+	xrp_dma_buf.addr = addr;
+	dev_dbg(xvp->dev,
+		"%s: import dma-buf phy addr:0x%llx,user addr:0x%llx,size:%d\n",
+		__func__, xrp_dma_buf.paddr, xrp_dma_buf.addr, xrp_dma_buf.size);
+
+	if (copy_to_user(p, &xrp_dma_buf, sizeof(*p))) {
+		if (addr)
+			vm_munmap(addr, xrp_dma_buf.size);
+		ret = -EFAULT;
+		goto err_put;
+	}
+	return 0;
+
+err_put:
+	mutex_lock(&xvp_file->dma_buf_lock);
+	xrp_dma_buf_item_put(xvp_file, item);
+	mutex_unlock(&xvp_file->dma_buf_lock);
+	return ret;
 }
 
+/* Called with dma_buf_lock held, returns the imported item behind fd */
+static struct xrp_dma_buf_item *xrp_search_dma_buf(struct xvp_file *xvp_file, int fd)
+{
+	struct xrp_dma_buf_item *item;
+	struct dma_buf *dmabuf;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return NULL;
+	item = xrp_dma_buf_lookup(xvp_file, dmabuf);
+	dma_buf_put(dmabuf);
+	if (item && !item->ref)
+		return NULL;
+	return item;
+}
+
+static long xrp_ioctl_dma_buf_release(struct file *filp,
+				      int __user *p)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_dma_buf_item *item;
+	int fd;
+
+	if (copy_from_user(&fd, p, sizeof(*p)))
+		return -EFAULT;
+
+	mutex_lock(&xvp_file->dma_buf_lock);
+	item = xrp_search_dma_buf(xvp_file, fd);
+	if (item)
+		xrp_dma_buf_item_put(xvp_file, item);
+	mutex_unlock(&xvp_file->dma_buf_lock);
+	return item ? 0 : -EFAULT;
+}
+
+/* Sync size bytes from offset into item, clipped to the buffer */
+static void xrp_dma_buf_sync_item(struct xvp *xvp, struct xrp_dma_buf_item *item,
+				  bool for_cpu, enum dma_data_direction dir,
+				  unsigned long offset, unsigned long size)
+{
+	struct sg_table *sgt = item->sgt;
+	struct scatterlist *s;
+	dma_addr_t dma;
+	int i;
+
+	if (!sgt || offset >= item->size)
+		return;
+	size = min(size, item->size - offset);
+
+	if (!item->sg_list) {
+		dma = phys_to_dma(xvp->dev, item->paddr) + offset;
+		if (for_cpu)
+			dma_sync_single_for_cpu(xvp->dev, dma, size, dir);
+		else
+			dma_sync_single_for_device(xvp->dev, dma, size, dir);
+		return;
+	}
+	if (offset == 0 && size == item->size) {
+		if (for_cpu)
+			dma_sync_sg_for_cpu(xvp->dev, sgt->sgl, sgt->orig_nents, dir);
+		else
+			dma_sync_sg_for_device(xvp->dev, sgt->sgl, sgt->orig_nents, dir);
+		return;
+	}
+	for_each_sg(sgt->sgl, s, sgt->nents, i) {
+		unsigned long len = sg_dma_len(s);
+		unsigned long n;
+
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		n = min(len - offset, size);
+		dma = sg_dma_address(s) + offset;
+		if (for_cpu)
+			dma_sync_single_for_cpu(xvp->dev, dma, n, dir);
+		else
+			dma_sync_single_for_device(xvp->dev, dma, n, dir);
+		size -= n;
+		if (!size)
+			break;
+		offset = 0;
+	}
+}
 
 static long xrp_ioctl_dma_buf_sync(struct file *filp,
-			                struct xrp_dma_buf __user *p)
+				   struct xrp_dma_buf __user *p)
 {
-    struct xvp_file *xvp_file = filp->private_data;
+	struct xvp_file *xvp_file = filp->private_data;
 	struct xvp *xvp = xvp_file->xvp;
-    struct xrp_dma_buf  xrp_dma_buf;
-    struct xrp_dma_buf_item *dma_buf_item=NULL;
-    if (copy_from_user(&xrp_dma_buf, p, sizeof(*p)))
-    {
+	struct xrp_dma_buf xrp_dma_buf;
+	struct xrp_dma_buf_item *item;
+	unsigned long offset = 0;
+	unsigned long size = ULONG_MAX;
+	unsigned int flags;
+	long ret = 0;
+
+	if (copy_from_user(&xrp_dma_buf, p, sizeof(*p)))
 		return -EFAULT;
-    }
+	flags = xrp_dma_buf.flags;
+	if (flags & XRP_FLAG_DMABUF_SYNC_RANGE) {
+		offset = xrp_dma_buf.addr;
+		size = xrp_dma_buf.size;
+	}
 
-    dma_buf_item = xrp_search_dma_buf(&xvp->dma_buf_list,xrp_dma_buf.fd);
-    if(dma_buf_item == NULL)
-    {
-        return -EFAULT;
-    }
-    switch(xrp_dma_buf.flags)
-    {   
-        case XRP_FLAG_READ:
-                    dma_sync_single_for_cpu(xvp->dev, phys_to_dma(xvp->dev, xrp_dma_buf.paddr), xrp_dma_buf.size,
-				                             xrp_dma_direction(xrp_dma_buf.flags));
-                   break;
-        case XRP_FLAG_WRITE:
-                    dma_sync_single_for_device(xvp->dev, phys_to_dma(xvp->dev,  xrp_dma_buf.paddr), xrp_dma_buf.size,
-				                             xrp_dma_direction(xrp_dma_buf.flags));
-                   break;
-        case XRP_FLAG_READ_WRITE:
-                    dma_sync_single_for_cpu(xvp->dev, phys_to_dma(xvp->dev,  xrp_dma_buf.paddr), xrp_dma_buf.size,
-				                             xrp_dma_direction(xrp_dma_buf.flags));
-                    dma_sync_single_for_device(xvp->dev, phys_to_dma(xvp->dev,  xrp_dma_buf.paddr),xrp_dma_buf.size,
-				                             xrp_dma_direction(xrp_dma_buf.flags));
-                    break;
-        default:
-            dev_dbg(xvp->dev,"%s: invalid type%x\n", __func__, xrp_dma_buf.flags);
-            return -EFAULT;
-    }
-    return 0;
+	mutex_lock(&xvp_file->dma_buf_lock);
+	item = xrp_search_dma_buf(xvp_file, xrp_dma_buf.fd);
+	if (item == NULL) {
+		mutex_unlock(&xvp_file->dma_buf_lock);
+		return -EFAULT;
+	}
+	if (flags & (XRP_FLAG_DMABUF_SYNC_FOR_DEVICE | XRP_FLAG_DMABUF_SYNC_FOR_CPU)) {
+		enum dma_data_direction dir = xrp_dma_direction(flags);
+
+		if (dir == DMA_NONE)
+			ret = -EINVAL;
+		if (!ret && (flags & XRP_FLAG_DMABUF_SYNC_FOR_DEVICE))
+			xrp_dma_buf_sync_item(xvp, item, false, dir, offset, size);
+		if (!ret && (flags & XRP_FLAG_DMABUF_SYNC_FOR_CPU))
+			xrp_dma_buf_sync_item(xvp, item, true, dir, offset, size);
+		mutex_unlock(&xvp_file->dma_buf_lock);
+		return ret;
+	}
+	/* sync the imported range, not what the caller left in paddr/size */
+	switch (flags & XRP_FLAG_READ_WRITE) {
+	case XRP_FLAG_READ:
+		xrp_dma_buf_sync_item(xvp, item, true, DMA_TO_DEVICE, offset, size);
+		break;
+	case XRP_FLAG_WRITE:
+		xrp_dma_buf_sync_item(xvp, item, false, DMA_FROM_DEVICE, offset, size);
+		break;
+	case XRP_FLAG_READ_WRITE:
+		xrp_dma_buf_sync_item(xvp, item, true, DMA_BIDIRECTIONAL, offset, size);
+		xrp_dma_buf_sync_item(xvp, item, false, DMA_BIDIRECTIONAL, offset, size);
+		break;
+	default:
+		dev_dbg(xvp->dev, "%s: invalid type%x\n", __func__, flags);
+		ret = -EFAULT;
+	}
+	mutex_unlock(&xvp_file->dma_buf_lock);
+	return ret;
+}
+
+static void xrp_dma_buf_release(struct file *filp)
+{
+	struct xvp_file *xvp_file = filp->private_data;
+	struct xrp_dma_buf_item *item;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(xvp_file->dma_bufs, bkt, tmp, item, node) {
+		hash_del(&item->node);
+		xrp_dma_buf_item_free(item);
+	}
+	mutex_destroy(&xvp_file->dma_buf_lock);
 }
+
 static long xvp_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	long retval;
@@ -2506,6 +3662,30 @@ static long xvp_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		retval = xrp_ioctl_submit_sync(filp,
 					       (struct xrp_ioctl_queue __user *)arg);
 		break;
+	case XRP_IOCTL_QUEUE_BATCH:
+		retval = xrp_ioctl_submit_batch(filp,
+						(struct xrp_ioctl_queue_batch __user *)arg);
+		break;
+	case XRP_IOCTL_QUEUE_ASYNC:
+		retval = xrp_ioctl_submit_async(filp,
+						(struct xrp_ioctl_queue_async __user *)arg);
+		break;
+	case XRP_IOCTL_RING_SETUP:
+		retval = xrp_ioctl_ring_setup(filp,
+					      (struct xrp_ioctl_ring_setup __user *)arg);
+		break;
+	case XRP_IOCTL_RING_ENTER:
+		retval = xrp_ioctl_ring_enter(filp,
+					      (struct xrp_ioctl_ring_enter __user *)arg);
+		break;
+	case XRP_IOCTL_BUFFER_REGISTER:
+		retval = xrp_ioctl_register_buffers(filp,
+						    (struct xrp_ioctl_register_buffers __user *)arg);
+		break;
+	case XRP_IOCTL_BUFFER_UNREGISTER:
+		retval = xrp_ioctl_unregister_buffers(filp,
+						      (struct xrp_ioctl_register_buffers __user *)arg);
+		break;
 	case XRP_IOCTL_REPORT_CREATE:
 		retval = xrp_ioctl_alloc_report(filp,
 					       (struct xrp_ioctl_alloc __user *)arg);
@@ -2556,6 +3736,12 @@ static int xvp_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct xvp_file *xvp_file = filp->private_data;
 	unsigned long pfn = vma->vm_pgoff;// + PFN_DOWN(xvp_file->xvp->pmem);
 	struct xrp_allocation *xrp_allocation;
+	struct xrp_ring *ring = READ_ONCE(xvp_file->ring_pending);
+
+	/* vm_mmap from xrp_ioctl_ring_setup */
+	if (ring && ring->mmap_pending && vma->vm_pgoff == 0 &&
+	    vma->vm_end - vma->vm_start == ring->size)
+		return remap_vmalloc_range(vma, ring->hdr, 0);
 
 	xrp_allocation = xrp_allocation_dequeue(filp->private_data,
 						pfn << PAGE_SHIFT,
@@ -2611,6 +3797,17 @@ static int xvp_open(struct inode *inode, struct file *filp)
 
 	xvp_file->xvp = xvp;
 	spin_lock_init(&xvp_file->busy_list_lock);
+	spin_lock_init(&xvp_file->async_lock);
+	INIT_LIST_HEAD(&xvp_file->async_pending);
+	INIT_LIST_HEAD(&xvp_file->async_done);
+	init_waitqueue_head(&xvp_file->async_wait);
+	INIT_WORK(&xvp_file->async_work, xrp_async_work);
+	mutex_init(&xvp_file->async_submit_lock);
+	spin_lock_init(&xvp_file->registered_lock);
+	idr_init(&xvp_file->registered);
+	mutex_init(&xvp_file->dma_buf_lock);
+	hash_init(xvp_file->dma_bufs);
+	INIT_LIST_HEAD(&xvp_file->dma_buf_lru);
 	filp->private_data = xvp_file;
 	xrp_add_known_file(filp);
 	return 0;
@@ -2621,6 +3818,10 @@ static int xvp_close(struct inode *inode, struct file *filp)
 	struct xvp_file *xvp_file = filp->private_data;
 
 	pr_debug("%s\n", __func__);
+	xrp_ring_release(filp);
+	xrp_async_release(filp);
+	xrp_registered_release(filp);
+	xrp_dma_buf_release(filp);
 	xrp_report_fasync_release(filp);
 	xrp_remove_known_file(filp);
 	pm_runtime_put_sync(xvp_file->xvp->dev);
@@ -2744,6 +3945,8 @@ static const struct file_operations xvp_fops = {
 	.compat_ioctl = xvp_ioctl,
 #endif
 	.mmap = xvp_mmap,
+	.read = xvp_read,
+	.poll = xvp_poll,
 	.open = xvp_open,
 	.fasync = xrp_report_fasync,
 	.release = xvp_close,
@@ -2952,6 +4155,7 @@ static long xrp_init_common(struct platform_device *pdev,
 		goto err;
 	}
     xvp->reporter = NULL;
+	init_waitqueue_head(&xvp->report_wait);
 	xvp->dev = &pdev->dev;
 	xvp->hw_ops = hw_ops;
 	xvp->hw_arg = hw_arg;
@@ -3083,8 +4287,6 @@ static long xrp_init_common(struct platform_device *pdev,
 	if (ret < 0)
 		goto err_pm_disable;
     // xrp_device_heartbeat_init(xvp);
-    
-    INIT_LIST_HEAD(&xvp->dma_buf_list);
 
 
 	return PTR_ERR(xvp);
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2021 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../include/xrp_api.h"
+#include "../include/dsp_ps_ns.h"
+#include "../include/csi_dsp_api.h"
+#include "csi_dsp_core.h"
+#include "dsp_common.h"
+
+/*
+ * Algorithm libraries read into device memory, shared by the tasks of an
+ * instance. An entry is found by the identity of the files it was read
+ * from and deduplicated by content, so a library is read and copied into
+ * device memory once however many tasks acquire it. Entries no task holds
+ * stay cached up to high_water bytes.
+ */
+typedef struct csi_dsp_algo_file{
+    struct list_head head;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtim;
+}csi_dsp_algo_file_t;
+
+struct csi_dsp_algo_entry{
+    struct list_head head;
+    csi_dsp_algo_file_t file;
+    struct list_head aliases;   /* other files found to hold the same library */
+    uint64_t hash;
+    struct xrp_buffer *buf;
+    void *virt;
+    uint64_t phy;
+    size_t size;
+    int ref;
+};
+
+void csi_dsp_algo_cache_init(csi_dsp_algo_cache_t *cache)
+{
+    const char *env = getenv("CSI_DSP_ALGO_CACHE_MAX");
+
+    pthread_mutex_init(&cache->mutex,NULL);
+    INIT_LIST_HEAD(&cache->entries);
+    memset(&cache->stats,0,sizeof(cache->stats));
+    cache->stats.high_water = env ? strtoul(env,NULL,0) : CSI_DSP_ALGO_CACHE_HIGH_WATER;
+}
+
+static void csi_dsp_algo_entry_free(csi_dsp_algo_entry_t *entry)
+{
+    csi_dsp_algo_file_t *alias,*tmp;
+
+    list_for_each_entry_safe(alias,tmp,&entry->aliases,head)
+    {
+        list_del(&alias->head);
+        free(alias);
+    }
+    xrp_release_buffer(entry->buf);
+    free(entry);
+}
+
+static void csi_dsp_algo_file_set(csi_dsp_algo_file_t *file,const struct stat *st)
+{
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->mtim = st->st_mtim;
+}
+
+static int csi_dsp_algo_file_match(const csi_dsp_algo_file_t *file,const struct stat *st)
+{
+    return file->ino == st->st_ino && file->dev == st->st_dev &&
+           file->mtim.tv_sec == st->st_mtim.tv_sec &&
+           file->mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Whether the library in entry was read from the file behind st */
+static int csi_dsp_algo_entry_match(csi_dsp_algo_entry_t *entry,const struct stat *st)
+{
+    csi_dsp_algo_file_t *alias;
+
+    if(entry->size != (size_t)st->st_size)
+        return 0;
+    if(csi_dsp_algo_file_match(&entry->file,st))
+        return 1;
+    list_for_each_entry(alias,&entry->aliases,head)
+    {
+        if(csi_dsp_algo_file_match(alias,st))
+            return 1;
+    }
+    return 0;
+}
+
+/* Release idle entries, least recently used first, until at most target bytes are idle */
+static void csi_dsp_algo_cache_trim(csi_dsp_algo_cache_t *cache,size_t target)
+{
+    csi_dsp_algo_entry_t *entry,*tmp;
+    struct list_head *pos,*prev;
+    struct list_head release;
+
+    INIT_LIST_HEAD(&release);
+    pthread_mutex_lock(&cache->mutex);
+    for(pos=cache->entries.prev;pos!=&cache->entries && cache->stats.idle_bytes > target;pos=prev)
+    {
+        prev = pos->prev;
+        entry = list_entry(pos,csi_dsp_algo_entry_t,head);
+        if(entry->ref)
+            continue;
+        list_del(&entry->head);
+        list_add(&entry->head,&release);
+        cache->stats.idle_bytes -= entry->size;
+        cache->stats.cached_num--;
+        cache->stats.evictions++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    list_for_each_entry_safe(entry,tmp,&release,head)
+    {
+        list_del(&entry->head);
+        csi_dsp_algo_entry_free(entry);
+    }
+}
+
+void csi_dsp_algo_cache_destroy(csi_dsp_algo_cache_t *cache)
+{
+    csi_dsp_algo_cache_trim(cache,0);
+    DSP_PRINT(INFO,"algo cache hits:%llu,misses:%llu,evictions:%llu\n",
+              (unsigned long long)cache->stats.hits,
+              (unsigned long long)cache->stats.misses,
+              (unsigned long long)cache->stats.evictions);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+/* FNV-1a */
+static uint64_t csi_dsp_algo_hash(const unsigned char *data,size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for(i=0;i<size;i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void csi_dsp_algo_cache_ref(csi_dsp_algo_cache_t *cache,csi_dsp_algo_entry_t *entry)
+{
+    if(entry->ref++ == 0)
+        cache->stats.idle_bytes -= entry->size;
+    list_del(&entry->head);
+    list_add(&entry->head,&cache->entries);
+}
+
+/* Read file into device memory unless it is cached, returns a held entry */
+csi_dsp_algo_entry_t *csi_dsp_algo_cache_get(csi_dsp_algo_cache_t *cache,struct xrp_device *device,
+                                             const char *file)
+{
+    csi_dsp_algo_entry_t *entry,*new_entry;
+    enum xrp_status status;
+    struct stat st;
+    FILE *fp;
+
+    if(stat(file,&st) || st.st_size == 0)
+    {
+        DSP_PRINT(ERROR,"open file fail\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    list_for_each_entry(entry,&cache->entries,head)
+    {
+        if(csi_dsp_algo_entry_match(entry,&st))
+        {
+            csi_dsp_algo_cache_ref(cache,entry);
+            cache->stats.hits++;
+            pthread_mutex_unlock(&cache->mutex);
+            return entry;
+        }
+    }
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->mutex);
+
+    new_entry = calloc(1,sizeof(*new_entry));
+    if(!new_entry)
+        return NULL;
+    INIT_LIST_HEAD(&new_entry->aliases);
+    new_entry->buf = xrp_create_buffer(device,st.st_size,NULL,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(ERROR,"malloc buf fail\n");
+        free(new_entry);
+        return NULL;
+    }
+    xrp_buffer_get_info(new_entry->buf,XRP_BUFFER_PHY_ADDR,&new_entry->phy,sizeof(new_entry->phy),&status);
+    xrp_buffer_get_info(new_entry->buf,XRP_BUFFER_USER_ADDR,&new_entry->virt,sizeof(new_entry->virt),&status);
+    fp = fopen(file,"rb");
+    if(!fp || fread(new_entry->virt,1,st.st_size,fp) != (size_t)st.st_size)
+    {
+        DSP_PRINT(ERROR,"Loading file failed\n");
+        if(fp)
+            fclose(fp);
+        xrp_release_buffer(new_entry->buf);
+        free(new_entry);
+        return NULL;
+    }
+    fclose(fp);
+    csi_dsp_algo_file_set(&new_entry->file,&st);
+    new_entry->size = st.st_size;
+    new_entry->hash = csi_dsp_algo_hash(new_entry->virt,st.st_size);
+    new_entry->ref = 1;
+
+    /* the same library under another name, or loaded meanwhile by another task */
+    pthread_mutex_lock(&cache->mutex);
+    list_for_each_entry(entry,&cache->entries,head)
+    {
+        if(entry->hash == new_entry->hash && entry->size == new_entry->size &&
+           !memcmp(entry->virt,new_entry->virt,entry->size))
+        {
+            /* remember this file too so the next get is a hit without a read */
+            if(!csi_dsp_algo_entry_match(entry,&st))
+            {
+                csi_dsp_algo_file_t *alias = malloc(sizeof(*alias));
+
+                if(alias)
+                {
+                    csi_dsp_algo_file_set(alias,&st);
+                    list_add(&alias->head,&entry->aliases);
+                }
+            }
+            csi_dsp_algo_cache_ref(cache,entry);
+            pthread_mutex_unlock(&cache->mutex);
+            xrp_release_buffer(new_entry->buf);
+            free(new_entry);
+            return entry;
+        }
+    }
+    list_add(&new_entry->head,&cache->entries);
+    cache->stats.cached_num++;
+    pthread_mutex_unlock(&cache->mutex);
+    return new_entry;
+}
+
+/* Take another reference on an entry the caller already holds */
+void csi_dsp_algo_cache_hold(csi_dsp_algo_cache_t *cache,csi_dsp_algo_entry_t *entry)
+{
+    pthread_mutex_lock(&cache->mutex);
+    csi_dsp_algo_cache_ref(cache,entry);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void csi_dsp_algo_cache_put(csi_dsp_algo_cache_t *cache,csi_dsp_algo_entry_t *entry)
+{
+    if(!entry)
+        return;
+    pthread_mutex_lock(&cache->mutex);
+    if(--entry->ref == 0)
+        cache->stats.idle_bytes += entry->size;
+    pthread_mutex_unlock(&cache->mutex);
+    csi_dsp_algo_cache_trim(cache,cache->stats.high_water);
+}
+
+struct xrp_buffer *csi_dsp_algo_entry_buffer(csi_dsp_algo_entry_t *entry,uint64_t *phy)
+{
+    *phy = entry->phy;
+    return entry->buf;
+}
+
+int csi_dsp_set_algo_cache_limit(void *dsp,size_t high_water)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->algo_cache.mutex);
+    instance->algo_cache.stats.high_water = high_water;
+    pthread_mutex_unlock(&instance->algo_cache.mutex);
+    csi_dsp_algo_cache_trim(&instance->algo_cache,high_water);
+    return 0;
+}
+
+int csi_dsp_get_algo_cache_stats(void *dsp,csi_dsp_algo_cache_stats_t *stats)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance || !stats)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->algo_cache.mutex);
+    *stats = instance->algo_cache.stats;
+    pthread_mutex_unlock(&instance->algo_cache.mutex);
+    return 0;
+}
+
+/*
+ * csi_dsp_algo_prefetch reads the library on a thread of its own; the
+ * handle keeps a reference on the cache entry until it is released, so a
+ * task attaching it later only sends PS_CMD_ALGO_LOAD.
+ */
+static void *csi_dsp_algo_prefetch_thread(void *arg)
+{
+    csi_dsp_algo_prefetch_t *prefetch = (csi_dsp_algo_prefetch_t *)arg;
+
+    prefetch->entry = csi_dsp_algo_cache_get(&prefetch->instance->algo_cache,
+                                             prefetch->instance->device,prefetch->file);
+    if(!prefetch->entry)
+        DSP_PRINT(WARNING,"prefetch %s fail\n",prefetch->file);
+    return NULL;
+}
+
+void *csi_dsp_algo_prefetch(void *dsp,const char *name)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+    csi_dsp_algo_prefetch_t *prefetch;
+
+    if(!instance || !name || strlen(name)>100)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return NULL;
+    }
+    prefetch = calloc(1,sizeof(*prefetch));
+    if(!prefetch)
+        return NULL;
+    prefetch->instance = instance;
+    pthread_mutex_init(&prefetch->mutex,NULL);
+    sprintf(prefetch->file,"/lib/firmware/%s.lib",name);
+    if(pthread_create(&prefetch->thread,NULL,csi_dsp_algo_prefetch_thread,prefetch))
+    {
+        DSP_PRINT(WARNING,"prefetch thread create fail\n");
+        pthread_mutex_destroy(&prefetch->mutex);
+        free(prefetch);
+        return NULL;
+    }
+    return prefetch;
+}
+
+/* Wait for the prefetch to finish, returns its entry or NULL if it failed */
+csi_dsp_algo_entry_t *csi_dsp_algo_prefetch_wait(csi_dsp_algo_prefetch_t *prefetch)
+{
+    pthread_mutex_lock(&prefetch->mutex);
+    if(!prefetch->joined)
+    {
+        pthread_join(prefetch->thread,NULL);
+        prefetch->joined = 1;
+    }
+    pthread_mutex_unlock(&prefetch->mutex);
+    return prefetch->entry;
+}
+
+int csi_dsp_algo_prefetch_release(void *handle)
+{
+    csi_dsp_algo_prefetch_t *prefetch = (csi_dsp_algo_prefetch_t *)handle;
+
+    if(!prefetch)
+        return -1;
+    csi_dsp_algo_cache_put(&prefetch->instance->algo_cache,csi_dsp_algo_prefetch_wait(prefetch));
+    pthread_mutex_destroy(&prefetch->mutex);
+    free(prefetch);
+    return 0;
+}
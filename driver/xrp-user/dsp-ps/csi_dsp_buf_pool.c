@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2021 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../include/xrp_api.h"
+#include "../include/dsp_ps_ns.h"
+#include "../include/csi_dsp_api.h"
+#include "csi_dsp_core.h"
+#include "dsp_common.h"
+
+/*
+ * Released request buffers are kept mapped and handed out again for
+ * requests of the same size class, saving the XRP_IOCTL_ALLOC/mmap and
+ * munmap/XRP_IOCTL_FREE round trips per plane and frame. A pooled buffer
+ * holds its mapping, get hands it out mapped and put takes it back.
+ */
+typedef struct csi_dsp_pool_buf{
+    struct list_head head;
+    struct xrp_buffer *buf;
+    void *vir;
+    size_t size;
+}csi_dsp_pool_buf_t;
+
+static void csi_dsp_buf_pool_release(struct xrp_buffer *buf,void *vir)
+{
+    enum xrp_status status;
+
+    xrp_unmap_buffer(buf,vir,&status);
+    xrp_release_buffer(buf);
+}
+
+/* Return the class index of size and its rounded size, -1 if not cached */
+static int csi_dsp_buf_pool_class(size_t size,size_t *class_size)
+{
+    size_t shift = CSI_DSP_BUF_POOL_MIN_SHIFT;
+    size_t sub;
+    int idx;
+
+    if(size <= (size_t)1 << shift)
+    {
+        *class_size = (size_t)1 << shift;
+        return 0;
+    }
+    while(((size_t)1 << (shift + 1)) < size)
+        shift++;
+    /* 2^shift < size <= 2^(shift+1), split in four steps */
+    sub = (size - 1) >> (shift - 2);
+    idx = (shift - CSI_DSP_BUF_POOL_MIN_SHIFT) * 4 + (sub - 4) + 1;
+    if(idx >= CSI_DSP_BUF_POOL_CLASSES)
+    {
+        *class_size = size;
+        return -1;
+    }
+    *class_size = (sub + 1) << (shift - 2);
+    return idx;
+}
+
+void csi_dsp_buf_pool_init(csi_dsp_buf_pool_t *pool)
+{
+    const char *env = getenv("CSI_DSP_BUF_POOL_MAX");
+    int i;
+
+    pthread_mutex_init(&pool->mutex,NULL);
+    for(i=0;i<CSI_DSP_BUF_POOL_CLASSES;i++)
+        INIT_LIST_HEAD(&pool->free_list[i]);
+    memset(&pool->stats,0,sizeof(pool->stats));
+    pool->stats.high_water = env ? strtoul(env,NULL,0) : CSI_DSP_BUF_POOL_HIGH_WATER;
+}
+
+/* Release cached buffers, largest first, until at most target bytes remain */
+static void csi_dsp_buf_pool_trim(csi_dsp_buf_pool_t *pool,size_t target)
+{
+    csi_dsp_pool_buf_t *item;
+    struct list_head release;
+    int i;
+
+    INIT_LIST_HEAD(&release);
+    pthread_mutex_lock(&pool->mutex);
+    for(i=CSI_DSP_BUF_POOL_CLASSES-1;i>=0 && pool->stats.cached_bytes > target;i--)
+    {
+        while(!list_empty(&pool->free_list[i]) && pool->stats.cached_bytes > target)
+        {
+            item = list_first_entry(&pool->free_list[i],csi_dsp_pool_buf_t,head);
+            list_del(&item->head);
+            list_add(&item->head,&release);
+            pool->stats.cached_bytes -= item->size;
+            pool->stats.cached_num--;
+            pool->stats.trims++;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    while(!list_empty(&release))
+    {
+        item = list_first_entry(&release,csi_dsp_pool_buf_t,head);
+        list_del(&item->head);
+        csi_dsp_buf_pool_release(item->buf,item->vir);
+        free(item);
+    }
+}
+
+void csi_dsp_buf_pool_destroy(csi_dsp_buf_pool_t *pool)
+{
+    csi_dsp_buf_pool_trim(pool,0);
+    DSP_PRINT(INFO,"buf pool hits:%llu,misses:%llu,trims:%llu\n",
+              (unsigned long long)pool->stats.hits,
+              (unsigned long long)pool->stats.misses,
+              (unsigned long long)pool->stats.trims);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+struct xrp_buffer *csi_dsp_buf_pool_get(csi_dsp_buf_pool_t *pool,struct xrp_device *device,
+                                        size_t size,void **vir)
+{
+    csi_dsp_pool_buf_t *item = NULL;
+    struct xrp_buffer *buf;
+    enum xrp_status status;
+    size_t class_size;
+    int idx = csi_dsp_buf_pool_class(size,&class_size);
+
+    pthread_mutex_lock(&pool->mutex);
+    if(idx >= 0 && !list_empty(&pool->free_list[idx]))
+    {
+        item = list_first_entry(&pool->free_list[idx],csi_dsp_pool_buf_t,head);
+        list_del(&item->head);
+        pool->stats.cached_bytes -= item->size;
+        pool->stats.cached_num--;
+        pool->stats.hits++;
+    }
+    else
+    {
+        pool->stats.misses++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(item)
+    {
+        buf = item->buf;
+        *vir = item->vir;
+        free(item);
+        return buf;
+    }
+    buf = xrp_create_buffer(device,class_size,NULL,&status);
+    if(status != XRP_STATUS_SUCCESS)
+        return NULL;
+    *vir = xrp_map_buffer(buf,0,class_size,XRP_READ_WRITE,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        xrp_release_buffer(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Take over the caller's reference to buf and its mapping vir, the buffer may be reused */
+void csi_dsp_buf_pool_put(csi_dsp_buf_pool_t *pool,struct xrp_buffer *buf,void *vir)
+{
+    csi_dsp_pool_buf_t *item;
+    enum xrp_status status;
+    size_t size,class_size;
+    int idx;
+
+    xrp_buffer_get_info(buf,XRP_BUFFER_SIZE_SIZE_T,&size,sizeof(size),&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        csi_dsp_buf_pool_release(buf,vir);
+        return;
+    }
+    idx = csi_dsp_buf_pool_class(size,&class_size);
+    if(idx < 0 || class_size != size)
+    {
+        csi_dsp_buf_pool_release(buf,vir);
+        return;
+    }
+    item = malloc(sizeof(*item));
+    if(!item)
+    {
+        csi_dsp_buf_pool_release(buf,vir);
+        return;
+    }
+    item->buf = buf;
+    item->vir = vir;
+    item->size = size;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->stats.cached_bytes + size > pool->stats.high_water)
+    {
+        pool->stats.trims++;
+        pthread_mutex_unlock(&pool->mutex);
+        free(item);
+        csi_dsp_buf_pool_release(buf,vir);
+        return;
+    }
+    list_add(&item->head,&pool->free_list[idx]);
+    pool->stats.cached_bytes += size;
+    pool->stats.cached_num++;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int csi_dsp_set_buf_pool_limit(void *dsp,size_t high_water)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->buf_pool.mutex);
+    instance->buf_pool.stats.high_water = high_water;
+    pthread_mutex_unlock(&instance->buf_pool.mutex);
+    csi_dsp_buf_pool_trim(&instance->buf_pool,high_water);
+    return 0;
+}
+
+int csi_dsp_get_buf_pool_stats(void *dsp,csi_dsp_buf_pool_stats_t *stats)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance || !stats)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->buf_pool.mutex);
+    *stats = instance->buf_pool.stats;
+    pthread_mutex_unlock(&instance->buf_pool.mutex);
+    return 0;
+}
+
+/*
+ * Property arena: one device buffer per task, carved into blocks in ring
+ * order. Every block starts with a csi_dsp_arena_hdr_t; freed blocks are
+ * only reclaimed once all older blocks are free as well, which is the
+ * common case since requests of a task complete in order.
+ */
+typedef struct csi_dsp_arena_hdr{
+    uint32_t size;          /* block size including this header */
+    uint32_t free;
+    uint64_t reserved;
+}csi_dsp_arena_hdr_t;
+
+#define CSI_DSP_ARENA_ALIGN 64
+
+csi_dsp_sett_arena_t *csi_dsp_sett_arena_create(struct xrp_device *device,size_t size)
+{
+    csi_dsp_sett_arena_t *arena = malloc(sizeof(*arena));
+    enum xrp_status status;
+
+    if(!arena)
+        return NULL;
+    arena->buf = xrp_create_buffer(device,size,NULL,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"create property arena fail\n");
+        free(arena);
+        return NULL;
+    }
+    xrp_buffer_get_info(arena->buf,XRP_BUFFER_USER_ADDR,&arena->virt,sizeof(uint64_t),&status);
+    if(status == XRP_STATUS_SUCCESS)
+        xrp_buffer_get_info(arena->buf,XRP_BUFFER_PHY_ADDR,&arena->phy,sizeof(uint64_t),&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"get property arena addr fail\n");
+        xrp_release_buffer(arena->buf);
+        free(arena);
+        return NULL;
+    }
+    pthread_mutex_init(&arena->mutex,NULL);
+    arena->size = size;
+    arena->head = 0;
+    arena->tail = 0;
+    arena->used = 0;
+    return arena;
+}
+
+void csi_dsp_sett_arena_destroy(csi_dsp_sett_arena_t *arena)
+{
+    if(!arena)
+        return;
+    if(arena->used)
+        DSP_PRINT(WARNING,"property arena released with %zu bytes in use\n",arena->used);
+    pthread_mutex_destroy(&arena->mutex);
+    xrp_release_buffer(arena->buf);
+    free(arena);
+}
+
+int csi_dsp_sett_arena_contains(csi_dsp_sett_arena_t *arena,uint64_t phy)
+{
+    return arena && phy >= arena->phy && phy < arena->phy + arena->size;
+}
+
+/* Return the device address of a block for sz bytes, 0 if out of space */
+uint64_t csi_dsp_sett_arena_alloc(csi_dsp_sett_arena_t *arena,size_t sz,void **virt)
+{
+    size_t need = (sizeof(csi_dsp_arena_hdr_t) + sz + CSI_DSP_ARENA_ALIGN - 1) &
+                  ~(size_t)(CSI_DSP_ARENA_ALIGN - 1);
+    csi_dsp_arena_hdr_t *hdr;
+    size_t off;
+
+    pthread_mutex_lock(&arena->mutex);
+    if(arena->used && arena->head <= arena->tail)
+    {
+        /* wrapped, free space is [head, tail) */
+        if(arena->tail - arena->head < need)
+            goto full;
+    }
+    else if(arena->size - arena->head < need)
+    {
+        /* not enough room up to the end, skip it and wrap around */
+        if(arena->tail < need)
+            goto full;
+        if(arena->head < arena->size)
+        {
+            hdr = (csi_dsp_arena_hdr_t *)(arena->virt + arena->head);
+            hdr->size = arena->size - arena->head;
+            hdr->free = 1;
+            arena->used += hdr->size;
+        }
+        arena->head = 0;
+    }
+    off = arena->head;
+    hdr = (csi_dsp_arena_hdr_t *)(arena->virt + off);
+    hdr->size = need;
+    hdr->free = 0;
+    arena->head += need;
+    arena->used += need;
+    pthread_mutex_unlock(&arena->mutex);
+    *virt = hdr + 1;
+    return arena->phy + off + sizeof(*hdr);
+
+full:
+    pthread_mutex_unlock(&arena->mutex);
+    return 0;
+}
+
+/* Room left in the block of phy for its data */
+size_t csi_dsp_sett_arena_block_size(csi_dsp_sett_arena_t *arena,uint64_t phy,void **virt)
+{
+    csi_dsp_arena_hdr_t *hdr = (csi_dsp_arena_hdr_t *)(arena->virt + (phy - arena->phy)) - 1;
+
+    *virt = hdr + 1;
+    return hdr->size - sizeof(*hdr);
+}
+
+void csi_dsp_sett_arena_free(csi_dsp_sett_arena_t *arena,uint64_t phy)
+{
+    csi_dsp_arena_hdr_t *hdr = (csi_dsp_arena_hdr_t *)(arena->virt + (phy - arena->phy)) - 1;
+
+    pthread_mutex_lock(&arena->mutex);
+    hdr->free = 1;
+    while(arena->used)
+    {
+        hdr = (csi_dsp_arena_hdr_t *)(arena->virt + arena->tail);
+        if(!hdr->free)
+            break;
+        arena->used -= hdr->size;
+        arena->tail += hdr->size;
+        if(arena->tail == arena->size)
+            arena->tail = 0;
+    }
+    if(!arena->used)
+    {
+        arena->head = 0;
+        arena->tail = 0;
+    }
+    pthread_mutex_unlock(&arena->mutex);
+}
@@ -60,6 +60,8 @@ int csi_dsp_cmd_send(const struct xrp_queue *queue,int cmd_type,void * cmd_paylo
 }
 
 
+static void csi_dsp_task_free_result_ring(struct csi_dsp_task_handler *task);
+
 /*********************************/
 static int dsp_register_report_item_to_dsp(struct csi_dsp_task_handler *task)
 {
@@ -112,6 +114,9 @@ int csi_dsp_delete_instance(void* dsp)
     // printf("%s,entry\n",__FUNCTION__);
     struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
     csi_dsp_disable_heartbeat_check();
+    csi_dsp_buf_pool_destroy(&instance->buf_pool);
+    csi_dsp_dmabuf_cache_destroy(&instance->dmabuf_cache);
+    csi_dsp_algo_cache_destroy(&instance->algo_cache);
     xrp_release_queue(instance->comm_queue);
     xrp_release_device(instance->device);
     free(dsp);
@@ -125,6 +130,7 @@ void* csi_dsp_create_instance(int dsp_id)
 	struct csi_dsp_instance *instance = NULL;
     struct xrp_queue * queue;
     unsigned char ns_id[]=XRP_PS_NSID_COMMON_CMD;
+    const char *env;
     
     dsp_InitEnv();
 
@@ -157,6 +163,12 @@ void* csi_dsp_create_instance(int dsp_id)
     }
     instance->comm_queue=queue;
     INIT_LIST_HEAD(&instance->task_list);
+    csi_dsp_buf_pool_init(&instance->buf_pool);
+    csi_dsp_dmabuf_cache_init(&instance->dmabuf_cache,device);
+    csi_dsp_algo_cache_init(&instance->algo_cache);
+    /* needs a firmware that understands PS_CMD_COMPOUND */
+    env = getenv("CSI_DSP_COMPOUND");
+    instance->no_compound = !(env && strtol(env,NULL,0));
     //csi_dsp_enable_heartbeat_check(instance,10);
     DSP_PRINT(INFO,"dsp instance create successulf\n");
     return instance;
@@ -201,55 +213,35 @@ static void dsp_task_init(struct csi_dsp_task_handler * task)
     task->fe.frontend_type = CSI_DSP_FE_TYPE_INVALID;
     task->be.backend_type = CSI_DSP_BE_TYPE_INVALID;
     task->report_id =-1;
+    task->result_buf = NULL;
+    task->result_ring = NULL;
+    task->result_cb = NULL;
+    task->sett_arena = NULL;
+    task->algo_entry = NULL;
+    task->param = NULL;
 } 
-/* queue ns 应该通过DSP侧来分配保证唯一性，区分不同进程的task.*/
-void *csi_dsp_create_task(void* dsp,csi_dsp_task_mode_e task_type)
+/*
+ * Host side of a task the DSP has allocated: queue, completion manager and
+ * instance list. Used by csi_dsp_create_task and compound transactions.
+ */
+int csi_dsp_task_setup(struct csi_dsp_instance *instance,struct csi_dsp_task_handler *task,
+                       dsp_handler_item_t *task_item,csi_dsp_task_mode_e task_type,
+                       const struct csi_dsp_task_create_resp *resp)
 {
-        struct csi_dsp_task_handler * task;
-        struct csi_dsp_task_create_resp resp;
         struct xrp_queue *queue;
-        struct csi_dsp_task_create_req config_para;
         enum xrp_status status;
-        struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
-        dsp_handler_item_t *task_item =NULL;
-        if(!instance)
-        {
-            DSP_PRINT(ERROR,"param check fail\n");
-            return NULL;
-        }
-        task_item = malloc(sizeof(*task_item));
-        if(!task_item)
-        {
-            DSP_PRINT(ERROR,"malloc fail\n");
-            goto error1;
-        }
-        task= malloc(sizeof(*task));
-        if(!task)
-        {
-            DSP_PRINT(ERROR,"malloc fail\n");
-            goto error;
-        }
+
         task_item->handler = task;
-        config_para.type=task_type;
-        if(csi_dsp_cmd_send(instance->comm_queue,PS_CMD_TASK_ALLOC,&config_para,sizeof(struct csi_dsp_task_create_req),&resp,sizeof(resp),NULL))
-        {
-            DSP_PRINT(ERROR,"PS_CMD_TASK_ALLOC fail\n");
-            goto error;
-        }
-        if(resp.status!=CSI_DSP_OK)
-        {
-            DSP_PRINT(ERROR,"task creat fail:%d\n",resp.status);
-            goto error;
-        }
         task->queue = NULL;
+        task->private = NULL;
         if(task_type == CSI_DSP_TASK_SW_TO_SW || task_type == CSI_DSP_TASK_SW_TO_HW)
         {
 
-            queue = xrp_create_ns_queue(instance->device, resp.task_ns, &status);
+            queue = xrp_create_ns_queue(instance->device, resp->task_ns, &status);
             if(status!=XRP_STATUS_SUCCESS)
             {
                 DSP_PRINT(ERROR,"queue creat fail\n");
-                goto error;
+                return -1;
             }
             task->queue=queue;
 
@@ -258,32 +250,79 @@ void *csi_dsp_create_task(void* dsp,csi_dsp_task_mode_e task_type)
             {
                 DSP_PRINT(ERROR,"malloc fail\n");
                 xrp_release_queue(queue);
-                goto error;
+                return -1;
             }
-            INIT_LIST_HEAD(&sw_task_ctx->event_list);
+            INIT_LIST_HEAD(&sw_task_ctx->run_list);
+            INIT_LIST_HEAD(&sw_task_ctx->done_list);
+            INIT_LIST_HEAD(&sw_task_ctx->free_list);
             sw_task_ctx->event_num = 0;
             pthread_mutex_init(&sw_task_ctx->mutex, NULL);
+            pthread_cond_init(&sw_task_ctx->done_cond, NULL);
             task->private = sw_task_ctx;
             if(status != XRP_STATUS_SUCCESS)
             {
                 DSP_PRINT(ERROR,"xrp_create_buffer_group fail\n");
                 free(sw_task_ctx);
                 xrp_release_queue(queue);
-                goto error;
+                return -1;
             }     
         }
         else{
             // HW  task create report
         }
         task->buffers = xrp_create_buffer_group(&status);
-        memcpy(task->task_ns,resp.task_ns,TASK_NAME_LINE);
-        task->task_id=resp.task_id;
+        memcpy(task->task_ns,resp->task_ns,TASK_NAME_LINE);
+        task->task_id=resp->task_id;
         task->instance=instance;
         task->mode=task_type;
         list_add_tail(&task_item->head,&instance->task_list);
         dsp_task_init(task);
         // task->report_id=-1;
         DSP_PRINT(INFO,"task(%d) ,ns(%x)create successful!\n",task->task_id,task->task_ns[0]);
+        return 0;
+}
+
+/* queue ns 应该通过DSP侧来分配保证唯一性，区分不同进程的task.*/
+void *csi_dsp_create_task(void* dsp,csi_dsp_task_mode_e task_type)
+{
+        struct csi_dsp_task_handler * task;
+        struct csi_dsp_task_create_resp resp;
+        struct csi_dsp_task_create_req config_para;
+        struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+        dsp_handler_item_t *task_item =NULL;
+        if(!instance)
+        {
+            DSP_PRINT(ERROR,"param check fail\n");
+            return NULL;
+        }
+        task_item = malloc(sizeof(*task_item));
+        if(!task_item)
+        {
+            DSP_PRINT(ERROR,"malloc fail\n");
+            goto error1;
+        }
+        task= malloc(sizeof(*task));
+        if(!task)
+        {
+            DSP_PRINT(ERROR,"malloc fail\n");
+            goto error;
+        }
+        task_item->handler = task;
+        config_para.type=task_type;
+        if(csi_dsp_cmd_send(instance->comm_queue,PS_CMD_TASK_ALLOC,&config_para,sizeof(struct csi_dsp_task_create_req),&resp,sizeof(resp),NULL))
+        {
+            DSP_PRINT(ERROR,"PS_CMD_TASK_ALLOC fail\n");
+            goto error;
+        }
+        if(resp.status!=CSI_DSP_OK)
+        {
+            DSP_PRINT(ERROR,"task creat fail:%d\n",resp.status);
+            goto error;
+        }
+        if(csi_dsp_task_setup(instance,task,task_item,task_type,&resp))
+        {
+            goto error;
+        }
         return task;
 
 error:
@@ -303,10 +342,25 @@ void csi_dsp_destroy_task(void *task_ctx)
     if(task->queue)
         xrp_release_queue(task->queue);
 
+    if(task->private)
+    {
+        csi_dsp_sw_task_manager_t *sw_task_ctx = (csi_dsp_sw_task_manager_t *)task->private;
+        task_event_item_t *item, *tmp;
+
+        list_for_each_entry_safe(item,tmp,&sw_task_ctx->free_list,head)
+            free(item);
+        pthread_cond_destroy(&sw_task_ctx->done_cond);
+        pthread_mutex_destroy(&sw_task_ctx->mutex);
+        free(sw_task_ctx);
+    }
+
     if(task->report_id>=0)
     {
         xrp_remove_report_item(task->instance->report_impl,task->report_id);
     }
+    csi_dsp_task_free_result_ring(task);
+    csi_dsp_sett_arena_destroy(task->sett_arena);
+    csi_dsp_algo_cache_put(&task->instance->algo_cache,task->algo_entry);
 
     if(task->buffers)
     {
@@ -328,6 +382,8 @@ void csi_dsp_destroy_task(void *task_ctx)
     {
          DSP_PRINT(ERROR,"TASK FREE Fail due to %d\n",resp);
     }
+    /* the DSP drops its reference with the task */
+    csi_dsp_task_free_param(task);
     DSP_PRINT(INFO,"task(%d) ,ns(%x) destroy successful!\n",task->task_id,task->task_ns[0]);
     free(task);
 }
@@ -601,94 +657,108 @@ int csi_dsp_task_load_algo(void *task_ctx, csi_dsp_algo_load_req_t* config_para)
     return 0;
 }
 
-int csi_dsp_task_acquire_algo(void *task_ctx,char*name)
+/* Load a held library entry for task, the task takes over the reference */
+static int csi_dsp_task_load_entry(struct csi_dsp_task_handler * task,csi_dsp_algo_entry_t *entry)
 {
-    FILE * fp;
-    int   size;
-    int rev = 0;
-    char file[128];
     struct xrp_buffer *buffer = NULL;
     enum xrp_status status;
-    void* buf_ptr;
     uint64_t buf_phy;
     struct xrp_buffer_group *buffer_group =NULL;
     csi_dsp_algo_load_resp_t resp;
     csi_dsp_algo_load_req_t config_para;
-    if(task_ctx == NULL || name ==NULL || strlen(name)>100 )
+
+    buffer = csi_dsp_algo_entry_buffer(entry,&buf_phy);
+    buffer_group = xrp_create_buffer_group(&status);
+    if(status != XRP_STATUS_SUCCESS)
     {
-        DSP_PRINT(ERROR,"param check fail\n");
-        return -1;
+        DSP_PRINT(ERROR,"malloc buf group fail\n");
+        goto err;
     }
+    xrp_add_buffer_to_group(buffer_group,buffer,XRP_READ,&status);
+    DSP_PRINT(DEBUG,"algo buf phy:0x%lx\n",buf_phy);
 
-    sprintf(file,"/lib/firmware/%s.lib",name);
-    DSP_PRINT(DEBUG,"open file:%s\n",file);
-    fp = fopen(file, "rb");
-    
-    if(fp==NULL)
+    config_para.task_id= task->task_id;
+    config_para.algo_id =-1;
+    config_para.algo_ptr = buf_phy;
+    if(csi_dsp_cmd_send(task->instance->comm_queue,PS_CMD_ALGO_LOAD, &config_para,sizeof(csi_dsp_algo_load_req_t),&resp,sizeof(resp),buffer_group))
     {
-        DSP_PRINT(ERROR,"open file fail\n");
-        return -1;
+        DSP_PRINT(ERROR,"send cmd fail\n");
+        goto err;
+    }
+    if(resp.status != CSI_DSP_OK)
+    {
+        DSP_PRINT(ERROR,"resp fail %d\n",resp.status);
+        goto err;
     }
-    fseek(fp , 0, SEEK_END);
-    size = ftell(fp);
-    rewind(fp);
+    xrp_release_buffer_group(buffer_group);
 
-    if(size ==0)
+    csi_dsp_algo_cache_put(&task->instance->algo_cache,task->algo_entry);
+    task->algo_entry = entry;
+    task->algo.algo_id=config_para.algo_id;
+    task->algo.algo_ptr = config_para.algo_ptr;
+    return 0;
+
+err:
+    if(buffer_group)
+        xrp_release_buffer_group(buffer_group);
+    csi_dsp_algo_cache_put(&task->instance->algo_cache,entry);
+    return -1;
+}
+
+int csi_dsp_task_acquire_algo(void *task_ctx,char*name)
+{
+    char file[128];
+    csi_dsp_algo_entry_t *entry;
+    if(task_ctx == NULL || name ==NULL || strlen(name)>100 )
     {
+        DSP_PRINT(ERROR,"param check fail\n");
         return -1;
     }
 
+    sprintf(file,"/lib/firmware/%s.lib",name);
+    DSP_PRINT(DEBUG,"open file:%s\n",file);
+
     struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
-    buffer_group = xrp_create_buffer_group(&status);
-    if(status != XRP_STATUS_SUCCESS)
+    /* read into device memory once, later acquires only send the load command */
+    entry = csi_dsp_algo_cache_get(&task->instance->algo_cache,task->instance->device,file);
+    if(entry == NULL)
     {
-        DSP_PRINT(ERROR,"malloc buf group fail\n");
         return -1;
     }
-    buffer = xrp_create_buffer(task->instance->device,size,NULL,&status);
-    if(status != XRP_STATUS_SUCCESS)
+    if(csi_dsp_task_load_entry(task,entry))
     {
-       DSP_PRINT(ERROR,"malloc buf fail\n");
         return -1;
     }
-    xrp_add_buffer_to_group(buffer_group,buffer,XRP_READ,&status);
-    xrp_buffer_get_info(buffer,XRP_BUFFER_PHY_ADDR,&buf_phy,sizeof(buf_phy),&status);
-    xrp_buffer_get_info(buffer,XRP_BUFFER_USER_ADDR,&buf_ptr,sizeof(buf_ptr),&status);
-    DSP_PRINT(DEBUG,"algo buf virtual:0x%p, phy:0x%lx\n", buf_ptr,buf_phy);
+    DSP_PRINT(INFO,"task %d acquire algo:%s sucessful!\n",task->task_id,name);
+    return 0;
+}
 
-    rev = fread(buf_ptr, 1, size, fp);
-    if(rev != size) 
-    {
-      DSP_PRINT(ERROR,"Loading file failed\n");
-      return -1;
-    }
-    fclose(fp);
-    config_para.task_id= task->task_id;
-    config_para.algo_id =-1;
-    config_para.algo_ptr = buf_phy;
-    if(csi_dsp_cmd_send(task->instance->comm_queue,PS_CMD_ALGO_LOAD, &config_para,sizeof(csi_dsp_algo_load_req_t),&resp,sizeof(resp),buffer_group))
+int csi_dsp_task_attach_algo(void *task_ctx,void *handle)
+{
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
+    csi_dsp_algo_prefetch_t *prefetch = (csi_dsp_algo_prefetch_t *)handle;
+    csi_dsp_algo_entry_t *entry;
+
+    if(task == NULL || prefetch == NULL || prefetch->instance != task->instance)
     {
-        DSP_PRINT(ERROR,"send cmd fail\n");
+        DSP_PRINT(ERROR,"param check fail\n");
         return -1;
     }
-    if(resp.status != CSI_DSP_OK)
+    entry = csi_dsp_algo_prefetch_wait(prefetch);
+    if(entry == NULL)
     {
-        DSP_PRINT(ERROR,"resp fail %d\n",resp.status);
-        return -1; 
+        DSP_PRINT(ERROR,"algo %s was not loaded\n",prefetch->file);
+        return -1;
     }
-
-    if(buffer)
+    csi_dsp_algo_cache_hold(&task->instance->algo_cache,entry);
+    if(csi_dsp_task_load_entry(task,entry))
     {
-        // memset(buf_ptr,0xee,config_para->sett_length);
-        xrp_release_buffer(buffer);
-        xrp_release_buffer_group(buffer_group);
+        return -1;
     }
-    task->algo.algo_id=config_para.algo_id;
-    task->algo.algo_ptr = config_para.algo_ptr;
-    DSP_PRINT(INFO,"task %d acquire algo:%s sucessful!\n",task->task_id,name);
+    DSP_PRINT(INFO,"task %d attach algo:%s sucessful!\n",task->task_id,prefetch->file);
     return 0;
-
 }
+
 int csi_dsp_task_start(void *task_ctx)
 {
     csi_dsp_status_e resp;
@@ -740,6 +810,18 @@ int csi_dsp_task_stop(void *task_ctx)
 
 }
 
+/* PS_CMD_REPORT_CONFIG payload for the report of task */
+void csi_dsp_task_report_config(struct csi_dsp_task_handler *task,enum cmd_type flag,
+                                struct report_config_msg *config)
+{
+    memset(config,0,sizeof(*config));
+    config->report_id=task->report_id;
+    config->flag = flag;
+    memcpy(config->task,task->task_ns,TASK_NAME_LINE);
+    config->addr = task->result_buf ? task->result_phy : 0xdeadbeef;
+    config->size = task->report_size; 
+}
+
 static int csi_dsp_config_report_item_to_dsp(void *task_ctx,enum cmd_type flag)
 {
     csi_dsp_status_e resp;
@@ -750,11 +832,7 @@ static int csi_dsp_config_report_item_to_dsp(void *task_ctx,enum cmd_type flag)
         DSP_PRINT(ERROR,"param check fail\n");
         return -1;
     }
-    config.report_id=task->report_id;
-    config.flag = flag;
-    memcpy(config.task,task->task_ns,TASK_NAME_LINE);
-    config.addr = 0xdeadbeef;
-    config.size = task->report_size; 
+    csi_dsp_task_report_config(task,flag,&config);
     if(csi_dsp_cmd_send(task->instance->comm_queue,PS_CMD_REPORT_CONFIG,&config,sizeof(struct report_config_msg),&resp,sizeof(resp),NULL))
     {
         DSP_PRINT(ERROR,"send PS_CMD_REPORT_CONFIG fail\n");
@@ -769,12 +847,122 @@ static int csi_dsp_config_report_item_to_dsp(void *task_ctx,enum cmd_type flag)
 }
 
 
-int csi_dsp_task_register_cb(void *task_ctx,
+/*
+ * Report handler of tasks with a result ring: results are handed out
+ * in place and the slot is returned to the DSP afterwards, every other
+ * report goes to the task callback.
+ */
+static int csi_dsp_task_report_handler(void *context,void *data)
+{
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)context;
+    csi_dsp_report_item_t *item = (csi_dsp_report_item_t *)data;
+    csi_dsp_result_ring_t *ring = task->result_ring;
+    csi_dsp_result_ref_t *ref = &item->result;
+
+    if(item->type != CSI_DSP_REPORT_RESULT_BUF)
+        return task->cb ? task->cb(task->context,data) : 0;
+
+    if(ref->slot >= ring->slot_num || ref->offset > ring->slot_size ||
+       ref->size > ring->slot_size - ref->offset)
+    {
+        DSP_PRINT(WARNING,"invalid result ref slot:%u,offset:%u,size:%u\n",
+                  ref->slot,ref->offset,ref->size);
+    }
+    else if(task->result_cb)
+    {
+        task->result_cb(task->result_context,
+                        task->result_slots + (size_t)ref->slot * ring->slot_size + ref->offset,
+                        ref->size);
+    }
+    __atomic_store_n(&ring->tail,ring->tail + 1,__ATOMIC_RELEASE);
+    return 0;
+}
+
+int csi_dsp_task_register_result_cb(void *task_ctx,
+                            size_t slot_size,
+                            int slot_num,
+                            int (*cb)(void*context,void*result,size_t size),
+                            void* context)
+{
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
+    size_t ring_size = (sizeof(csi_dsp_result_ring_t) + 63) & ~(size_t)63;
+    enum xrp_status status;
+    size_t size;
+
+    if(!task || !cb || slot_num <= 0 || !slot_size)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    if(task->report_id >= 0 || task->result_buf)
+    {
+        DSP_PRINT(WARNING,"result ring must be set before the report callback\n");
+        return -1;
+    }
+    slot_size = (slot_size + 63) & ~(size_t)63;
+    size = ring_size + slot_size * slot_num;
+    task->result_buf = xrp_create_buffer(task->instance->device,size,NULL,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"create result buffer fail\n");
+        task->result_buf = NULL;
+        return -1;
+    }
+    task->result_ring = xrp_map_buffer(task->result_buf,0,size,XRP_READ_WRITE,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"map result buffer fail\n");
+        goto err_release;
+    }
+    xrp_buffer_get_info(task->result_buf,XRP_BUFFER_PHY_ADDR,&task->result_phy,
+                        sizeof(task->result_phy),&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"get result buffer phy addr fail\n");
+        goto err_unmap;
+    }
+    task->result_slots = (char *)task->result_ring + ring_size;
+    task->result_ring->head = 0;
+    task->result_ring->tail = 0;
+    task->result_ring->slot_num = slot_num;
+    task->result_ring->slot_size = slot_size;
+    task->result_ring->slot_addr = task->result_phy + ring_size;
+    task->result_cb = cb;
+    task->result_context = context;
+    DSP_PRINT(INFO,"result ring %d x %zu at 0x%llx\n",slot_num,slot_size,task->result_phy);
+    return 0;
+
+err_unmap:
+    xrp_unmap_buffer(task->result_buf,task->result_ring,&status);
+err_release:
+    xrp_release_buffer(task->result_buf);
+    task->result_buf = NULL;
+    task->result_ring = NULL;
+    return -1;
+}
+
+static void csi_dsp_task_free_result_ring(struct csi_dsp_task_handler *task)
+{
+    enum xrp_status status;
+
+    if(!task->result_buf)
+        return;
+    xrp_unmap_buffer(task->result_buf,task->result_ring,&status);
+    xrp_release_buffer(task->result_buf);
+    task->result_buf = NULL;
+    task->result_ring = NULL;
+    task->result_cb = NULL;
+}
+
+/*
+ * Host side of a report callback: reports of a task with a result ring go
+ * through csi_dsp_task_report_handler. The DSP is told separately.
+ */
+int csi_dsp_task_add_report(struct csi_dsp_task_handler *task,
                             int (*cb)(void*context,void*data),
                             void* context,
                             size_t data_size)
 {
-    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
     task->report_id = task->task_id;
     if(task->report_id<0)
     {
@@ -782,19 +970,35 @@ int csi_dsp_task_register_cb(void *task_ctx,
        return -1;
     }
     task->report_size = data_size;
+    task->cb = cb;
+    task->context = context;
     if(xrp_add_report_item_with_id(task->instance->report_impl,
-								        cb,task->report_id,context,data_size)<0)
+                                   task->result_ring ? csi_dsp_task_report_handler : cb,
+                                   task->report_id,
+                                   task->result_ring ? task : context,
+                                   data_size)<0)
     {
         DSP_PRINT(WARNING,"report id is invalid\n");
+        task->report_id = -1;
         return -1;
     }
+    return 0;
+}
+
+int csi_dsp_task_register_cb(void *task_ctx,
+                            int (*cb)(void*context,void*data),
+                            void* context,
+                            size_t data_size)
+{
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
+
+    if(csi_dsp_task_add_report(task,cb,context,data_size))
+        return -1;
     if(csi_dsp_config_report_item_to_dsp(task,CMD_SETUP))
     {
         DSP_PRINT(WARNING,"report id is invalid\n");
         return -1;
     }
-    task->cb = cb;
-    task->context = context;
     DSP_PRINT(INFO,"new reprot %d is created and register to DSP\n",task->report_id);
     return 0;
 }
@@ -816,6 +1020,7 @@ int csi_dsp_ps_task_unregister_cb(void *task_ctx)
     xrp_remove_report_item(task->instance->report_impl,task->report_id);
     DSP_PRINT(INFO,"new reprot %d is unregister to DSP\n",task->report_id);
     task->report_id =-1;
+    csi_dsp_task_free_result_ring(task);
    
     return 0;
     
@@ -825,6 +1030,7 @@ struct csi_sw_task_req* csi_dsp_task_create_request(void *task_ctx)
 {
     struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)task_ctx;
     struct csi_sw_task_req*  req = NULL;
+    csi_dsp_request_host_t *host;
     void* req_ptr,*event_ptr;
     enum xrp_status status;
     if(task->mode != CSI_DSP_TASK_SW_TO_SW)
@@ -837,12 +1043,13 @@ struct csi_sw_task_req* csi_dsp_task_create_request(void *task_ctx)
         DSP_PRINT(WARNING,"algo is not loaded:%d\n",task->algo.algo_id);
         return NULL;
     }
-    req = malloc(sizeof(*req));
-    if(req == NULL)
+    host = calloc(1,sizeof(*host));
+    if(host == NULL)
     {
         DSP_PRINT(WARNING,"memroy alloc fail\n");
         return NULL;
     }
+    req = &host->req;
 
     req->priv = xrp_create_buffer_group(&status);
     if(status != XRP_STATUS_SUCCESS)
@@ -864,14 +1071,55 @@ struct csi_sw_task_req* csi_dsp_task_create_request(void *task_ctx)
 }
 
 
+/* Find the property buffer of req in its buffer group, NULL if none */
+static struct xrp_buffer *csi_dsp_request_sett_buffer(struct csi_sw_task_req* req)
+{
+    struct xrp_buffer_group *group = (struct xrp_buffer_group *)req->priv;
+    struct xrp_buffer *buffer;
+    enum xrp_status status;
+    uint64_t buf_phy;
+    size_t buf_num;
+    size_t index;
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)req->task;
+
+    if(!req->sett_ptr || csi_dsp_sett_arena_contains(task->sett_arena,req->sett_ptr))
+        return NULL;
+    xrp_buffer_group_get_info(group,XRP_BUFFER_GROUP_SIZE_SIZE_T,0,&buf_num,sizeof(buf_num),&status);
+    if(status!=XRP_STATUS_SUCCESS)
+        return NULL;
+    for(index=0; index<buf_num; index++)
+    {
+        buffer = xrp_get_buffer_from_group(group,index,&status);
+        xrp_buffer_get_info(buffer,XRP_BUFFER_PHY_ADDR,&buf_phy,sizeof(buf_phy),&status);
+        if(buf_phy == req->sett_ptr)
+            return buffer;
+    }
+    return NULL;
+}
+
+int csi_dsp_request_rearm(struct csi_sw_task_req* req)
+{
+    if(!req || !req->priv)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    if(req->status == CSI_DSP_SW_REQ_RUNNING)
+    {
+        DSP_PRINT(WARNING,"req %d is still running\n",req->request_id);
+        return -1;
+    }
+    req->status = CSI_DSP_SW_REQ_IDLE;
+    DSP_PRINT(DEBUG,"req %d is rearmed\n",req->request_id);
+    return 0;
+}
+
 int csi_dsp_task_release_request(struct csi_sw_task_req*  req)
 {
     struct xrp_buffer_group *group;
     enum xrp_status status;
     int buf_idx,plane_idx;;
     struct xrp_buffer *buffer;
-    int index;
-    size_t buf_num;
     struct csi_dsp_task_handler * task =(struct csi_dsp_task_handler *) req->task;
     if(req == NULL)
     {
@@ -892,7 +1140,7 @@ int csi_dsp_task_release_request(struct csi_sw_task_req*  req)
         {
             for(plane_idx =0 ;plane_idx<req->buffers[buf_idx].plane_count;plane_idx++)
             {
-                 xrp_release_dma_buf(task->instance->device,req->buffers[buf_idx].planes[plane_idx].fd,&status);
+                 csi_dsp_dmabuf_cache_put(&task->instance->dmabuf_cache,req->buffers[buf_idx].planes[plane_idx].buf_phy);
             }
         }
         else
@@ -901,31 +1149,19 @@ int csi_dsp_task_release_request(struct csi_sw_task_req*  req)
             {
                 // printf("release buf %d plane %d\n",buf_idx,plane_idx);
                 buffer = xrp_get_buffer_from_group(group,req->buffers[buf_idx].planes[plane_idx].fd,&status);
-                xrp_unmap_buffer(buffer,(void *)req->buffers[buf_idx].planes[plane_idx].buf_vir,&status);
-                xrp_release_buffer(buffer);
+                /* the pool keeps the mapping */
+                csi_dsp_buf_pool_put(&task->instance->buf_pool,buffer,
+                                     (void *)req->buffers[buf_idx].planes[plane_idx].buf_vir);
             }
         }
 
     }
     /*free sett buf   */
-    xrp_buffer_group_get_info(group,XRP_BUFFER_GROUP_SIZE_SIZE_T, 0,&buf_num,sizeof(buf_num),&status);
-    if(status!=XRP_STATUS_SUCCESS)
-    {
-        DSP_PRINT(WARNING,"Get sett buffer release fail\n");
-        return -1;
-    }
-    uint64_t buf_phy;
-    for(index=0; index<buf_num; index++)
-    {
-        buffer = xrp_get_buffer_from_group(group,index,&status);
-        xrp_buffer_get_info(buffer,XRP_BUFFER_PHY_ADDR,&buf_phy,sizeof(buf_phy),&status);
-        if(buf_phy == req->sett_ptr)
-        {
-            // xrp_unmap_buffer(buffer,(void *)req->buffers[buf_idx].planes[plane_idx].buf_vir,&status);
-            xrp_release_buffer(buffer);
-            break;
-        }
-    }
+    if(csi_dsp_sett_arena_contains(task->sett_arena,req->sett_ptr))
+        csi_dsp_sett_arena_free(task->sett_arena,req->sett_ptr);
+    buffer = csi_dsp_request_sett_buffer(req);
+    if(buffer)
+        xrp_release_buffer(buffer);
 
     xrp_release_buffer_group(group);
     DSP_PRINT(DEBUG,"req %d is release successful!\n",req->request_id);
@@ -1016,21 +1252,14 @@ int csi_dsp_task_create_buffer(void * task_ctx,struct csi_dsp_buffer * buffer)
                 {
                     int flag = buffer->dir == CSI_DSP_BUFFER_IN ?XRP_READ:XRP_WRITE;
 
-
-                    xrp_import_dma_buf(task->instance->device,buffer->planes[i].fd,flag,&buffer->planes[i].buf_phy,
-                                               &buffer->planes[i].buf_vir,&buffer->planes[i].size,&status);
-                    if(status !=XRP_STATUS_SUCCESS )
-                    {
-                        DSP_PRINT(WARNING,"dma buf import fail\n");
+                    if(csi_dsp_dmabuf_cache_get(&task->instance->dmabuf_cache,buffer->planes[i].fd,flag,&buffer->planes[i]))
                         goto err_2;
-                    }
-
                 }
                 break;
                 err_2:
                     for(j=0;j<i;j++)
                     {
-                            xrp_release_dma_buf(task->instance->device,buffer->planes[i].fd,&status);
+                            csi_dsp_dmabuf_cache_put(&task->instance->dmabuf_cache,buffer->planes[j].buf_phy);
                     }
                     return -1;
          default:
@@ -1078,8 +1307,7 @@ int csi_dsp_task_free_buffer(void * task_ctx,struct csi_dsp_buffer * buffer)
          case CSI_DSP_BUF_TYPE_DMA_BUF_IMPORT:
                 for(i=0;i<buffer->plane_count;i++)
                 {
-                    xrp_release_dma_buf(task->instance->device,buffer->planes[i].fd,&status);
-                    if(status != XRP_STATUS_SUCCESS)
+                    if(csi_dsp_dmabuf_cache_put(&task->instance->dmabuf_cache,buffer->planes[i].buf_phy))
                     {
                         DSP_PRINT(WARNING,"ERR DMA Buffrs(%d) Release fail\n",buffer->planes[i].fd);
                         return -1;
@@ -1113,36 +1341,31 @@ int csi_dsp_request_add_buffer(struct csi_sw_task_req* req,struct csi_dsp_buffer
          case CSI_DSP_BUF_ALLOC_DRV:
                 for(i=0;i<buffer->plane_count;i++)
                 {
-                    buf = xrp_create_buffer(task->instance->device,buffer->planes[i].size,NULL,&status);
-                    if(status != XRP_STATUS_SUCCESS)
+                    void *vir;
+
+                    /* pooled buffers come back mapped */
+                    buf = csi_dsp_buf_pool_get(&task->instance->buf_pool,task->instance->device,
+                                               buffer->planes[i].size,&vir);
+                    if(buf == NULL)
                     {
                          DSP_PRINT(WARNING,"create buffer failed\n");
                          goto err_1;
                     }
                     else
                     {
-
-                        buffer->planes[i].buf_vir = xrp_map_buffer(buf,0,buffer->planes[i].size,flag,&status);
-                        if(status != XRP_STATUS_SUCCESS)
-                        {
-                            DSP_PRINT(WARNING,"Map Buffrs not init\n");
-                            xrp_release_buffer(buf);
-                            goto err_1;
-                        }
+                        buffer->planes[i].buf_vir = (uint64_t)(uintptr_t)vir;
                         xrp_buffer_get_info(buf,XRP_BUFFER_PHY_ADDR,&buffer->planes[i].buf_phy,sizeof(uint64_t),&status);
                         if(status != XRP_STATUS_SUCCESS)
                         {
                             DSP_PRINT(WARNING,"xrp_buffer_get_info failed\n");
-                            xrp_unmap_buffer(buf,buffer->planes[i].buf_vir,&status);
-                            xrp_release_buffer(buf);
+                            csi_dsp_buf_pool_put(&task->instance->buf_pool,buf,vir);
                             goto err_1;
                         }
                         buffer->planes[i].fd = xrp_add_buffer_to_group(buf_gp,buf,flag,&status);
                         if(status !=XRP_STATUS_SUCCESS)
                         {
                             DSP_PRINT(WARNING,"xrp_add_buffer_to_group failed\n");
-                            xrp_unmap_buffer(buf,buffer->planes[i].buf_vir,&status);
-                            xrp_release_buffer(buf);
+                            csi_dsp_buf_pool_put(&task->instance->buf_pool,buf,vir);
                             goto err_1;
                         }                        
                     }
@@ -1155,8 +1378,8 @@ int csi_dsp_request_add_buffer(struct csi_sw_task_req* req,struct csi_dsp_buffer
                     for(j=0;j<i;j++)
                     {
                          buf = xrp_get_buffer_from_group(buf_gp,buffer->planes[j].fd,&status);
-                         xrp_unmap_buffer(buf,buffer->planes[j].buf_vir,&status);
-                         xrp_release_buffer(buf);
+                         csi_dsp_buf_pool_put(&task->instance->buf_pool,buf,
+                                              (void *)buffer->planes[j].buf_vir);
                     }
                 return -1;
          case  CSI_DSP_BUF_TYPE_DMA_BUF_EXPORT:
@@ -1166,21 +1389,15 @@ int csi_dsp_request_add_buffer(struct csi_sw_task_req* req,struct csi_dsp_buffer
                     
                 for(i=0;i<buffer->plane_count;i++)
                 {
-                    xrp_import_dma_buf(task->instance->device,buffer->planes[i].fd,flag,&buffer->planes[i].buf_phy,
-                                               & buffer->planes[i].buf_vir,&buffer->planes[i].size,&status);
-                    if(status !=XRP_STATUS_SUCCESS )
-                    {
-                        DSP_PRINT(WARNING,"dma buf import fail\n");
+                    if(csi_dsp_dmabuf_cache_get(&task->instance->dmabuf_cache,buffer->planes[i].fd,flag,&buffer->planes[i]))
                         goto err_2;
-                    }
-
                 }
                 memcpy(&req->buffers[req->buffer_num++],buffer,sizeof(*buffer));
                 break;
                 err_2:
                     for(j=0;j<i;j++)
                     {
-                        xrp_release_dma_buf(task->instance->device,buffer->planes[i].fd,&status);
+                        csi_dsp_dmabuf_cache_put(&task->instance->dmabuf_cache,buffer->planes[j].buf_phy);
                     }
                     return -1;
          case CSI_DSP_BUF_ALLOC_APP:
@@ -1192,19 +1409,178 @@ int csi_dsp_request_add_buffer(struct csi_sw_task_req* req,struct csi_dsp_buffer
     return 0;
 }
 
+int csi_dsp_request_set_sync_rect(struct csi_sw_task_req* req,int buf_idx,int plane,
+                                  uint32_t x,uint32_t y,uint32_t width,uint32_t height)
+{
+    csi_dsp_sync_region_t *region;
+    struct csi_dsp_plane *p;
+    uint64_t offset,size;
+
+    if(!req || buf_idx < 0 || buf_idx >= req->buffer_num ||
+       plane < 0 || plane >= req->buffers[buf_idx].plane_count)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    p = &req->buffers[buf_idx].planes[plane];
+    region = &csi_dsp_request_host(req)->sync[buf_idx][plane];
+    if(!width || !height)
+    {
+        region->offset = 0;
+        region->size = 0;
+        return 0;
+    }
+    if(!p->stride || x + width > p->stride)
+    {
+        DSP_PRINT(WARNING,"rect needs a plane stride\n");
+        return -1;
+    }
+    /* rows y..y+height-1 are synced as one span, from x in the first to x+width in the last */
+    offset = (uint64_t)y * p->stride + x;
+    size = (uint64_t)(height - 1) * p->stride + width;
+    if(offset + size > p->size)
+    {
+        DSP_PRINT(WARNING,"rect exceeds the plane\n");
+        return -1;
+    }
+    region->offset = offset;
+    region->size = size;
+    return 0;
+}
+
+int csi_dsp_request_set_sync_lines(struct csi_sw_task_req* req,int buf_idx,int plane,
+                                   uint32_t first_line,uint32_t lines)
+{
+    if(!req || buf_idx < 0 || buf_idx >= req->buffer_num ||
+       plane < 0 || plane >= req->buffers[buf_idx].plane_count)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    return csi_dsp_request_set_sync_rect(req,buf_idx,plane,0,first_line,
+                                         req->buffers[buf_idx].planes[plane].stride,lines);
+}
+
+/* Make sure the arena goes to the DSP with the request buffer group */
+static int csi_dsp_request_attach_arena(struct csi_sw_task_req* req,csi_dsp_sett_arena_t *arena)
+{
+    struct xrp_buffer_group *group = (struct xrp_buffer_group *)req->priv;
+    enum xrp_status status;
+    size_t buf_num;
+    size_t index;
+
+    xrp_buffer_group_get_info(group,XRP_BUFFER_GROUP_SIZE_SIZE_T,0,&buf_num,sizeof(buf_num),&status);
+    if(status != XRP_STATUS_SUCCESS)
+        return -1;
+    for(index=0; index<buf_num; index++)
+    {
+        if(xrp_get_buffer_from_group(group,index,&status) == arena->buf)
+            return 0;
+    }
+    xrp_add_buffer_to_group(group,arena->buf,XRP_READ,&status);
+    return status == XRP_STATUS_SUCCESS ? 0 : -1;
+}
+
+/*
+ * Place the property in the task arena. The block stays with the request
+ * until the property is replaced or the request is released, so a rearmed
+ * request can be enqueued again with the same property. Returns -1 when
+ * the arena has no room, the caller then falls back to a buffer of its own.
+ */
+static int csi_dsp_request_set_arena_property(struct csi_sw_task_req* req,void* property,size_t sz)
+{
+    struct csi_dsp_task_handler * task = (struct csi_dsp_task_handler *)req->task;
+    struct xrp_buffer *old;
+    void *virt;
+    uint64_t phy;
+
+    if(sz > CSI_DSP_SETT_ARENA_SIZE / 4)
+    {
+        /*
+         * Grown past what the arena takes: free the block now, the arena
+         * only reclaims in order and the caller replaces sett_ptr.
+         */
+        if(csi_dsp_sett_arena_contains(task->sett_arena,req->sett_ptr))
+        {
+            csi_dsp_sett_arena_free(task->sett_arena,req->sett_ptr);
+            req->sett_ptr = 0;
+        }
+        return -1;
+    }
+    if(!task->sett_arena)
+    {
+        task->sett_arena = csi_dsp_sett_arena_create(task->instance->device,CSI_DSP_SETT_ARENA_SIZE);
+        if(!task->sett_arena)
+            return -1;
+    }
+    if(csi_dsp_sett_arena_contains(task->sett_arena,req->sett_ptr))
+    {
+        if(sz <= csi_dsp_sett_arena_block_size(task->sett_arena,req->sett_ptr,&virt))
+        {
+            memcpy(virt,property,sz);
+            req->sett_length = sz;
+            return 0;
+        }
+        csi_dsp_sett_arena_free(task->sett_arena,req->sett_ptr);
+        req->sett_ptr = 0;
+    }
+    phy = csi_dsp_sett_arena_alloc(task->sett_arena,sz,&virt);
+    if(!phy)
+        return -1;
+    if(csi_dsp_request_attach_arena(req,task->sett_arena))
+    {
+        csi_dsp_sett_arena_free(task->sett_arena,phy);
+        return -1;
+    }
+    /* drop a property buffer of its own, the group keeps it until release */
+    old = csi_dsp_request_sett_buffer(req);
+    if(old)
+        xrp_release_buffer(old);
+    memcpy(virt,property,sz);
+    req->sett_ptr = phy;
+    req->sett_length = sz;
+    DSP_PRINT(DEBUG,"setting propert in arena %p succeful!\n",req->sett_ptr);
+    return 0;
+}
+
 int csi_dsp_request_set_property(struct csi_sw_task_req* req,void* property,size_t sz)
 {
     if(!req || !property || sz==0)
     {
         return -1;
     }
-    csi_dsp_status_e status;
+    enum xrp_status status;
     struct csi_dsp_task_handler * task=req->task;
     struct xrp_buffer * buf=NULL;
     void *sett_virt_addr =NULL;
     struct xrp_buffer_group *buf_gp ;
 
     buf_gp = (struct xrp_buffer_group *)req->priv;
+
+    if(csi_dsp_request_set_arena_property(req,property,sz) == 0)
+        return 0;
+
+    /* a rearmed request keeps its property buffer while the new one fits */
+    buf = csi_dsp_request_sett_buffer(req);
+    if(buf)
+    {
+        size_t buf_size;
+
+        xrp_buffer_get_info(buf,XRP_BUFFER_SIZE_SIZE_T,&buf_size,sizeof(buf_size),&status);
+        if(status == XRP_STATUS_SUCCESS && sz <= buf_size)
+        {
+            xrp_buffer_get_info(buf,XRP_BUFFER_USER_ADDR,&sett_virt_addr,sizeof(uint64_t),&status);
+            if(status == XRP_STATUS_SUCCESS)
+            {
+                req->sett_length = sz;
+                memcpy(sett_virt_addr,property,sz);
+                return 0;
+            }
+        }
+        /* the group keeps its reference until the request is released */
+        xrp_release_buffer(buf);
+        req->sett_ptr = 0;
+    }
     req->sett_length = sz;
     buf = xrp_create_buffer(task->instance->device,req->sett_length,NULL,&status);
     if(status != XRP_STATUS_SUCCESS)
@@ -1243,14 +1619,29 @@ int csi_dsp_request_set_property(struct csi_sw_task_req* req,void* property,size
 }
 
 
+static void csi_dsp_request_notify(struct xrp_event *event, void *context)
+{
+    task_event_item_t *item = context;
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)item->req->task;
+    csi_dsp_sw_task_manager_t *sw_task_ctx = (csi_dsp_sw_task_manager_t *)task->private;
+
+    pthread_mutex_lock(&sw_task_ctx->mutex);
+    list_move_tail(&item->head,&sw_task_ctx->done_list);
+    pthread_cond_signal(&sw_task_ctx->done_cond);
+    pthread_mutex_unlock(&sw_task_ctx->mutex);
+}
+
+/* keep sw task requests on the xrp inline copy path */
+_Static_assert(sizeof(struct csi_sw_task_req) <= XRP_REQUEST_INLINE_DATA_SIZE,
+               "csi_sw_task_req exceeds XRP_REQUEST_INLINE_DATA_SIZE");
+
 int csi_dsp_request_enqueue(struct csi_sw_task_req* req)
 {
     struct csi_dsp_task_handler * task=NULL;
-    struct xrp_buffer * buf=NULL;
-    task_event_item_t *event_item;
-    csi_dsp_status_e status;
+    task_event_item_t *event_item=NULL;
     struct xrp_event *evt;
     csi_dsp_sw_task_manager_t * sw_task_ctx;
+    csi_dsp_sw_req_status_e prev_status;
 	enum xrp_status s;
     int loop;
     if(!req )
@@ -1260,33 +1651,57 @@ int csi_dsp_request_enqueue(struct csi_sw_task_req* req)
     task = (struct csi_dsp_task_handler *)req->task;
 
     sw_task_ctx = (csi_dsp_sw_task_manager_t *)task->private;
-    event_item = malloc(sizeof(task_event_item_t));
+    pthread_mutex_lock(&sw_task_ctx->mutex);
+    /* a request is in flight once, rearm it after dequeue to send it again */
+    prev_status = req->status;
+    if(prev_status != CSI_DSP_SW_REQ_IDLE && prev_status != CSI_DSP_SW_REQ_DONE &&
+       prev_status != CSI_DSP_SW_REQ_FAIL)
+    {
+        pthread_mutex_unlock(&sw_task_ctx->mutex);
+        DSP_PRINT(WARNING,"req %d is already enqueued\n",req->request_id);
+        return -1;
+    }
+    /* the DSP gets the request as copied at enqueue, so mark it first */
+    req->status = CSI_DSP_SW_REQ_RUNNING;
+    if(!list_empty(&sw_task_ctx->free_list))
+    {
+        event_item = list_first_entry(&sw_task_ctx->free_list,task_event_item_t,head);
+        list_del(&event_item->head);
+    }
+    pthread_mutex_unlock(&sw_task_ctx->mutex);
+    if(event_item==NULL)
+        event_item = malloc(sizeof(task_event_item_t));
     if(event_item==NULL)
     {
         DSP_PRINT(WARNING,"malloc fail\n");
+        req->status = prev_status;
 		return -1;
     }
 
     for(loop =0;loop<req->buffer_num;loop++)
     {
-        csi_dsp_buf_flush(task->instance->device,&req->buffers[loop]);
+        csi_dsp_buf_sync(task->instance->device,&req->buffers[loop],
+                         csi_dsp_request_host(req)->sync[loop],1);
     }
 
+    event_item->req = req;
 	xrp_enqueue_command(task->queue, req, sizeof(struct csi_sw_task_req),
 			    &event_item->req_status, sizeof(event_item->req_status),
 			    req->priv, &evt, &s);
 	if (s != XRP_STATUS_SUCCESS) {
 		DSP_PRINT(WARNING,"enqueue task to dsp fail\n");
+		req->status = prev_status;
+		free(event_item);
 		return -1;
 	}
 
-    req->status = CSI_DSP_SW_REQ_RUNNING;
     event_item->event = evt;
-    event_item->req = req;
     pthread_mutex_lock(&sw_task_ctx->mutex);
-    list_add_tail(&event_item->head,&sw_task_ctx->event_list);
     sw_task_ctx->event_num++;
+    list_add_tail(&event_item->head,&sw_task_ctx->run_list);
     pthread_mutex_unlock(&sw_task_ctx->mutex);
+    /* completion pushes the item to done_list, may run right here */
+    xrp_event_set_notify(evt,csi_dsp_request_notify,event_item,NULL);
     DSP_PRINT(DEBUG,"Req %d is enqueue \n",req->request_id);
     return 0;
 }
@@ -1296,31 +1711,42 @@ struct csi_sw_task_req*  csi_dsp_request_dequeue(void *task_ctx)
     struct csi_dsp_task_handler * task=(struct csi_dsp_task_handler *)task_ctx;
     csi_dsp_sw_task_manager_t * sw_task_ctx = (csi_dsp_sw_task_manager_t *)task->private;
     struct csi_sw_task_req*  req=NULL;
-    int id=0;
     task_event_item_t *item;
-    enum xrp_status status;
     int loop;
-    pthread_mutex_lock(&sw_task_ctx->mutex);
-    struct xrp_event **evts = malloc(sw_task_ctx->event_num*sizeof(struct xrp_event*));
-    list_for_each_entry(item,&sw_task_ctx->event_list,head){
-            evts[id++]=item->event;
-    }
-    pthread_mutex_unlock(&sw_task_ctx->mutex);
+
     DSP_PRINT(DEBUG,"Wait for Req event \n");
-    id= xrp_wait_any(evts,sw_task_ctx->event_num,&status);
-    if(id>=sw_task_ctx->event_num || status !=XRP_STATUS_SUCCESS)
+    pthread_mutex_lock(&sw_task_ctx->mutex);
+    if(sw_task_ctx->event_num == 0)
     {
-        DSP_PRINT(WARNING,"id invalid:%d\n",id);
+        pthread_mutex_unlock(&sw_task_ctx->mutex);
+        DSP_PRINT(WARNING,"no req in flight\n");
         return NULL;
     }
-    list_for_each_entry(item,&sw_task_ctx->event_list,head){
-        if(item->event == evts[id])
-            break;
-    }
-    pthread_mutex_lock(&sw_task_ctx->mutex);
+    if(list_empty(&sw_task_ctx->done_list) && !list_empty(&sw_task_ctx->run_list))
+    {
+        /*
+         * Wait on the oldest request's event rather than only for the
+         * notify: with async or ring submission xrp_wait also reaps the
+         * completion on this thread.
+         */
+        struct xrp_event *evt;
+
+        item = list_first_entry(&sw_task_ctx->run_list,task_event_item_t,head);
+        evt = item->event;
+        xrp_retain_event(evt);
+        pthread_mutex_unlock(&sw_task_ctx->mutex);
+        xrp_wait(evt,NULL);
+        xrp_release_event(evt);
+        pthread_mutex_lock(&sw_task_ctx->mutex);
+    }
+    /* the event is complete, its notify is at most about to run */
+    while(list_empty(&sw_task_ctx->done_list))
+        pthread_cond_wait(&sw_task_ctx->done_cond,&sw_task_ctx->mutex);
+    item = list_first_entry(&sw_task_ctx->done_list,task_event_item_t,head);
     list_del(&item->head);
     sw_task_ctx->event_num--;
     pthread_mutex_unlock(&sw_task_ctx->mutex);
+
     req = item->req;
     xrp_release_event(item->event);
     if(item->req_status !=CSI_DSP_OK)
@@ -1331,12 +1757,15 @@ struct csi_sw_task_req*  csi_dsp_request_dequeue(void *task_ctx)
     else{
         req->status = CSI_DSP_SW_REQ_DONE;
     }
-    free(evts);
-    free(item);
+
+    pthread_mutex_lock(&sw_task_ctx->mutex);
+    list_add(&item->head,&sw_task_ctx->free_list);
+    pthread_mutex_unlock(&sw_task_ctx->mutex);
 
     for(loop =0;loop<req->buffer_num;loop++)
     {
-        csi_dsp_buf_flush(task->instance->device,&req->buffers[loop]);
+        csi_dsp_buf_sync(task->instance->device,&req->buffers[loop],
+                         csi_dsp_request_host(req)->sync[loop],0);
     }
 
     DSP_PRINT(DEBUG,"Req %d is deuque \n",req->request_id);
@@ -64,6 +64,101 @@ typedef struct dsp_handler_item{
     void* handler;
 }dsp_handler_item_t;
 
+/*
+ * Cache of mapped CSI_DSP_BUF_ALLOC_DRV buffers, one free list per size
+ * class. Classes are four per power of two from 4 KiB, so a buffer is at
+ * most 25% larger than asked for. Buffers bigger than the largest class
+ * are not cached.
+ */
+#define CSI_DSP_BUF_POOL_MIN_SHIFT  12
+#define CSI_DSP_BUF_POOL_CLASSES    (4 * 20 + 1)
+#define CSI_DSP_BUF_POOL_HIGH_WATER (64 << 20)
+
+typedef struct csi_dsp_buf_pool{
+    pthread_mutex_t mutex;
+    struct list_head free_list[CSI_DSP_BUF_POOL_CLASSES];
+    csi_dsp_buf_pool_stats_t stats;
+}csi_dsp_buf_pool_t;
+
+/*
+ * Imported dma-bufs keyed by the inode behind their fd. Entries in use are
+ * on busy, unreferenced ones on lru (most recent first) up to max_idle.
+ */
+#define CSI_DSP_DMABUF_CACHE_MAX 16
+
+typedef struct csi_dsp_dmabuf_cache{
+    pthread_mutex_t mutex;
+    struct xrp_device *device;
+    struct list_head busy;
+    struct list_head lru;
+    int sg;                 /* import non-contiguous buffers as descriptor lists */
+    csi_dsp_dmabuf_cache_stats_t stats;
+}csi_dsp_dmabuf_cache_t;
+
+/* Algorithm libraries in device memory, see csi_dsp_algo_cache.c */
+#define CSI_DSP_ALGO_CACHE_HIGH_WATER (16 << 20)
+
+typedef struct csi_dsp_algo_entry csi_dsp_algo_entry_t;
+
+typedef struct csi_dsp_algo_cache{
+    pthread_mutex_t mutex;
+    struct list_head entries;   /* most recently acquired first */
+    csi_dsp_algo_cache_stats_t stats;
+}csi_dsp_algo_cache_t;
+
+typedef struct csi_dsp_algo_prefetch{
+    struct csi_dsp_instance *instance;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    int joined;
+    char file[128];
+    csi_dsp_algo_entry_t *entry;    /* NULL if the library could not be read */
+}csi_dsp_algo_prefetch_t;
+
+/* Per-task device memory the request properties are sub-allocated from */
+#define CSI_DSP_SETT_ARENA_SIZE (64 << 10)
+
+typedef struct csi_dsp_sett_arena{
+    pthread_mutex_t mutex;
+    struct xrp_buffer *buf;
+    char *virt;
+    uint64_t phy;
+    size_t size;
+    size_t head;            /* next block is carved here */
+    size_t tail;            /* oldest block still in use */
+    size_t used;
+}csi_dsp_sett_arena_t;
+
+/* Host side of a task parameter block, see csi_dsp_param.c */
+typedef struct csi_dsp_param{
+    pthread_mutex_t mutex;
+    struct xrp_buffer *buf;
+    uint64_t phy;
+    csi_dsp_param_block_t *block;   /* mapped, slots follow */
+    char *slots;
+    char *shadow;                   /* host copy of the published slot */
+    size_t size;
+    size_t slot_stride;
+}csi_dsp_param_t;
+
+/* Part of a plane that needs cache maintenance, size 0 for all of it */
+typedef struct csi_dsp_sync_region{
+    uint32_t offset;
+    uint32_t size;
+}csi_dsp_sync_region_t;
+
+/*
+ * Host side of a sw task request. Only req is sent to the DSP, so host
+ * bookkeeping can be added here without touching the shared layout.
+ */
+typedef struct csi_dsp_request_host{
+    struct csi_sw_task_req req;
+    csi_dsp_sync_region_t sync[CSI_DSP_MAX_BUFFER][3];
+}csi_dsp_request_host_t;
+
+/* req is the first member */
+#define csi_dsp_request_host(r) ((csi_dsp_request_host_t *)(r))
+
 struct csi_dsp_instance{
     int  id;
     struct xrp_device *device;
@@ -73,6 +168,10 @@ struct csi_dsp_instance{
     struct xrp_report *report_impl;
 
     struct list_head task_list;
+    csi_dsp_buf_pool_t buf_pool;
+    csi_dsp_dmabuf_cache_t dmabuf_cache;
+    csi_dsp_algo_cache_t algo_cache;
+    int no_compound;                /* firmware without PS_CMD_COMPOUND */
 
 };
 
@@ -97,8 +196,41 @@ struct csi_dsp_task_handler{
     void *context;
     void *private;
 
+    /* result buffer ring, see csi_dsp_task_register_result_cb */
+    struct xrp_buffer *result_buf;
+    uint64_t result_phy;
+    csi_dsp_result_ring_t *result_ring;
+    char *result_slots;
+    int (*result_cb)(void *context,void *result,size_t size);
+    void *result_context;
+
+    csi_dsp_sett_arena_t *sett_arena;   /* created on first use */
+    csi_dsp_algo_entry_t *algo_entry;   /* library from csi_dsp_task_acquire_algo */
+    csi_dsp_param_t *param;             /* from csi_dsp_task_create_param */
 };
 
+/* Commands of a compound transaction, see csi_dsp_txn.c */
+#define CSI_DSP_TXN_MAX_STEPS 16
+
+typedef struct csi_dsp_txn_step{
+    uint32_t cmd;
+    void *payload;
+    size_t size;
+    void *resp;
+    size_t resp_size;
+    int task_step;                  /* step allocating the task, -1 if its id is known */
+    size_t task_id_offset;
+    struct csi_dsp_task_handler *task;
+    dsp_handler_item_t *task_item;  /* PS_CMD_TASK_ALLOC only, NULL once set up */
+}csi_dsp_txn_step_t;
+
+typedef struct csi_dsp_txn{
+    struct csi_dsp_instance *instance;
+    int n_steps;
+    int committed;
+    csi_dsp_txn_step_t steps[CSI_DSP_TXN_MAX_STEPS];
+}csi_dsp_txn_t;
+
 typedef struct task_event_item{
     struct list_head head;
     struct xrp_event * event;
@@ -108,18 +240,60 @@ typedef struct task_event_item{
 
 typedef struct csi_dsp_sw_task_manager{
 
-    struct list_head event_list;
-    int event_num;
+    struct list_head run_list;      /* enqueued requests, in submission order */
+    struct list_head done_list;     /* completed requests, in completion order */
+    struct list_head free_list;     /* recycled event items */
+    int event_num;                  /* requests enqueued but not yet dequeued */
     pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
 }csi_dsp_sw_task_manager_t;
 
 int csi_dsp_test_config(void* dsp ,struct csi_dsp_ip_test_par* config_para,void* buf);
 int csi_dsp_cmd_send(const struct xrp_queue *queue,int cmd_type,void * cmd_payload,
                                     size_t payload_size,void *resp, size_t resp_size,struct xrp_buffer_group *buffer_group);
 int csi_dsp_enable_heartbeat_check(struct csi_dsp_instance *dsp ,int secs);
+int csi_dsp_task_setup(struct csi_dsp_instance *instance,struct csi_dsp_task_handler *task,
+                       dsp_handler_item_t *task_item,csi_dsp_task_mode_e task_type,
+                       const struct csi_dsp_task_create_resp *resp);
+
+int csi_dsp_task_add_report(struct csi_dsp_task_handler *task,
+                            int (*cb)(void*context,void*data),
+                            void* context,
+                            size_t data_size);
+void csi_dsp_task_report_config(struct csi_dsp_task_handler *task,enum cmd_type flag,
+                                struct report_config_msg *config);
 
 int csi_dsp_disable_heartbeat_check();
-int csi_dsp_buf_flush( struct xrp_device *device,struct csi_dsp_buffer *buffers);
+
+void csi_dsp_buf_pool_init(csi_dsp_buf_pool_t *pool);
+void csi_dsp_buf_pool_destroy(csi_dsp_buf_pool_t *pool);
+struct xrp_buffer *csi_dsp_buf_pool_get(csi_dsp_buf_pool_t *pool,struct xrp_device *device,
+                                        size_t size,void **vir);
+void csi_dsp_buf_pool_put(csi_dsp_buf_pool_t *pool,struct xrp_buffer *buf,void *vir);
+
+void csi_dsp_dmabuf_cache_init(csi_dsp_dmabuf_cache_t *cache,struct xrp_device *device);
+void csi_dsp_dmabuf_cache_destroy(csi_dsp_dmabuf_cache_t *cache);
+int csi_dsp_dmabuf_cache_get(csi_dsp_dmabuf_cache_t *cache,int fd,int flag,struct csi_dsp_plane *plane);
+int csi_dsp_dmabuf_cache_put(csi_dsp_dmabuf_cache_t *cache,uint64_t phy);
+
+void csi_dsp_algo_cache_init(csi_dsp_algo_cache_t *cache);
+void csi_dsp_algo_cache_destroy(csi_dsp_algo_cache_t *cache);
+csi_dsp_algo_entry_t *csi_dsp_algo_cache_get(csi_dsp_algo_cache_t *cache,struct xrp_device *device,
+                                             const char *file);
+void csi_dsp_algo_cache_hold(csi_dsp_algo_cache_t *cache,csi_dsp_algo_entry_t *entry);
+void csi_dsp_algo_cache_put(csi_dsp_algo_cache_t *cache,csi_dsp_algo_entry_t *entry);
+csi_dsp_algo_entry_t *csi_dsp_algo_prefetch_wait(csi_dsp_algo_prefetch_t *prefetch);
+struct xrp_buffer *csi_dsp_algo_entry_buffer(csi_dsp_algo_entry_t *entry,uint64_t *phy);
+
+csi_dsp_sett_arena_t *csi_dsp_sett_arena_create(struct xrp_device *device,size_t size);
+void csi_dsp_sett_arena_destroy(csi_dsp_sett_arena_t *arena);
+int csi_dsp_sett_arena_contains(csi_dsp_sett_arena_t *arena,uint64_t phy);
+uint64_t csi_dsp_sett_arena_alloc(csi_dsp_sett_arena_t *arena,size_t sz,void **virt);
+size_t csi_dsp_sett_arena_block_size(csi_dsp_sett_arena_t *arena,uint64_t phy,void **virt);
+void csi_dsp_sett_arena_free(csi_dsp_sett_arena_t *arena,uint64_t phy);
+void csi_dsp_task_free_param(struct csi_dsp_task_handler *task);
+int csi_dsp_buf_sync(struct xrp_device *device,struct csi_dsp_buffer *buffer,
+                     const csi_dsp_sync_region_t *region,int to_device);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2021 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/xrp_api.h"
+#include "../include/dsp_ps_ns.h"
+#include "../include/csi_dsp_api.h"
+#include "csi_dsp_core.h"
+#include "dsp_common.h"
+
+/*
+ * Imported dma-bufs stay imported and mapped while they are in use and,
+ * once idle, until they fall off the LRU. Producers like the ISP hand out
+ * the same few buffers in rotation, so most frames skip the
+ * XRP_IOCTL_DMABUF_IMPORT/vm_mmap and release round trips.
+ */
+typedef struct csi_dsp_dmabuf_entry{
+    struct list_head head;
+    dev_t dev;
+    ino_t ino;
+    int fd;                 /* our own dup, keeps the dma-buf and its inode alive */
+    int flag;               /* access flags the import was made for */
+    int ref;
+    uint64_t phy;
+    uint64_t virt;
+    size_t size;
+}csi_dsp_dmabuf_entry_t;
+
+void csi_dsp_dmabuf_cache_init(csi_dsp_dmabuf_cache_t *cache,struct xrp_device *device)
+{
+    const char *env = getenv("CSI_DSP_DMABUF_CACHE_MAX");
+    const char *sg = getenv("CSI_DSP_DMABUF_SG");
+
+    pthread_mutex_init(&cache->mutex,NULL);
+    INIT_LIST_HEAD(&cache->busy);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->device = device;
+    /* needs a firmware that understands CSI_DSP_PLANE_SG_LIST */
+    cache->sg = sg ? atoi(sg) : 0;
+    memset(&cache->stats,0,sizeof(cache->stats));
+    cache->stats.max_idle = env ? strtoul(env,NULL,0) : CSI_DSP_DMABUF_CACHE_MAX;
+}
+
+static void csi_dsp_dmabuf_entry_release(csi_dsp_dmabuf_cache_t *cache,csi_dsp_dmabuf_entry_t *entry)
+{
+    enum xrp_status status;
+
+    munmap((void *)(uintptr_t)entry->virt,entry->size);
+    xrp_release_dma_buf(cache->device,entry->fd,&status);
+    if(status != XRP_STATUS_SUCCESS)
+        DSP_PRINT(WARNING,"ERR DMA Buffrs(%d) Release fail\n",entry->fd);
+    close(entry->fd);
+    free(entry);
+}
+
+/* Release idle entries from the cold end until at most max_idle remain */
+static void csi_dsp_dmabuf_cache_trim(csi_dsp_dmabuf_cache_t *cache,size_t max_idle)
+{
+    csi_dsp_dmabuf_entry_t *entry;
+    struct list_head release;
+
+    INIT_LIST_HEAD(&release);
+    pthread_mutex_lock(&cache->mutex);
+    while(cache->stats.idle_num > max_idle)
+    {
+        entry = list_entry(cache->lru.prev,csi_dsp_dmabuf_entry_t,head);
+        list_del(&entry->head);
+        list_add(&entry->head,&release);
+        cache->stats.idle_num--;
+        cache->stats.evictions++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    while(!list_empty(&release))
+    {
+        entry = list_first_entry(&release,csi_dsp_dmabuf_entry_t,head);
+        list_del(&entry->head);
+        csi_dsp_dmabuf_entry_release(cache,entry);
+    }
+}
+
+void csi_dsp_dmabuf_cache_destroy(csi_dsp_dmabuf_cache_t *cache)
+{
+    csi_dsp_dmabuf_cache_trim(cache,0);
+    if(!list_empty(&cache->busy))
+        DSP_PRINT(WARNING,"%zu dma-buf still in use\n",cache->stats.busy_num);
+    DSP_PRINT(INFO,"dma-buf cache hits:%llu,misses:%llu,evictions:%llu\n",
+              (unsigned long long)cache->stats.hits,
+              (unsigned long long)cache->stats.misses,
+              (unsigned long long)cache->stats.evictions);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+static csi_dsp_dmabuf_entry_t *csi_dsp_dmabuf_cache_find(struct list_head *list,dev_t dev,ino_t ino)
+{
+    csi_dsp_dmabuf_entry_t *entry;
+
+    list_for_each_entry(entry,list,head)
+    {
+        if(entry->ino == ino && entry->dev == dev)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * The cached import was made for narrower access than flag asks for. Import
+ * it again with both, the driver then widens the mapping it shares between
+ * the imports, and drop the extra import right away. The device address may
+ * move with the mapping, so only an entry no plane is using can be widened.
+ */
+static int csi_dsp_dmabuf_entry_widen(csi_dsp_dmabuf_cache_t *cache,csi_dsp_dmabuf_entry_t *entry,int flag)
+{
+    enum xrp_status status;
+    uint64_t phy,virt;
+    size_t size;
+
+    if(entry->ref)
+    {
+        DSP_PRINT(WARNING,"dma buf fd %d is in use, can't widen\n",entry->fd);
+        return -1;
+    }
+    flag = (entry->flag | flag) | XRP_NO_CPU_MAP;
+    if(cache->sg)
+        flag |= XRP_SG_LIST;
+    xrp_import_dma_buf(cache->device,entry->fd,flag,&phy,&virt,&size,&status);
+    if(status != XRP_STATUS_SUCCESS)
+        return -1;
+    xrp_release_dma_buf(cache->device,entry->fd,&status);
+    entry->phy = phy;
+    entry->flag |= flag & XRP_READ_WRITE;
+    return 0;
+}
+
+/* Import the dma-buf behind fd, or take another reference on the cached import */
+int csi_dsp_dmabuf_cache_get(csi_dsp_dmabuf_cache_t *cache,int fd,int flag,struct csi_dsp_plane *plane)
+{
+    csi_dsp_dmabuf_entry_t *entry;
+    enum xrp_status status;
+    struct stat st;
+
+    if(fd < 0 || fstat(fd,&st))
+    {
+        DSP_PRINT(WARNING,"dma buf fd %d invalid\n",fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    entry = csi_dsp_dmabuf_cache_find(&cache->busy,st.st_dev,st.st_ino);
+    if(!entry)
+    {
+        entry = csi_dsp_dmabuf_cache_find(&cache->lru,st.st_dev,st.st_ino);
+        if(entry)
+        {
+            list_del(&entry->head);
+            list_add(&entry->head,&cache->busy);
+            cache->stats.idle_num--;
+            cache->stats.busy_num++;
+        }
+    }
+    if(entry)
+    {
+        if((flag & XRP_READ_WRITE & ~entry->flag) &&
+           csi_dsp_dmabuf_entry_widen(cache,entry,flag & XRP_READ_WRITE))
+        {
+            DSP_PRINT(WARNING,"dma buf fd %d widen access fail\n",fd);
+            if(!entry->ref)
+            {
+                list_del(&entry->head);
+                list_add(&entry->head,&cache->lru);
+                cache->stats.busy_num--;
+                cache->stats.idle_num++;
+            }
+            goto err;
+        }
+        entry->ref++;
+        cache->stats.hits++;
+        goto out;
+    }
+
+    cache->stats.misses++;
+    entry = malloc(sizeof(*entry));
+    if(!entry)
+        goto err;
+    entry->fd = fcntl(fd,F_DUPFD_CLOEXEC,0);
+    if(entry->fd < 0)
+    {
+        free(entry);
+        goto err;
+    }
+    if(cache->sg)
+        flag |= XRP_SG_LIST;
+    xrp_import_dma_buf(cache->device,entry->fd,flag,&entry->phy,&entry->virt,&entry->size,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        close(entry->fd);
+        free(entry);
+        goto err;
+    }
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->flag = flag & XRP_READ_WRITE;
+    entry->ref = 1;
+    list_add(&entry->head,&cache->busy);
+    cache->stats.busy_num++;
+out:
+    plane->buf_phy = entry->phy;
+    plane->buf_vir = entry->virt;
+    plane->size = entry->size;
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+err:
+    pthread_mutex_unlock(&cache->mutex);
+    DSP_PRINT(WARNING,"dma buf import fail\n");
+    return -1;
+}
+
+/* Drop a reference taken by csi_dsp_dmabuf_cache_get, looked up by physical address */
+int csi_dsp_dmabuf_cache_put(csi_dsp_dmabuf_cache_t *cache,uint64_t phy)
+{
+    csi_dsp_dmabuf_entry_t *entry;
+    int found = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    list_for_each_entry(entry,&cache->busy,head)
+    {
+        if(entry->phy == phy)
+        {
+            found = 1;
+            break;
+        }
+    }
+    if(found && --entry->ref == 0)
+    {
+        list_del(&entry->head);
+        list_add(&entry->head,&cache->lru);
+        cache->stats.busy_num--;
+        cache->stats.idle_num++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    if(!found)
+    {
+        DSP_PRINT(WARNING,"dma buf 0x%llx not imported\n",(unsigned long long)phy);
+        return -1;
+    }
+    csi_dsp_dmabuf_cache_trim(cache,cache->stats.max_idle);
+    return 0;
+}
+
+int csi_dsp_set_dmabuf_cache_limit(void *dsp,size_t max_idle)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->dmabuf_cache.mutex);
+    instance->dmabuf_cache.stats.max_idle = max_idle;
+    pthread_mutex_unlock(&instance->dmabuf_cache.mutex);
+    csi_dsp_dmabuf_cache_trim(&instance->dmabuf_cache,max_idle);
+    return 0;
+}
+
+int csi_dsp_get_dmabuf_cache_stats(void *dsp,csi_dsp_dmabuf_cache_stats_t *stats)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+
+    if(!instance || !stats)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    pthread_mutex_lock(&instance->dmabuf_cache.mutex);
+    *stats = instance->dmabuf_cache.stats;
+    pthread_mutex_unlock(&instance->dmabuf_cache.mutex);
+    return 0;
+}
@@ -114,21 +114,49 @@ void isp_algo_result_handler(void *context,void *data)
 }
 
 
-int csi_dsp_buf_flush( struct xrp_device *device,struct csi_dsp_buffer *buffers)
+/*
+ * Cache maintenance around a DSP access: before it only what the DSP reads
+ * is cleaned, after it only what the DSP wrote is invalidated. region holds
+ * one entry per plane and may be NULL for whole planes.
+ */
+int csi_dsp_buf_sync(struct xrp_device *device,struct csi_dsp_buffer *buffer,
+                     const csi_dsp_sync_region_t *region,int to_device)
 {
     int loop;
     enum xrp_status status;
-    int flag = buffers->dir == CSI_DSP_BUFFER_IN ?XRP_READ:XRP_WRITE;
-    if(buffers->type == CSI_DSP_BUF_TYPE_DMA_BUF_IMPORT ||
-          buffers->type == CSI_DSP_BUF_TYPE_DMA_BUF_IMPORT  )
+    int ret = 0;
+    int flag;
+
+    if(buffer->type != CSI_DSP_BUF_TYPE_DMA_BUF_IMPORT)
+        return 0;
+    switch(buffer->dir)
+    {
+        case CSI_DSP_BUFFER_IN:
+            if(!to_device)
+                return 0;
+            flag = XRP_READ;
+            break;
+        case CSI_DSP_BUFFER_OUT:
+            if(to_device)
+                return 0;
+            flag = XRP_WRITE;
+            break;
+        default:
+            flag = to_device ? XRP_READ : XRP_WRITE;
+            break;
+    }
+    for(loop=0;loop<buffer->plane_count;loop++)
     {
-        for(loop=0;loop<buffers->plane_count;loop++)
+        xrp_sync_dma_buf(device,buffer->planes[loop].fd,flag,to_device,
+                         region ? region[loop].offset : 0,
+                         region ? region[loop].size : 0,&status);
+        if(status != XRP_STATUS_SUCCESS)
         {
-            xrp_flush_dma_buf(device, buffers->planes[loop].fd,flag,&status);
+            DSP_PRINT(WARNING,"dma buf %d sync fail\n",buffer->planes[loop].fd);
+            ret = -1;
         }
-        
     }
-
+    return ret;
 }
 
 // void hw_task_result_handler(void *context,void *data)
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2021 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/xrp_api.h"
+#include "../include/dsp_ps_ns.h"
+#include "../include/csi_dsp_api.h"
+#include "csi_dsp_core.h"
+#include "dsp_common.h"
+
+/*
+ * Per-task algorithm parameters in a block the DSP reads at every frame
+ * boundary, so changing a coefficient is a copy into device memory rather
+ * than a PS_CMD_ALGO_CONFIG round trip. The block is double buffered; the
+ * host keeps a shadow of the published slot so a partial update never
+ * reads device memory back.
+ */
+
+#define CSI_DSP_PARAM_ALIGN 64
+#define csi_dsp_param_align(x) (((x) + CSI_DSP_PARAM_ALIGN - 1) & ~(size_t)(CSI_DSP_PARAM_ALIGN - 1))
+
+static int csi_dsp_param_config(struct csi_dsp_task_handler *task,enum cmd_type flag,uint64_t addr)
+{
+    struct csi_dsp_algo_param_config_req config;
+    csi_dsp_status_e resp = 0;
+
+    config.task_id = task->task_id;
+    config.flag = flag;
+    config.addr = addr;
+    if(csi_dsp_cmd_send(task->instance->comm_queue,PS_CMD_ALGO_PARAM_CONFIG,&config,sizeof(config),
+                        &resp,sizeof(resp),NULL))
+    {
+        DSP_PRINT(ERROR,"send PS_CMD_ALGO_PARAM_CONFIG fail\n");
+        return -1;
+    }
+    if(resp != CSI_DSP_OK)
+    {
+        DSP_PRINT(ERROR,"param config resp fail %d\n",resp);
+        return -1;
+    }
+    return 0;
+}
+
+static void csi_dsp_param_free(csi_dsp_param_t *param)
+{
+    enum xrp_status status;
+
+    if(param->block)
+        xrp_unmap_buffer(param->buf,param->block,&status);
+    if(param->buf)
+        xrp_release_buffer(param->buf);
+    pthread_mutex_destroy(&param->mutex);
+    free(param->shadow);
+    free(param);
+}
+
+int csi_dsp_task_create_param(void *task_ctx,const void *init,size_t size)
+{
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+    size_t block_size = csi_dsp_param_align(sizeof(csi_dsp_param_block_t));
+    csi_dsp_param_t *param;
+    enum xrp_status status;
+    size_t total;
+
+    if(!task || !size || size > UINT32_MAX)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    if(task->param)
+    {
+        DSP_PRINT(WARNING,"task %d already has a parameter block\n",task->task_id);
+        return -1;
+    }
+    param = calloc(1,sizeof(*param));
+    if(!param)
+        return -1;
+    pthread_mutex_init(&param->mutex,NULL);
+    param->size = size;
+    param->slot_stride = csi_dsp_param_align(size);
+    param->shadow = calloc(1,size);
+    if(!param->shadow)
+        goto err;
+    if(init)
+        memcpy(param->shadow,init,size);
+
+    total = block_size + 2 * param->slot_stride;
+    param->buf = xrp_create_buffer(task->instance->device,total,NULL,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"create param buffer fail\n");
+        param->buf = NULL;
+        goto err;
+    }
+    param->block = xrp_map_buffer(param->buf,0,total,XRP_READ_WRITE,&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"map param buffer fail\n");
+        param->block = NULL;
+        goto err;
+    }
+    xrp_buffer_get_info(param->buf,XRP_BUFFER_PHY_ADDR,&param->phy,sizeof(param->phy),&status);
+    if(status != XRP_STATUS_SUCCESS)
+    {
+        DSP_PRINT(WARNING,"get param buffer phy addr fail\n");
+        goto err;
+    }
+    param->slots = (char *)param->block + block_size;
+    memcpy(param->slots,param->shadow,size);
+    param->block->version = 1;
+    param->block->active = 0;
+    param->block->size = size;
+    param->block->ack = 0;
+    param->block->slot_addr[0] = param->phy + block_size;
+    param->block->slot_addr[1] = param->phy + block_size + param->slot_stride;
+
+    if(csi_dsp_param_config(task,CMD_SETUP,param->phy))
+        goto err;
+    task->param = param;
+    DSP_PRINT(INFO,"task %d param block %zu bytes at 0x%llx\n",task->task_id,size,param->phy);
+    return 0;
+
+err:
+    csi_dsp_param_free(param);
+    return -1;
+}
+
+int csi_dsp_task_update_param(void *task_ctx,size_t offset,const void *data,size_t size,
+                              uint32_t *version)
+{
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+    csi_dsp_param_t *param;
+    csi_dsp_param_block_t *block;
+    uint32_t next;
+    uint32_t ver;
+
+    if(!task || !task->param || !data)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    param = task->param;
+    if(offset > param->size || size > param->size - offset)
+    {
+        DSP_PRINT(WARNING,"update %zu+%zu out of %zu bytes\n",offset,size,param->size);
+        return -1;
+    }
+    block = param->block;
+
+    pthread_mutex_lock(&param->mutex);
+    memcpy(param->shadow + offset,data,size);
+    /*
+     * The other slot was last published two versions ago; a DSP copy of
+     * it that overlaps this write also spans the version bump that moved
+     * active away from it, so the DSP drops that copy.
+     */
+    next = block->active ^ 1;
+    memcpy(param->slots + next * param->slot_stride,param->shadow,param->size);
+    __atomic_store_n(&block->active,next,__ATOMIC_RELEASE);
+    ver = block->version + 1;
+    __atomic_store_n(&block->version,ver,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&param->mutex);
+
+    if(version)
+        *version = ver;
+    return 0;
+}
+
+int csi_dsp_task_get_param_version(void *task_ctx,uint32_t *version,uint32_t *applied)
+{
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+
+    if(!task || !task->param)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    if(version)
+        *version = __atomic_load_n(&task->param->block->version,__ATOMIC_ACQUIRE);
+    if(applied)
+        *applied = __atomic_load_n(&task->param->block->ack,__ATOMIC_ACQUIRE);
+    return 0;
+}
+
+int csi_dsp_task_read_param(void *task_ctx,size_t offset,void *data,size_t size)
+{
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+    csi_dsp_param_t *param;
+
+    if(!task || !task->param || !data)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    param = task->param;
+    if(offset > param->size || size > param->size - offset)
+    {
+        DSP_PRINT(WARNING,"read %zu+%zu out of %zu bytes\n",offset,size,param->size);
+        return -1;
+    }
+    pthread_mutex_lock(&param->mutex);
+    memcpy(data,param->shadow + offset,size);
+    pthread_mutex_unlock(&param->mutex);
+    return 0;
+}
+
+int csi_dsp_task_release_param(void *task_ctx)
+{
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+
+    if(!task || !task->param)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    if(csi_dsp_param_config(task,CMD_RELEASE,task->param->phy))
+        return -1;
+    csi_dsp_task_free_param(task);
+    return 0;
+}
+
+void csi_dsp_task_free_param(struct csi_dsp_task_handler *task)
+{
+    if(!task->param)
+        return;
+    csi_dsp_param_free(task->param);
+    task->param = NULL;
+}
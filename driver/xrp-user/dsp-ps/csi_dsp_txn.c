@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2021 Alibaba Group. All rights reserved.
+ * License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "../include/xrp_api.h"
+#include "../include/dsp_ps_ns.h"
+#include "../include/csi_dsp_api.h"
+#include "csi_dsp_core.h"
+#include "dsp_common.h"
+
+/*
+ * Compound transactions: comm queue commands collected on the host and
+ * sent as one PS_CMD_COMPOUND, so setting up or reconfiguring a task is a
+ * single round trip. Steps may refer to a task allocated by an earlier
+ * step of the same transaction, the DSP fills in its id. Host state is
+ * only updated for the steps that succeeded, once the response is back.
+ * With firmware that does not know PS_CMD_COMPOUND the steps are sent one
+ * by one with the same semantics.
+ */
+
+#define csi_dsp_txn_align(x) (((x) + 7) & ~(size_t)7)
+
+void *csi_dsp_txn_create(void *dsp)
+{
+    struct csi_dsp_instance *instance = (struct csi_dsp_instance *)dsp;
+    csi_dsp_txn_t *txn;
+
+    if(!instance)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return NULL;
+    }
+    txn = calloc(1,sizeof(*txn));
+    if(!txn)
+        return NULL;
+    txn->instance = instance;
+    return txn;
+}
+
+/* Index of the step allocating task in txn, -1 if task exists already */
+static int csi_dsp_txn_task_step(csi_dsp_txn_t *txn,struct csi_dsp_task_handler *task)
+{
+    int i;
+
+    for(i=0;i<txn->n_steps;i++)
+    {
+        if(txn->steps[i].cmd == PS_CMD_TASK_ALLOC && txn->steps[i].task == task)
+            return i;
+    }
+    return -1;
+}
+
+static csi_dsp_txn_step_t *csi_dsp_txn_add(csi_dsp_txn_t *txn,uint32_t cmd,const void *payload,
+                                           size_t size,size_t resp_size)
+{
+    csi_dsp_txn_step_t *step;
+
+    if(txn->committed)
+    {
+        DSP_PRINT(WARNING,"transaction is already committed\n");
+        return NULL;
+    }
+    if(txn->n_steps >= CSI_DSP_TXN_MAX_STEPS)
+    {
+        DSP_PRINT(WARNING,"too many steps in transaction\n");
+        return NULL;
+    }
+    step = &txn->steps[txn->n_steps];
+    memset(step,0,sizeof(*step));
+    step->payload = malloc(size);
+    step->resp = calloc(1,resp_size);
+    if(!step->payload || !step->resp)
+    {
+        free(step->payload);
+        free(step->resp);
+        return NULL;
+    }
+    memcpy(step->payload,payload,size);
+    step->cmd = cmd;
+    step->size = size;
+    step->resp_size = resp_size;
+    step->task_step = -1;
+    txn->n_steps++;
+    return step;
+}
+
+/* Add a step for task whose payload carries the task id at task_id_offset */
+static int csi_dsp_txn_add_task_cmd(void *txn_ctx,void *task_ctx,uint32_t cmd,void *payload,
+                                    size_t size,size_t task_id_offset)
+{
+    csi_dsp_txn_t *txn = (csi_dsp_txn_t *)txn_ctx;
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+    csi_dsp_txn_step_t *step;
+    int task_step;
+
+    if(!txn || !task || !payload)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    task_step = csi_dsp_txn_task_step(txn,task);
+    step = csi_dsp_txn_add(txn,cmd,payload,size,sizeof(csi_dsp_status_e));
+    if(!step)
+        return -1;
+    /* only the copy carries the id, the caller's payload is left alone */
+    if(task_step < 0)
+        *(int *)((char *)step->payload + task_id_offset) = task->task_id;
+    step->task = task;
+    step->task_step = task_step;
+    step->task_id_offset = task_id_offset;
+    return 0;
+}
+
+void *csi_dsp_txn_create_task(void *txn_ctx,csi_dsp_task_mode_e task_type)
+{
+    csi_dsp_txn_t *txn = (csi_dsp_txn_t *)txn_ctx;
+    struct csi_dsp_task_create_req config_para;
+    struct csi_dsp_task_handler *task;
+    dsp_handler_item_t *task_item;
+    csi_dsp_txn_step_t *step;
+
+    if(!txn)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return NULL;
+    }
+    task = calloc(1,sizeof(*task));
+    task_item = malloc(sizeof(*task_item));
+    if(!task || !task_item)
+        goto err;
+    task->task_id = -1;         /* known once the transaction is committed */
+    task->instance = txn->instance;
+    task->mode = task_type;
+    config_para.type = task_type;
+    config_para.priority = 0;
+    step = csi_dsp_txn_add(txn,PS_CMD_TASK_ALLOC,&config_para,sizeof(config_para),
+                           sizeof(struct csi_dsp_task_create_resp));
+    if(!step)
+        goto err;
+    step->task = task;
+    step->task_item = task_item;
+    return task;
+
+err:
+    free(task);
+    free(task_item);
+    return NULL;
+}
+
+int csi_dsp_txn_config_frontend(void *txn,void *task,struct csi_dsp_task_fe_para *config_para)
+{
+    return csi_dsp_txn_add_task_cmd(txn,task,PS_CMD_FE_CONFIG,config_para,
+                                    sizeof(struct csi_dsp_task_fe_para),
+                                    offsetof(struct csi_dsp_task_fe_para,task_id));
+}
+
+int csi_dsp_txn_config_backend(void *txn,void *task,struct csi_dsp_task_be_para *config_para)
+{
+    size_t sz = sizeof(struct csi_dsp_task_be_para);
+
+    if(config_para && config_para->backend_type == CSI_DSP_BE_TYPE_HOST)
+        sz += sizeof(struct csi_dsp_buffer)*config_para->sw_param.num_buf;
+    return csi_dsp_txn_add_task_cmd(txn,task,PS_CMD_BE_CONFIG,config_para,sz,
+                                    offsetof(struct csi_dsp_task_be_para,task_id));
+}
+
+int csi_dsp_txn_start_task(void *txn,void *task)
+{
+    struct csi_dsp_task_start_req req;
+
+    memset(&req,0,sizeof(req));
+    return csi_dsp_txn_add_task_cmd(txn,task,PS_CMD_TASK_START,&req,sizeof(req),
+                                    offsetof(struct csi_dsp_task_start_req,task_id));
+}
+
+int csi_dsp_txn_stop_task(void *txn,void *task)
+{
+    struct csi_dsp_task_start_req req;
+
+    memset(&req,0,sizeof(req));
+    return csi_dsp_txn_add_task_cmd(txn,task,PS_CMD_TASK_STOP,&req,sizeof(req),
+                                    offsetof(struct csi_dsp_task_start_req,task_id));
+}
+
+int csi_dsp_txn_register_cb(void *txn_ctx,void *task_ctx,int (*cb)(void*context,void*data),
+                            void *context,size_t data_size)
+{
+    csi_dsp_txn_t *txn = (csi_dsp_txn_t *)txn_ctx;
+    struct csi_dsp_task_handler *task = (struct csi_dsp_task_handler *)task_ctx;
+    struct report_config_msg config;
+    csi_dsp_txn_step_t *step;
+
+    if(!txn || !task || !cb)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    /* the report is addressed by the task name, which only the DSP knows yet */
+    if(csi_dsp_txn_task_step(txn,task) >= 0)
+    {
+        DSP_PRINT(WARNING,"report of a task created in the same transaction\n");
+        return -1;
+    }
+    if(task->report_id >= 0)
+    {
+        DSP_PRINT(WARNING,"task %d already has a report callback\n",task->task_id);
+        return -1;
+    }
+    /* the host must be ready for reports before the DSP is told about them */
+    if(csi_dsp_task_add_report(task,cb,context,data_size))
+        return -1;
+    csi_dsp_task_report_config(task,CMD_SETUP,&config);
+    step = csi_dsp_txn_add(txn,PS_CMD_REPORT_CONFIG,&config,sizeof(config),sizeof(csi_dsp_status_e));
+    if(!step)
+    {
+        xrp_remove_report_item(task->instance->report_impl,task->report_id);
+        task->report_id = -1;
+        return -1;
+    }
+    step->task = task;
+    return 0;
+}
+
+static int csi_dsp_txn_step_status(csi_dsp_txn_step_t *step)
+{
+    if(step->cmd == PS_CMD_TASK_ALLOC)
+        return ((struct csi_dsp_task_create_resp *)step->resp)->status;
+    return *(csi_dsp_status_e *)step->resp;
+}
+
+/* Write the id of a task allocated earlier in the transaction into step */
+static void csi_dsp_txn_patch_task_id(csi_dsp_txn_t *txn,csi_dsp_txn_step_t *step)
+{
+    struct csi_dsp_task_create_resp *resp;
+
+    if(step->task_step < 0)
+        return;
+    resp = (struct csi_dsp_task_create_resp *)txn->steps[step->task_step].resp;
+    *(int *)((char *)step->payload + step->task_id_offset) = resp->task_id;
+}
+
+#define CSI_DSP_TXN_REJECTED  (-1)    /* firmware does not know PS_CMD_COMPOUND */
+#define CSI_DSP_TXN_FAILED    (-2)    /* sent, but what ran is unknown */
+
+/*
+ * Returns the number of steps run. Only a firmware that answered without
+ * filling in n_done rejected the command, anything else may have run
+ * some of the steps already and must not be replayed.
+ */
+static int csi_dsp_txn_send_compound(csi_dsp_txn_t *txn,int *status)
+{
+    struct csi_dsp_compound_req *req;
+    struct csi_dsp_compound_resp *resp;
+    struct csi_dsp_compound_step *hdr;
+    size_t req_size = sizeof(*req);
+    size_t resp_size = sizeof(*resp) + csi_dsp_txn_align(sizeof(int32_t) * txn->n_steps);
+    size_t resp_offset[CSI_DSP_TXN_MAX_STEPS];
+    char *p;
+    int n_done = 0;
+    int i;
+
+    for(i=0;i<txn->n_steps;i++)
+    {
+        req_size += sizeof(*hdr) + csi_dsp_txn_align(txn->steps[i].size);
+        resp_offset[i] = resp_size;
+        resp_size += csi_dsp_txn_align(txn->steps[i].resp_size);
+    }
+    req = calloc(1,req_size);
+    resp = calloc(1,resp_size);
+    if(!req || !resp)
+        goto out;
+
+    req->n_steps = txn->n_steps;
+    p = (char *)(req + 1);
+    for(i=0;i<txn->n_steps;i++)
+    {
+        csi_dsp_txn_step_t *step = &txn->steps[i];
+
+        hdr = (struct csi_dsp_compound_step *)p;
+        hdr->cmd = step->cmd;
+        hdr->size = step->size;
+        hdr->resp_offset = resp_offset[i];
+        hdr->resp_size = step->resp_size;
+        hdr->task_step = step->task_step;
+        hdr->task_id_offset = step->task_id_offset;
+        memcpy(hdr + 1,step->payload,step->size);
+        p += sizeof(*hdr) + csi_dsp_txn_align(step->size);
+    }
+
+    resp->n_done = UINT32_MAX;
+    if(csi_dsp_cmd_send(txn->instance->comm_queue,PS_CMD_COMPOUND,req,req_size,resp,resp_size,NULL))
+    {
+        DSP_PRINT(WARNING,"send PS_CMD_COMPOUND fail\n");
+        n_done = CSI_DSP_TXN_FAILED;
+        goto out;
+    }
+    /* unknown commands come back untouched or with a status in place of n_done */
+    if(resp->n_done > (uint32_t)txn->n_steps)
+    {
+        DSP_PRINT(INFO,"compound command is not supported\n");
+        n_done = CSI_DSP_TXN_REJECTED;
+        goto out;
+    }
+    n_done = resp->n_done;
+    for(i=0;i<n_done;i++)
+    {
+        memcpy(txn->steps[i].resp,(char *)resp + resp_offset[i],txn->steps[i].resp_size);
+        status[i] = resp->status[i];
+    }
+
+out:
+    free(req);
+    free(resp);
+    return n_done;
+}
+
+static int csi_dsp_txn_send_steps(csi_dsp_txn_t *txn,int *status)
+{
+    int i;
+
+    for(i=0;i<txn->n_steps;i++)
+    {
+        csi_dsp_txn_step_t *step = &txn->steps[i];
+
+        csi_dsp_txn_patch_task_id(txn,step);
+        if(csi_dsp_cmd_send(txn->instance->comm_queue,step->cmd,step->payload,step->size,
+                            step->resp,step->resp_size,NULL))
+        {
+            status[i] = CSI_DSP_FAIL;
+            return i + 1;
+        }
+        status[i] = csi_dsp_txn_step_status(step);
+        if(status[i] != CSI_DSP_OK)
+            return i + 1;
+    }
+    return i;
+}
+
+/* Bring host state in line with a step the DSP completed */
+static int csi_dsp_txn_apply(csi_dsp_txn_t *txn,csi_dsp_txn_step_t *step)
+{
+    struct csi_dsp_task_handler *task = step->task;
+
+    csi_dsp_txn_patch_task_id(txn,step);
+    switch(step->cmd)
+    {
+    case PS_CMD_TASK_ALLOC:
+        if(csi_dsp_task_setup(txn->instance,task,step->task_item,task->mode,
+                              (struct csi_dsp_task_create_resp *)step->resp))
+            return CSI_DSP_FAIL;
+        step->task_item = NULL;
+        break;
+    case PS_CMD_FE_CONFIG:
+        memcpy(&task->fe,step->payload,sizeof(task->fe));
+        break;
+    case PS_CMD_BE_CONFIG:
+        memcpy(&task->be,step->payload,sizeof(task->be));
+        break;
+    default:
+        break;
+    }
+    return CSI_DSP_OK;
+}
+
+/* Undo host state set up for a step the DSP did not complete */
+static void csi_dsp_txn_revert(csi_dsp_txn_step_t *step)
+{
+    struct csi_dsp_task_handler *task = step->task;
+
+    if(step->cmd == PS_CMD_REPORT_CONFIG)
+    {
+        xrp_remove_report_item(task->instance->report_impl,task->report_id);
+        task->report_id = -1;
+    }
+}
+
+int csi_dsp_txn_commit(void *txn_ctx,int *step_status,int n_status)
+{
+    csi_dsp_txn_t *txn = (csi_dsp_txn_t *)txn_ctx;
+    int status[CSI_DSP_TXN_MAX_STEPS];
+    int n_done = -1;
+    int ret = 0;
+    int i;
+
+    if(!txn || !txn->n_steps || txn->committed)
+    {
+        DSP_PRINT(WARNING,"param check fail\n");
+        return -1;
+    }
+    txn->committed = 1;
+    if(!txn->instance->no_compound)
+    {
+        n_done = csi_dsp_txn_send_compound(txn,status);
+        if(n_done == CSI_DSP_TXN_REJECTED)
+            txn->instance->no_compound = 1;
+    }
+    if(n_done == CSI_DSP_TXN_FAILED)
+    {
+        for(i=0;i<txn->n_steps;i++)
+            status[i] = CSI_DSP_FAIL;
+        n_done = txn->n_steps;
+    }
+    else if(n_done < 0)
+    {
+        n_done = csi_dsp_txn_send_steps(txn,status);
+    }
+
+    for(i=0;i<txn->n_steps;i++)
+    {
+        if(i >= n_done)
+            status[i] = CSI_DSP_TXN_STEP_NOT_RUN;
+        else if(status[i] == CSI_DSP_OK)
+            status[i] = csi_dsp_txn_apply(txn,&txn->steps[i]);
+        if(status[i] != CSI_DSP_OK)
+        {
+            csi_dsp_txn_revert(&txn->steps[i]);
+            ret = -1;
+        }
+        if(step_status && i < n_status)
+            step_status[i] = status[i];
+    }
+    DSP_PRINT(INFO,"transaction of %d steps, %d run%s\n",txn->n_steps,n_done,ret ? ", failed" : "");
+    return ret;
+}
+
+void csi_dsp_txn_destroy(void *txn_ctx)
+{
+    csi_dsp_txn_t *txn = (csi_dsp_txn_t *)txn_ctx;
+    int i;
+
+    if(!txn)
+        return;
+    for(i=0;i<txn->n_steps;i++)
+    {
+        csi_dsp_txn_step_t *step = &txn->steps[i];
+
+        if(!txn->committed)
+            csi_dsp_txn_revert(step);
+        /* tasks whose allocation did not go through */
+        if(step->task_item)
+        {
+            free(step->task_item);
+            free(step->task);
+        }
+        free(step->payload);
+        free(step->resp);
+    }
+    free(txn);
+}
@@ -53,6 +53,92 @@ void *csi_dsp_create_instance(int dsp_id);
  */
 int csi_dsp_delete_instance(void *dsp);
 
+/**
+ * @description: set the number of bytes the instance keeps cached in
+ *   released CSI_DSP_BUF_ALLOC_DRV request buffers; buffers above it are
+ *   freed. 0 disables the cache. Defaults to CSI_DSP_BUF_POOL_MAX from the
+ *   environment or 64 MiB.
+ * @param {void} *dsp
+ * @param {size_t} high_water
+ * @return {int} 0 on success
+ */
+int csi_dsp_set_buf_pool_limit(void *dsp,size_t high_water);
+
+/**
+ * @description: get the buffer cache statistics of an instance
+ * @param {void} *dsp
+ * @param {csi_dsp_buf_pool_stats_t} *stats
+ * @return {int} 0 on success
+ */
+int csi_dsp_get_buf_pool_stats(void *dsp,csi_dsp_buf_pool_stats_t *stats);
+
+/**
+ * @description: limit the number of idle dma-buf imports an instance keeps.
+ *   Imports are keyed by the dma-buf behind the fd, so a buffer handed in
+ *   again is not imported again. A cached import holds its own fd, use 0 to
+ *   release every idle import, e.g. before freeing the dma-bufs.
+ *   Defaults to CSI_DSP_DMABUF_CACHE_MAX from the environment, or 16.
+ * @param {void} *dsp
+ * @param {size_t} max_idle
+ * @return {int} 0 on success
+ */
+int csi_dsp_set_dmabuf_cache_limit(void *dsp,size_t max_idle);
+
+/**
+ * @description: get the dma-buf import cache statistics of an instance
+ * @param {void} *dsp
+ * @param {csi_dsp_dmabuf_cache_stats_t} *stats
+ * @return {int} 0 on success
+ */
+int csi_dsp_get_dmabuf_cache_stats(void *dsp,csi_dsp_dmabuf_cache_stats_t *stats);
+
+/**
+ * @description: limit the device memory an instance keeps for algorithm
+ *   libraries no task uses. Libraries acquired with csi_dsp_task_acquire_algo
+ *   stay in device memory and are shared by all tasks of the instance.
+ *   Defaults to CSI_DSP_ALGO_CACHE_MAX from the environment, or 16 MiB.
+ * @param {void} *dsp
+ * @param {size_t} high_water
+ * @return {int} 0 on success
+ */
+int csi_dsp_set_algo_cache_limit(void *dsp,size_t high_water);
+
+/**
+ * @description: get the algorithm library cache statistics of an instance
+ * @param {void} *dsp
+ * @param {csi_dsp_algo_cache_stats_t} *stats
+ * @return {int} 0 on success
+ */
+int csi_dsp_get_algo_cache_stats(void *dsp,csi_dsp_algo_cache_stats_t *stats);
+
+/**
+ * @description: start reading an algorithm library into device memory in
+ *   the background, e.g. ahead of a scene switch.
+ * @param {void} *dsp
+ * @param {char} *name: library name as for csi_dsp_task_acquire_algo
+ * @return {void*} prefetch handle, NULL on error
+ */
+void *csi_dsp_algo_prefetch(void *dsp,const char *name);
+
+/**
+ * @description: load a prefetched library for a task, the equivalent of
+ *   csi_dsp_task_acquire_algo. Waits if the prefetch has not finished yet,
+ *   otherwise only the load command is sent. The handle stays valid and
+ *   may be attached to more tasks.
+ * @param {void} *task_ctx
+ * @param {void} *handle: from csi_dsp_algo_prefetch
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_attach_algo(void *task_ctx,void *handle);
+
+/**
+ * @description: release a prefetch handle. Tasks it was attached to keep
+ *   their library.
+ * @param {void} *handle
+ * @return {int} 0 on success
+ */
+int csi_dsp_algo_prefetch_release(void *handle);
+
 /**
  * @description: create an task on an instance 
  * Task have a dependece Algo
@@ -120,6 +206,55 @@ int csi_dsp_task_get_backend(void *task,struct csi_dsp_task_be_para *config_para
  * @return {*}
  */
 int csi_dsp_task_config_algo(void *task,struct csi_dsp_algo_config_par *config_para);
+/**
+ * @description: create the task's algorithm parameter block in shared
+ *   memory and register it with the DSP, which reads it at every frame
+ *   boundary. One block per task.
+ * @param {void} *task
+ * @param {void} *init: initial parameters, NULL for all zero
+ * @param {size_t} size: size of the parameters, e.g. sizeof(salgo_config_par)
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_create_param(void *task,const void *init,size_t size);
+/**
+ * @description: change part of the parameters, e.g. a single coefficient
+ *   at offsetof(salgo_config_par,gamma). Takes effect from the next frame
+ *   the DSP starts; no command is sent.
+ * @param {void} *task
+ * @param {size_t} offset: byte offset into the parameters
+ * @param {void} *data
+ * @param {size_t} size
+ * @param {uint32_t} *version: version published by this update, may be NULL
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_update_param(void *task,size_t offset,const void *data,size_t size,
+                              uint32_t *version);
+/**
+ * @description: versions of the parameter block, a change has been
+ *   applied once applied reaches the version its update returned.
+ * @param {void} *task
+ * @param {uint32_t} *version: latest published version, may be NULL
+ * @param {uint32_t} *applied: version the DSP last applied, may be NULL
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_get_param_version(void *task,uint32_t *version,uint32_t *applied);
+/**
+ * @description: read back part of the parameters as last published, from
+ *   the host copy; device memory is not read.
+ * @param {void} *task
+ * @param {size_t} offset: byte offset into the parameters
+ * @param {void} *data
+ * @param {size_t} size
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_read_param(void *task,size_t offset,void *data,size_t size);
+/**
+ * @description: unregister and free the parameter block. Destroying the
+ *   task does this too.
+ * @param {void} *task
+ * @return {int} 0 on success
+ */
+int csi_dsp_task_release_param(void *task);
 /**
  * @description: 
  * @param {void} *task_ctx
@@ -164,6 +299,90 @@ int csi_dsp_task_register_cb(void *task,
  */
 int csi_dsp_ps_task_unregister_cb(void *task);
 
+/* step_status of a step that was not run because an earlier one failed */
+#define CSI_DSP_TXN_STEP_NOT_RUN 1
+
+/**
+ * @description: start a transaction that collects task commands and sends
+ *   them to the DSP as one message on csi_dsp_txn_commit, e.g. to create,
+ *   configure and start a task in a single round trip. The single message
+ *   needs a firmware with PS_CMD_COMPOUND and CSI_DSP_COMPOUND=1 in the
+ *   environment, otherwise the steps are sent one by one.
+ * @param {void} *dsp
+ * @return {void*} transaction, NULL on error
+ */
+void *csi_dsp_txn_create(void *dsp);
+/**
+ * @description: allocate a task as part of the transaction. The handle may
+ *   be passed to later steps of the same transaction; it is a usable task
+ *   only if its step succeeded, otherwise csi_dsp_txn_destroy frees it.
+ * @param {void} *txn
+ * @param {csi_dsp_task_mode_e} task_type
+ * @return {void*} task handle, NULL on error
+ */
+void *csi_dsp_txn_create_task(void *txn,csi_dsp_task_mode_e task_type);
+/**
+ * @description: transaction step equivalent of csi_dsp_task_config_frontend
+ * @return {int} 0 if the step was added
+ */
+int csi_dsp_txn_config_frontend(void *txn,void *task,struct csi_dsp_task_fe_para *config_para);
+/**
+ * @description: transaction step equivalent of csi_dsp_task_config_backend
+ * @return {int} 0 if the step was added
+ */
+int csi_dsp_txn_config_backend(void *txn,void *task,struct csi_dsp_task_be_para *config_para);
+/**
+ * @description: transaction step equivalent of csi_dsp_task_start
+ * @return {int} 0 if the step was added
+ */
+int csi_dsp_txn_start_task(void *txn,void *task);
+/**
+ * @description: transaction step equivalent of csi_dsp_task_stop
+ * @return {int} 0 if the step was added
+ */
+int csi_dsp_txn_stop_task(void *txn,void *task);
+/**
+ * @description: transaction step equivalent of csi_dsp_task_register_cb.
+ *   Not for a task created in the same transaction.
+ * @return {int} 0 if the step was added
+ */
+int csi_dsp_txn_register_cb(void *txn,void *task,int (*cb)(void*context,void*data),
+                            void *context,size_t data_size);
+/**
+ * @description: send the steps in order, the DSP stops at the first one that
+ *   fails. Task state on the host is updated for the steps that succeeded.
+ *   A transaction is committed once.
+ * @param {void} *txn
+ * @param {int} *step_status: csi_dsp_status_e of each step in the order they
+ *   were added, or CSI_DSP_TXN_STEP_NOT_RUN; may be NULL
+ * @param {int} n_status: entries in step_status
+ * @return {int} 0 if every step succeeded
+ */
+int csi_dsp_txn_commit(void *txn,int *step_status,int n_status);
+/**
+ * @description: free a transaction, committed or not
+ * @param {void} *txn
+ */
+void csi_dsp_txn_destroy(void *txn);
+/**
+ * @description: set up a result buffer ring for the task. Results
+ *   reported as CSI_DSP_REPORT_RESULT_BUF are read in place from the ring
+ *   and handed to cb, the slot goes back to the DSP when cb returns. Must
+ *   be called before csi_dsp_task_register_cb, other report types still go
+ *   to the callback registered there.
+ * @param {void} *task
+ * @param {size_t} slot_size: bytes per result slot
+ * @param {int} slot_num: number of result slots
+ * @param {int (*)(void*,void*,size_t)} cb: result callback
+ * @param {void*} context
+ * @return {*} 0 on success
+ */
+int csi_dsp_task_register_result_cb(void *task,
+                            size_t slot_size,
+                            int slot_num,
+                            int (*cb)(void*context,void*result,size_t size),
+                            void* context);
+
 /**
  * @description: 
  * @param {void} *task
@@ -222,6 +441,46 @@ struct csi_sw_task_req*  csi_dsp_request_dequeue(void *task);
  */
 int csi_dsp_task_release_request(struct csi_sw_task_req* req);
 
+/**
+ * @description: make a completed request ready to be enqueued again.
+ *   Buffers, their mappings and the property buffer stay attached, so
+ *   only plane data and properties need to be updated before the next
+ *   csi_dsp_request_enqueue; csi_dsp_request_set_property reuses the
+ *   property buffer when the new property fits in it.
+ * @param {csi_sw_task_req*} req: a request returned by csi_dsp_request_dequeue
+ *   or never enqueued
+ * @return {int} 0 on success, -1 if the request is still running
+ */
+int csi_dsp_request_rearm(struct csi_sw_task_req* req);
+
+/**
+ * @description: limit cache maintenance of a dma-buf plane to a rectangle.
+ *   Input planes are cleaned on csi_dsp_request_enqueue and output planes
+ *   invalidated on csi_dsp_request_dequeue; by default the whole plane is
+ *   synced. The region stays set across csi_dsp_request_rearm.
+ * @param {csi_sw_task_req*} req
+ * @param {int} buf_idx: index of the buffer in the order it was added
+ * @param {int} plane
+ * @param {uint32_t} x, width: bytes within a line, within the plane stride
+ * @param {uint32_t} y, height: lines; width or height 0 syncs the whole plane
+ * @return {int} 0 on success
+ */
+int csi_dsp_request_set_sync_rect(struct csi_sw_task_req* req,int buf_idx,int plane,
+                                  uint32_t x,uint32_t y,uint32_t width,uint32_t height);
+
+/**
+ * @description: limit cache maintenance of a dma-buf plane to whole lines,
+ *   see csi_dsp_request_set_sync_rect.
+ * @param {csi_sw_task_req*} req
+ * @param {int} buf_idx
+ * @param {int} plane
+ * @param {uint32_t} first_line
+ * @param {uint32_t} lines: 0 syncs the whole plane
+ * @return {int} 0 on success
+ */
+int csi_dsp_request_set_sync_lines(struct csi_sw_task_req* req,int buf_idx,int plane,
+                                   uint32_t first_line,uint32_t lines);
+
 
 int csi_dsp_task_update_backend_buf(void *task_ctx,struct csi_dsp_task_be_para* config_para);
 int csi_dsp_test_config(void* dsp ,struct csi_dsp_ip_test_par* config_para,void* buf);
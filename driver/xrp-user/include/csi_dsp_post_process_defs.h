@@ -80,6 +80,26 @@ struct csi_dsp_plane {
     uint64_t buf_vir;
 };
 
+/*
+ * A dma-buf plane that is not physically contiguous has CSI_DSP_PLANE_SG_LIST
+ * set in buf_phy, the remaining bits address a csi_dsp_sg_list_t describing
+ * its segments in order.
+ */
+#define CSI_DSP_PLANE_SG_LIST (1ULL << 63)
+
+typedef struct csi_dsp_sg_entry {
+    uint64_t paddr;
+    uint32_t size;
+    uint32_t reserved;
+} csi_dsp_sg_entry_t;
+
+typedef struct csi_dsp_sg_list {
+    uint32_t n_entries;
+    uint32_t size;
+    uint64_t reserved;
+    csi_dsp_sg_entry_t entry[0];
+} csi_dsp_sg_list_t;
+
 typedef enum csi_dsp_buf_type {
 	CSI_DSP_BUF_TYPE_DMA_BUF_IMPORT,		// memory allocated via dma-buf from extern
     CSI_DSP_BUF_TYPE_DMA_BUF_EXPORT,     // memory allocated via dma-buf from internal
@@ -92,6 +92,7 @@ typedef enum{
   CSI_DSP_REPORT_HEARTBEAT_ERR,
   CSI_DSP_HW_FRAME_DROP,
   CSI_DSP_REPORT_EXRA_PARAM,
+  CSI_DSP_REPORT_RESULT_BUF,
 }csi_dsp_report_e;
 
 typedef struct dsp_frame{
@@ -197,14 +198,82 @@ struct csi_dsp_task_be_para{
 
 };
 
+/*
+ * Result buffer ring shared with the DSP, passed in the addr of
+ * PS_CMD_REPORT_CONFIG. The DSP writes a result into slot head % slot_num,
+ * bumps head and sends a CSI_DSP_REPORT_RESULT_BUF report naming the slot;
+ * the host bumps tail once it is done reading the slot in place.
+ */
+typedef struct csi_dsp_result_ring{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t slot_num;
+    uint32_t slot_size;
+    uint64_t slot_addr;     /* DSP address of slot 0 */
+}csi_dsp_result_ring_t;
+
+/*
+ * Algorithm parameter block shared with the DSP, passed in the addr of
+ * PS_CMD_ALGO_PARAM_CONFIG. The host writes new parameters into the slot
+ * active does not name, stores active and then bumps version. At a frame
+ * boundary the DSP reads version, copies slot active and reads version
+ * again, keeping its previous parameters if the two differ; ack is the
+ * version it last applied.
+ */
+typedef struct csi_dsp_param_block{
+    uint32_t version;
+    uint32_t active;
+    uint32_t size;          /* bytes per slot */
+    uint32_t ack;
+    uint64_t slot_addr[2];  /* DSP address of each slot */
+}csi_dsp_param_block_t;
+
+/* payload of a CSI_DSP_REPORT_RESULT_BUF report */
+typedef struct csi_dsp_result_ref{
+    uint32_t slot;
+    uint32_t offset;
+    uint32_t size;
+}csi_dsp_result_ref_t;
+
 typedef struct csi_dsp_report_item{
     csi_dsp_report_e type;
     union{
         char data[MAX_REPORT_SIZE];
         struct csi_dsp_buffer buf;
+        csi_dsp_result_ref_t result;
     };
 }csi_dsp_report_item_t;
 
+/* statistics of the per-instance CSI_DSP_BUF_ALLOC_DRV buffer cache */
+typedef struct csi_dsp_buf_pool_stats{
+    uint64_t hits;          /* allocations served from the cache */
+    uint64_t misses;        /* allocations that created a new buffer */
+    uint64_t trims;         /* buffers released because of the high water mark */
+    size_t cached_num;
+    size_t cached_bytes;
+    size_t high_water;
+}csi_dsp_buf_pool_stats_t;
+
+/* statistics of the per-instance dma-buf import cache */
+typedef struct csi_dsp_dmabuf_cache_stats{
+    uint64_t hits;          /* imports served from the cache */
+    uint64_t misses;        /* imports that went to the driver */
+    uint64_t evictions;     /* idle imports released from the LRU */
+    size_t busy_num;        /* dma-bufs referenced by buffers or requests */
+    size_t idle_num;
+    size_t max_idle;
+}csi_dsp_dmabuf_cache_stats_t;
+
+/* statistics of the per-instance algorithm library cache */
+typedef struct csi_dsp_algo_cache_stats{
+    uint64_t hits;          /* acquires served without reading the library */
+    uint64_t misses;
+    uint64_t evictions;     /* idle libraries released because of the high water mark */
+    size_t cached_num;
+    size_t idle_bytes;      /* held by no task */
+    size_t high_water;
+}csi_dsp_algo_cache_stats_t;
+
 typedef struct csi_dsp_algo_load_req{
 	uint16_t  algo_id;
     int task_id;
@@ -83,6 +83,8 @@ typedef enum {
   PS_CMD_DSP_IP_TEST,
   PS_CMD_BE_ASSGIN_BUF,
   PS_CMD_ALGO_LOAD,
+  PS_CMD_ALGO_PARAM_CONFIG,
+  PS_CMD_COMPOUND,
 }ECOMMON_CMD;
 
 enum cmd_type{
@@ -99,6 +101,42 @@ struct report_config_msg{
   uint64_t  addr;
 };
 
+struct csi_dsp_algo_param_config_req{
+    int  task_id;
+    enum cmd_type flag;
+    uint64_t  addr;         /* csi_dsp_param_block_t */
+};
+
+/*
+ * PS_CMD_COMPOUND payload: a csi_dsp_compound_req followed by n_steps
+ * steps, each a csi_dsp_compound_step and its payload padded to 8 bytes.
+ * The DSP runs the steps in order as if they were sent one by one and
+ * stops at the first one that fails. A step with task_step >= 0 first
+ * gets the task id from the PS_CMD_TASK_ALLOC response of that step
+ * written at task_id_offset of its payload.
+ * The response is a csi_dsp_compound_resp with the status of each step
+ * run, followed by the step responses at their resp_offset.
+ */
+struct csi_dsp_compound_req{
+    uint32_t  n_steps;
+    uint32_t  reserved;
+};
+
+struct csi_dsp_compound_step{
+    uint32_t  cmd;
+    uint32_t  size;
+    uint32_t  resp_offset;
+    uint32_t  resp_size;
+    int32_t   task_step;
+    uint32_t  task_id_offset;
+};
+
+struct csi_dsp_compound_resp{
+    uint32_t  n_done;       /* steps run, including a failed last one */
+    uint32_t  reserved;
+    int32_t   status[0];
+};
+
 struct data_move_msg{
   uint64_t  src_addr;
   uint64_t  dst_addr;
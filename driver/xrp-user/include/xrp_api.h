@@ -73,6 +73,13 @@ enum xrp_access_flags {
 	XRP_READ		= 0x1,
 	XRP_WRITE		= 0x2,
 	XRP_READ_WRITE		= 0x3,
+	/*! xrp_import_dma_buf only: the buffer is for the DSP, don't map it
+	 *  into the process, user_addr is returned as 0. */
+	XRP_NO_CPU_MAP		= 0x200,
+	/*! xrp_import_dma_buf only: accept a buffer that is not physically
+	 *  contiguous. phy_addr then addresses a descriptor list and has
+	 *  XRP_DMABUF_PADDR_SG set, see xrp_kernel_defs.h. */
+	XRP_SG_LIST		= 0x400,
 };
 
 /*!
@@ -101,6 +108,13 @@ enum xrp_buffer_group_info {
 
 #define XRP_NAMESPACE_ID_SIZE	16
 
+/*!
+ * in_data payloads up to this size are copied into the queued request
+ * itself by xrp_enqueue_command; larger ones take a separate allocation.
+ * Sized for the sw task requests libdsp submits.
+ */
+#define XRP_REQUEST_INLINE_DATA_SIZE	1024
+
 /*!
  * \defgroup device_api Device API
  * These calls are available on the host side and on the DSP side with the
@@ -131,6 +145,47 @@ void xrp_retain_device(struct xrp_device *device);
  */
 void xrp_release_device(struct xrp_device *device);
 
+/*!
+ * Set the number of threads that process commands of all queues of the
+ * device. Commands of one queue are still processed in order, one at a
+ * time. 0 selects one dedicated thread per queue.
+ * Must be called before the first queue is created on the device, the
+ * default may be set with the XRP_QUEUE_THREADS environment variable.
+ * \param[out] status: operation status
+ */
+void xrp_device_set_queue_threads(struct xrp_device *device,
+				  size_t n_threads,
+				  enum xrp_status *status);
+
+/*!
+ * Let xrp_run_command_sync issue the command on the calling thread when
+ * its queue is idle instead of handing it to a queue thread. Commands of
+ * a queue still run in submission order. Enabled by default, the default
+ * may be set with the XRP_QUEUE_SYNC_INLINE environment variable.
+ * \param enable: 0 to always go through the queue thread
+ * \param[out] status: operation status
+ */
+void xrp_device_set_sync_inline(struct xrp_device *device, int enable,
+				enum xrp_status *status);
+
+/*!
+ * Set scheduling of the threads that process queue commands.
+ * Queues created with priority > 0 (see xrp_create_nsp_queue) get a
+ * dedicated thread running with the given real-time policy at that
+ * priority above the policy minimum; falls back to a normal thread when
+ * the process may not use real-time scheduling. Other queues are served
+ * by normal priority threads.
+ * Must be called before the first queue is created on the device, the
+ * defaults may be set with XRP_QUEUE_POLICY (fifo, rr or other) and
+ * XRP_QUEUE_CPUS (CPU mask, e.g. 0xc) environment variables.
+ * \param policy: SCHED_FIFO, SCHED_RR or SCHED_OTHER
+ * \param cpu_mask: CPUs the queue threads may run on, 0 for any
+ * \param[out] status: operation status
+ */
+void xrp_device_set_queue_sched(struct xrp_device *device,
+				int policy, unsigned long cpu_mask,
+				enum xrp_status *status);
+
 /*!
  * @}
  */
@@ -193,6 +248,26 @@ void xrp_unmap_buffer(struct xrp_buffer *buffer, void *p,
 void xrp_buffer_get_info(struct xrp_buffer *buffer, enum xrp_buffer_info info,
 			 void *out, size_t out_sz, enum xrp_status *status);
 
+/*!
+ * Register buffers with the device driver.
+ * The driver pins and translates registered buffers once, commands then
+ * refer to them by handle, which saves the per-command lookup of the
+ * memory. Registration is all or nothing and is undone when the buffer is
+ * released or with xrp_unregister_buffer. Commands still work when
+ * registration fails, e.g. with an older driver.
+ * \param[out] status: operation status
+ */
+void xrp_register_buffers(struct xrp_device *device,
+			  struct xrp_buffer **buffer, size_t n_buffers,
+			  enum xrp_status *status);
+
+/*!
+ * Undo xrp_register_buffers for a single buffer.
+ * \param[out] status: operation status
+ */
+void xrp_unregister_buffer(struct xrp_buffer *buffer,
+			   enum xrp_status *status);
+
 /*!
  * @}
  */
@@ -316,6 +391,17 @@ struct xrp_queue *xrp_create_nsp_queue(struct xrp_device *device,
 				       int priority,
 				       enum xrp_status *status);
 
+/*!
+ * Get an eventfd that counts commands completed on the queue.
+ * Reading it returns the number of completions since the previous read,
+ * individual results are then checked with xrp_event_status().
+ * The descriptor is created on the first call, is non-blocking and is
+ * closed when the queue is released.
+ * \param[out] status: operation status
+ * \return file descriptor or -1 on failure
+ */
+int xrp_queue_get_fd(struct xrp_queue *queue, enum xrp_status *status);
+
 /*!
  * Increment queue reference count.
  */
@@ -359,6 +445,28 @@ void xrp_release_event(struct xrp_event *event);
  */
 void xrp_event_status(struct xrp_event *event, enum xrp_status *status);
 
+/*!
+ * Get an eventfd that becomes readable once the event is signaled.
+ * The descriptor is created on the first call, is non-blocking and is
+ * owned by the event: it is closed when the event is released.
+ * It may be added to poll/epoll sets along with any other descriptors.
+ * \param[out] status: operation status
+ * \return file descriptor or -1 on failure
+ */
+int xrp_event_get_fd(struct xrp_event *event, enum xrp_status *status);
+
+/*!
+ * Call notify(event, context) once when the event is signaled.
+ * If the event is already signaled notify is called before this function
+ * returns, otherwise it is called from the thread that completes the
+ * command. notify must not block and must not release the event.
+ * Only one callback may be set per event.
+ * \param[out] status: operation status
+ */
+void xrp_event_set_notify(struct xrp_event *event,
+			  void (*notify)(struct xrp_event *event, void *context),
+			  void *context, enum xrp_status *status);
+
 /*!
  * @}
  */
@@ -442,6 +550,104 @@ void xrp_enqueue_command(struct xrp_queue *queue,
 			 struct xrp_event **event,
 			 enum xrp_status *status);
 
+/*!
+ * Description of a single command for xrp_enqueue_commands().
+ * Fields have the same meaning as the corresponding xrp_enqueue_command()
+ * parameters.
+ */
+struct xrp_command {
+	const void *in_data;
+	size_t in_data_size;
+	void *out_data;
+	size_t out_data_size;
+	struct xrp_buffer_group *buffer_group;
+};
+
+/*!
+ * Asynchronously send a number of commands from host to DSP.
+ *
+ * Equivalent to calling xrp_enqueue_command() for each element of the cmd
+ * array in order, but all commands become visible to the queue at once and
+ * may be passed to the driver with a single call.
+ *
+ * If event is non-NULL it must point to an array of n_cmds event pointers
+ * that receive events corresponding to the queued commands.
+ *
+ * Enqueuing is all-or-nothing: on failure no command has been queued and
+ * the event array does not contain useful information.
+ *
+ * \param[in] cmd: an array of command descriptions
+ * \param[in] n_cmds: number of commands in the cmd array
+ * \param[out] status: operation status
+ */
+void xrp_enqueue_commands(struct xrp_queue *queue,
+			  const struct xrp_command *cmd, size_t n_cmds,
+			  struct xrp_event **event,
+			  enum xrp_status *status);
+
+/*!
+ * Asynchronously send command from host to DSP without a thread hop.
+ *
+ * Same as xrp_enqueue_command(), but the command is passed to the driver
+ * directly from the calling thread and the queue worker thread is not
+ * involved. The call returns as soon as the driver has accepted the command.
+ *
+ * Events of commands submitted this way are signaled, and their notify
+ * callbacks run, by a completion thread of the device that is started
+ * with the first such command. A caller may still reap completions
+ * earlier with xrp_device_process_completions().
+ *
+ * With a driver that does not support asynchronous submission the command
+ * is handed to the queue worker thread as xrp_enqueue_command() does.
+ * A command the driver rejects fails with XRP_STATUS_FAILURE and errno
+ * set by the driver, e.g. EINVAL.
+ *
+ * \param[out] status: operation status
+ */
+void xrp_submit_command(struct xrp_queue *queue,
+			const void *in_data, size_t in_data_size,
+			void *out_data, size_t out_data_size,
+			struct xrp_buffer_group *buffer_group,
+			struct xrp_event **event,
+			enum xrp_status *status);
+
+/*!
+ * Get the device file descriptor. It becomes readable (poll/epoll) when
+ * commands submitted with xrp_submit_command() have completed.
+ * The descriptor is owned by the device and must not be closed.
+ */
+int xrp_device_get_fd(struct xrp_device *device);
+
+/*!
+ * Switch command submission on the device to shared submission/completion
+ * rings mapped from the driver.
+ *
+ * After a successful call xrp_enqueue_command() and xrp_enqueue_commands()
+ * on every queue of the device write commands directly into the submission
+ * ring instead of going through the queue thread. The completion ring is
+ * reaped by xrp_wait() and by the device completion thread, so notify
+ * callbacks run without a waiter. entries is the submission ring size,
+ * a power of 2.
+ * If sq_poll is non-zero a driver thread polls the submission ring, so
+ * steady-state submission needs no system call at all.
+ *
+ * \param[out] status: operation status
+ */
+void xrp_device_setup_ring(struct xrp_device *device, size_t entries,
+			   int sq_poll, enum xrp_status *status);
+
+/*!
+ * Collect completions of commands submitted with xrp_submit_command()
+ * or through the device rings, copy their results to out_data and signal
+ * their events. Does not block. The device completion thread does this
+ * as well, calling it is only needed to reap on the caller's thread.
+ *
+ * \param[out] status: operation status
+ * \return number of commands completed by this call
+ */
+size_t xrp_device_process_completions(struct xrp_device *device,
+				      enum xrp_status *status);
+
 /*!
  * Wait for the event.
  * Waiting for already signaled event completes immediately.
@@ -470,6 +676,15 @@ void xrp_wait(struct xrp_event *event, enum xrp_status *status);
 size_t xrp_wait_any(struct xrp_event **event, size_t n_events,
 		    enum xrp_status *status);
 
+/*!
+ * Register cb as the handler of reports with report_id.
+ *
+ * Handlers run on the dispatcher thread of the reporter, not in signal
+ * context, so they may block, take locks or allocate memory. data points
+ * into the report ring and is only valid until the handler returns.
+ * xrp_remove_report_item waits for a running handler of the removed item
+ * unless it is called from a handler.
+ */
 int xrp_add_report_item_with_id(struct xrp_report *report,
 								int (*cb)(void*context,void*data),
 								int report_id,
@@ -485,6 +700,31 @@ void xrp_remove_report_item(struct xrp_report *report,int report_id);
 
 struct xrp_report *xrp_create_reporter(struct xrp_device *device,size_t size);
 
+/*!
+ * Create a reporter whose reports are queued in a ring of depth entries.
+ *
+ * The driver copies each DSP report into the ring and hands the DSP report
+ * slot back immediately, so reports are not lost while earlier ones are
+ * still being processed. When the ring is full new reports are dropped and
+ * counted, see xrp_reporter_dropped. The DSP has a single report slot,
+ * creating a second reporter on a device fails until the first one is
+ * released; report items of all users share that one reporter.
+ *
+ * \param device: device the reporter is created for
+ * \param size: maximal report payload size
+ * \param depth: number of ring entries, rounded up to a power of two;
+ *               0 takes XRP_REPORT_DEPTH from the environment or the
+ *               driver default
+ * \return pointer to the new reporter or NULL on failure
+ */
+struct xrp_report *xrp_create_reporter_ring(struct xrp_device *device,
+					    size_t size, size_t depth);
+
+/*!
+ * Number of reports dropped by the driver because the report ring was full.
+ */
+size_t xrp_reporter_dropped(struct xrp_report *report);
+
 int xrp_release_reporter(struct xrp_device *device,struct xrp_report *report);
 
 void xrp_import_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags flag ,uint64_t *phy_addr,
@@ -493,6 +733,19 @@ void xrp_import_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags
 void xrp_release_dma_buf(struct xrp_device *device, int fd,enum xrp_status *status);
 
 void xrp_flush_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags flag ,enum xrp_status *status);
+
+/*!
+ * Cache maintenance for part of an imported dma-buf.
+ * \param flag: XRP_READ when the DSP reads the buffer, XRP_WRITE when it
+ * writes it, XRP_READ_WRITE for both.
+ * \param to_device: non-zero before the DSP accesses the buffer (cleans
+ * what it reads), zero after it is done (invalidates what it wrote).
+ * \param offset, size: byte range within the buffer, size 0 for all of it.
+ * \param[out] status: operation status
+ */
+void xrp_sync_dma_buf(struct xrp_device *device, int fd, enum xrp_access_flags flag,
+		      int to_device, size_t offset, size_t size,
+		      enum xrp_status *status);
 /*!
  * @}
  */
@@ -35,5 +35,8 @@ typedef uint32_t __u32;
 #ifndef HAVE___U64
 typedef uint64_t __u64;
 #endif
+#ifndef HAVE___S32
+typedef int32_t __s32;
+#endif
 
 #endif
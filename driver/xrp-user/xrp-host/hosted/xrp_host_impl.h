@@ -28,18 +28,79 @@
 #include "xrp_thread_impl.h"
 #include "xrp_queue_impl.h"
 
+struct xrp_request;
+
 struct xrp_device_impl {
 	int fd;
+	/* the driver has no XRP_IOCTL_QUEUE_BATCH */
+	int no_batch;
+	/* the driver has no XRP_IOCTL_QUEUE_ASYNC */
+	int no_async;
+	/* run synchronous commands on the caller's thread when possible */
+	int sync_inline;
+	/* Commands passed with xrp_submit_command, in submission order */
+	xrp_mutex async_lock;
+	struct xrp_request *async_head;
+	struct xrp_request *async_tail;
+	/* one reader of async completions at a time, the fd is blocking */
+	xrp_mutex async_read_lock;
+	/* Shared submission/completion rings, see xrp_device_setup_ring */
+	struct xrp_ring_header *ring;
+	struct xrp_ring_sqe *ring_sqe;
+	struct xrp_ring_cqe *ring_cqe;
+	size_t ring_size;
+	uint32_t ring_sq_entries;
+	uint32_t ring_cq_entries;
+	uint32_t ring_flags;
+	xrp_mutex ring_sq_lock;
+	xrp_mutex ring_cq_lock;
+	/*
+	 * Reaps async and ring completions so their events and notify
+	 * callbacks fire without the caller polling the device, started
+	 * with the first such command. exit_flag is set when the last
+	 * device reference is dropped on that thread itself.
+	 */
+	xrp_mutex completion_lock;
+	int completion_started;
+	int completion_exit_fd;
+	int *completion_exit_flag;
+	xrp_thread completion_thread;
+	/*
+	 * Threads draining the queues of this device, created with the first
+	 * queue. n_workers == 0 means one thread per queue.
+	 */
+	xrp_mutex pool_lock;
+	struct xrp_worker_pool *pool;
+	size_t n_workers;
+	/*
+	 * Policy and CPUs of queue threads. Queues with priority > 0 get a
+	 * dedicated real-time thread instead of a pool worker.
+	 */
+	struct xrp_thread_sched sched;
 };
 
 struct xrp_buffer_impl {
+	/* XRP_IOCTL_BUFFER_REGISTER handle on device, 0 if not registered */
+	uint32_t handle;
+	struct xrp_device *device;
 };
 
 struct xrp_queue_impl {
 	struct xrp_request_queue queue;
+	/* Recycled request objects, see xrp_request_alloc/xrp_request_free */
+	xrp_mutex request_pool_lock;
+	struct xrp_request *request_pool;
+	size_t n_pooled;
+	/* eventfd counting completed commands, see xrp_queue_get_fd */
+	_Atomic int efd;
 };
 
 void xrp_impl_release_device(struct xrp_device *device);
+void xrp_impl_unregister_buffer(struct xrp_buffer *buffer);
+
+struct xrp_event;
+void xrp_impl_ring_wait(struct xrp_event *event);
+void xrp_impl_ring_wait_any(struct xrp_event **event, size_t n_events);
 
 void xrp_impl_create_device_buffer(struct xrp_device *device,
 				   struct xrp_buffer *buffer,
@@ -50,6 +111,11 @@ void xrp_impl_release_device_buffer(struct xrp_buffer *buffer);
 void xrp_impl_create_queue(struct xrp_queue *queue,
 			   enum xrp_status *status);
 void xrp_impl_release_queue(struct xrp_queue *queue);
+int xrp_impl_run_command_inline(struct xrp_queue *queue,
+				const void *in_data, size_t in_data_size,
+				void *out_data, size_t out_data_size,
+				struct xrp_buffer_group *buffer_group,
+				enum xrp_status *status);
 
 void xrp_impl_create_report(struct xrp_device *device,
 				struct xrp_report *report,
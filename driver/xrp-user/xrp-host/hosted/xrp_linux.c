@@ -26,11 +26,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include "xrp_types.h"
 #include "xrp_host_common.h"
@@ -38,14 +44,33 @@
 #include "xrp_kernel_defs.h"
 #include "xrp_report.h"
 #include "dsp_common.h"
+
+#define XRP_REQUEST_INLINE_BUFFERS	4
+#define XRP_REQUEST_POOL_MAX		64
+/*
+ * Default number of threads draining all queues of a device, may be
+ * overridden with XRP_QUEUE_THREADS or xrp_device_set_queue_threads.
+ */
+#define XRP_DEVICE_WORKERS_DEFAULT	4
+
 struct xrp_request {
 	struct xrp_queue_item q;
+	struct xrp_request *next_free;
+	/* in flight XRP_IOCTL_QUEUE_ASYNC command, or reaped ring command */
+	struct xrp_request *async_next;
+	int cq_status;
+	struct xrp_queue *queue;
+	uint64_t seq;
 	void *in_data;
 	void *out_data;
 	size_t in_data_size;
 	size_t out_data_size;
 	struct xrp_buffer_group *buffer_group;
 	struct xrp_event *event;
+	char in_data_inline[XRP_REQUEST_INLINE_DATA_SIZE];
+	/* buffer descriptors of a ring command, read by the driver later */
+	struct xrp_ioctl_buffer *ioctl_buffer;
+	struct xrp_ioctl_buffer ioctl_buffer_inline[XRP_REQUEST_INLINE_BUFFERS];
 };
 
 /* Device API. */
@@ -54,6 +79,7 @@ struct xrp_device *xrp_open_device(int idx, enum xrp_status *status)
 {
 	struct xrp_device *device;
 	char name[sizeof("/dev/xvp") + sizeof(int) * 4];
+	const char *env;
 	int fd;
 
 	sprintf(name, "/dev/xvp%u", idx);
@@ -68,13 +94,117 @@ struct xrp_device *xrp_open_device(int idx, enum xrp_status *status)
 		return NULL;
 	}
 	device->impl.fd = fd;
+	device->impl.no_batch = 0;
+	device->impl.no_async = 0;
+	device->impl.sync_inline = 1;
+	env = getenv("XRP_QUEUE_SYNC_INLINE");
+	if (env)
+		device->impl.sync_inline = strtoul(env, NULL, 0) != 0;
+	xrp_mutex_init(&device->impl.async_lock);
+	xrp_mutex_init(&device->impl.async_read_lock);
+	device->impl.async_head = NULL;
+	device->impl.async_tail = NULL;
+	device->impl.ring = NULL;
+	xrp_mutex_init(&device->impl.ring_sq_lock);
+	xrp_mutex_init(&device->impl.ring_cq_lock);
+	xrp_mutex_init(&device->impl.completion_lock);
+	device->impl.completion_started = 0;
+	device->impl.completion_exit_flag = NULL;
+	xrp_mutex_init(&device->impl.pool_lock);
+	device->impl.pool = NULL;
+	device->impl.n_workers = XRP_DEVICE_WORKERS_DEFAULT;
+	env = getenv("XRP_QUEUE_THREADS");
+	if (env)
+		device->impl.n_workers = strtoul(env, NULL, 0);
+	device->impl.sched.policy = SCHED_FIFO;
+	env = getenv("XRP_QUEUE_POLICY");
+	if (env && !strcasecmp(env, "rr"))
+		device->impl.sched.policy = SCHED_RR;
+	else if (env && !strcasecmp(env, "other"))
+		device->impl.sched.policy = SCHED_OTHER;
+	device->impl.sched.cpu_mask = 0;
+	env = getenv("XRP_QUEUE_CPUS");
+	if (env)
+		device->impl.sched.cpu_mask = strtoul(env, NULL, 0);
 	set_status(status, XRP_STATUS_SUCCESS);
 	return device;
 }
 
 void xrp_impl_release_device(struct xrp_device *device)
 {
+	struct xrp_device_impl *impl = &device->impl;
+	uint64_t v = 1;
+
+	if (impl->completion_started) {
+		if (xrp_thread_is_self(&impl->completion_thread)) {
+			*impl->completion_exit_flag = 1;
+			xrp_thread_detach(&impl->completion_thread);
+		} else {
+			if (write(impl->completion_exit_fd, &v, sizeof(v)) != sizeof(v))
+				DSP_PRINT(WARNING,"completion thread wake fail\n");
+			xrp_thread_join(&impl->completion_thread);
+		}
+		close(impl->completion_exit_fd);
+	}
+	xrp_mutex_destroy(&impl->completion_lock);
+	if (device->impl.ring)
+		munmap(device->impl.ring, device->impl.ring_size);
 	close(device->impl.fd);
+	xrp_mutex_destroy(&device->impl.async_lock);
+	xrp_mutex_destroy(&device->impl.async_read_lock);
+	xrp_mutex_destroy(&device->impl.ring_sq_lock);
+	xrp_mutex_destroy(&device->impl.ring_cq_lock);
+	if (device->impl.pool)
+		xrp_worker_pool_release(device->impl.pool);
+	xrp_mutex_destroy(&device->impl.pool_lock);
+}
+
+void xrp_device_set_queue_sched(struct xrp_device *device,
+				int policy, unsigned long cpu_mask,
+				enum xrp_status *status)
+{
+	if (policy != SCHED_FIFO && policy != SCHED_RR &&
+	    policy != SCHED_OTHER) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	xrp_mutex_lock(&device->impl.pool_lock);
+	if (device->impl.pool) {
+		xrp_mutex_unlock(&device->impl.pool_lock);
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	device->impl.sched.policy = policy;
+	device->impl.sched.cpu_mask = cpu_mask;
+	xrp_mutex_unlock(&device->impl.pool_lock);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+void xrp_device_set_queue_threads(struct xrp_device *device,
+				  size_t n_threads,
+				  enum xrp_status *status)
+{
+	xrp_mutex_lock(&device->impl.pool_lock);
+	if (device->impl.pool) {
+		xrp_mutex_unlock(&device->impl.pool_lock);
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	device->impl.n_workers = n_threads;
+	xrp_mutex_unlock(&device->impl.pool_lock);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+void xrp_device_set_sync_inline(struct xrp_device *device, int enable,
+				enum xrp_status *status)
+{
+	device->impl.sync_inline = enable;
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+int xrp_device_get_fd(struct xrp_device *device)
+{
+	return device->impl.fd;
 }
 
 
@@ -115,8 +245,147 @@ void xrp_impl_release_device_buffer(struct xrp_buffer *buffer)
 	xrp_release_device(buffer->device);
 }
 
+void xrp_register_buffers(struct xrp_device *device,
+			  struct xrp_buffer **buffer, size_t n_buffers,
+			  enum xrp_status *status)
+{
+	struct xrp_ioctl_buffer ioctl_buffer[n_buffers ? n_buffers : 1];
+	uint32_t handle[n_buffers ? n_buffers : 1];
+	struct xrp_ioctl_register_buffers ioctl_register = {
+		.n_buffers = n_buffers,
+		.buffer_addr = (uintptr_t)ioctl_buffer,
+		.handle_addr = (uintptr_t)handle,
+	};
+	size_t i;
+
+	for (i = 0; i < n_buffers; ++i) {
+		if (buffer[i]->impl.handle) {
+			set_status(status, XRP_STATUS_FAILURE);
+			return;
+		}
+		ioctl_buffer[i] = (struct xrp_ioctl_buffer){
+			.flags = XRP_FLAG_READ_WRITE,
+			.size = buffer[i]->size,
+			.addr = (uintptr_t)buffer[i]->ptr,
+		};
+	}
+	if (!n_buffers ||
+	    ioctl(device->impl.fd, XRP_IOCTL_BUFFER_REGISTER,
+		  &ioctl_register) < 0) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	for (i = 0; i < n_buffers; ++i) {
+		xrp_retain_device(device);
+		buffer[i]->impl.device = device;
+		buffer[i]->impl.handle = handle[i];
+	}
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+void xrp_impl_unregister_buffer(struct xrp_buffer *buffer)
+{
+	struct xrp_device *device = buffer->impl.device;
+	struct xrp_ioctl_register_buffers ioctl_register = {
+		.n_buffers = 1,
+		.handle_addr = (uintptr_t)&buffer->impl.handle,
+	};
+
+	if (!buffer->impl.handle)
+		return;
+	ioctl(device->impl.fd, XRP_IOCTL_BUFFER_UNREGISTER, &ioctl_register);
+	buffer->impl.handle = 0;
+	buffer->impl.device = NULL;
+	xrp_release_device(device);
+}
+
+void xrp_unregister_buffer(struct xrp_buffer *buffer,
+			   enum xrp_status *status)
+{
+	if (!buffer->impl.handle) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	xrp_impl_unregister_buffer(buffer);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+/* Registered buffers are passed by handle, others by address */
+static void xrp_fill_ioctl_buffer(struct xrp_queue *queue,
+				  const struct xrp_buffer_group_record *record,
+				  struct xrp_ioctl_buffer *ioctl_buffer)
+{
+	struct xrp_buffer *buffer = record->buffer;
+
+	if (buffer->impl.handle && buffer->impl.device == queue->device)
+		*ioctl_buffer = (struct xrp_ioctl_buffer){
+			.flags = record->access_flags | XRP_FLAG_REGISTERED,
+			.size = buffer->size,
+			.addr = buffer->impl.handle,
+		};
+	else
+		*ioctl_buffer = (struct xrp_ioctl_buffer){
+			.flags = record->access_flags,
+			.size = buffer->size,
+			.addr = (uintptr_t)buffer->ptr,
+		};
+}
+
 /* Queue API. */
 
+static struct xrp_request *xrp_request_alloc(struct xrp_queue *queue,
+					     size_t in_data_size)
+{
+	struct xrp_queue_impl *impl = &queue->impl;
+	struct xrp_request *rq;
+
+	xrp_mutex_lock(&impl->request_pool_lock);
+	rq = impl->request_pool;
+	if (rq) {
+		impl->request_pool = rq->next_free;
+		--impl->n_pooled;
+	}
+	xrp_mutex_unlock(&impl->request_pool_lock);
+
+	if (!rq) {
+		rq = malloc(sizeof(*rq));
+		if (!rq)
+			return NULL;
+	}
+
+	rq->ioctl_buffer = rq->ioctl_buffer_inline;
+	if (in_data_size <= sizeof(rq->in_data_inline)) {
+		rq->in_data = rq->in_data_inline;
+	} else {
+		rq->in_data = malloc(in_data_size);
+		if (!rq->in_data) {
+			free(rq);
+			return NULL;
+		}
+	}
+	return rq;
+}
+
+static void xrp_request_free(struct xrp_queue *queue, struct xrp_request *rq)
+{
+	struct xrp_queue_impl *impl = &queue->impl;
+
+	if (rq->in_data != rq->in_data_inline)
+		free(rq->in_data);
+	if (rq->ioctl_buffer != rq->ioctl_buffer_inline)
+		free(rq->ioctl_buffer);
+
+	xrp_mutex_lock(&impl->request_pool_lock);
+	if (impl->n_pooled < XRP_REQUEST_POOL_MAX) {
+		rq->next_free = impl->request_pool;
+		impl->request_pool = rq;
+		++impl->n_pooled;
+		rq = NULL;
+	}
+	xrp_mutex_unlock(&impl->request_pool_lock);
+	free(rq);
+}
+
 static void _xrp_run_command(struct xrp_queue *queue,
 			     const void *in_data, size_t in_data_size,
 			     void *out_data, size_t out_data_size,
@@ -145,13 +414,9 @@ static void _xrp_run_command(struct xrp_queue *queue,
 		};
 		size_t i;
 
-		for (i = 0; i < n_buffers; ++i) {
-			ioctl_buffer[i] = (struct xrp_ioctl_buffer){
-				.flags = buffer_group->buffer[i].access_flags,
-				.size = buffer_group->buffer[i].buffer->size,
-				.addr = (uintptr_t)buffer_group->buffer[i].buffer->ptr,
-			};
-		}
+		for (i = 0; i < n_buffers; ++i)
+			xrp_fill_ioctl_buffer(queue, buffer_group->buffer + i,
+					      ioctl_buffer + i);
 		if (buffer_group)
 			xrp_mutex_unlock(&buffer_group->mutex);
 
@@ -165,6 +430,61 @@ static void _xrp_run_command(struct xrp_queue *queue,
 		set_status(status, XRP_STATUS_SUCCESS);
 }
 
+static void xrp_queue_signal(struct xrp_queue *queue)
+{
+	int efd = atomic_load_explicit(&queue->impl.efd, memory_order_acquire);
+
+	if (efd >= 0)
+		eventfd_write(efd, 1);
+}
+
+int xrp_queue_get_fd(struct xrp_queue *queue, enum xrp_status *status)
+{
+	int efd = atomic_load(&queue->impl.efd);
+
+	if (efd < 0) {
+		int expected = -1;
+
+		efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (efd < 0) {
+			set_status(status, XRP_STATUS_FAILURE);
+			return -1;
+		}
+		if (!atomic_compare_exchange_strong(&queue->impl.efd,
+						    &expected, efd)) {
+			close(efd);
+			efd = expected;
+		}
+	}
+	set_status(status, XRP_STATUS_SUCCESS);
+	return efd;
+}
+
+static void xrp_request_complete(struct xrp_queue *queue,
+				 struct xrp_request *rq,
+				 enum xrp_status status)
+{
+	struct xrp_event *event;
+
+	if (rq->buffer_group)
+		xrp_release_buffer_group(rq->buffer_group);
+
+	/*
+	 * Recycle the request before signalling: releasing the event may drop
+	 * the last reference to the queue that owns the pool.
+	 */
+	event = rq->event;
+	xrp_request_free(queue, rq);
+
+	if (event) {
+		xrp_impl_broadcast_event(event, status);
+		xrp_queue_signal(queue);
+		xrp_release_event(event);
+	} else {
+		xrp_queue_signal(queue);
+	}
+}
+
 static void xrp_request_process(struct xrp_queue_item *q,
 				void *context)
 {
@@ -176,56 +496,227 @@ static void xrp_request_process(struct xrp_queue_item *q,
 			 rq->out_data, rq->out_data_size,
 			 rq->buffer_group,
 			 &status);
+	xrp_request_complete(context, rq, status);
+}
 
-	if (rq->buffer_group)
-		xrp_release_buffer_group(rq->buffer_group);
+static size_t xrp_request_n_buffers(struct xrp_request *rq)
+{
+	size_t n_buffers = 0;
 
-	if (rq->event) {
-		xrp_impl_broadcast_event(rq->event, status);
-		xrp_release_event(rq->event);
+	if (rq->buffer_group) {
+		xrp_mutex_lock(&rq->buffer_group->mutex);
+		n_buffers = rq->buffer_group->n_buffers;
+		xrp_mutex_unlock(&rq->buffer_group->mutex);
+	}
+	return n_buffers;
+}
+
+static void xrp_request_fill_ioctl(struct xrp_queue *queue,
+				   struct xrp_request *rq,
+				   size_t n_buffers,
+				   struct xrp_ioctl_buffer *ioctl_buffer,
+				   struct xrp_ioctl_queue *ioctl_queue)
+{
+	struct xrp_buffer_group *buffer_group = rq->buffer_group;
+	size_t i;
+
+	*ioctl_queue = (struct xrp_ioctl_queue){
+		.flags = (queue->use_nsid ? XRP_QUEUE_FLAG_NSID : 0) |
+			((queue->priority << XRP_QUEUE_FLAG_PRIO_SHIFT) &
+			 XRP_QUEUE_FLAG_PRIO),
+		.in_data_size = rq->in_data_size,
+		.out_data_size = rq->out_data_size,
+		.buffer_size = n_buffers * sizeof(struct xrp_ioctl_buffer),
+		.in_data_addr = (uintptr_t)rq->in_data,
+		.out_data_addr = (uintptr_t)rq->out_data,
+		.buffer_addr = (uintptr_t)ioctl_buffer,
+		.nsid_addr = (uintptr_t)queue->nsid,
+	};
+
+	if (!n_buffers)
+		return;
+	/* groups only grow, so the first n_buffers entries are still there */
+	xrp_mutex_lock(&buffer_group->mutex);
+	for (i = 0; i < n_buffers; ++i)
+		xrp_fill_ioctl_buffer(queue, buffer_group->buffer + i,
+				      ioctl_buffer + i);
+	xrp_mutex_unlock(&buffer_group->mutex);
+}
+
+/*
+ * Submit up to XRP_QUEUE_BATCH_MAX requests with one XRP_IOCTL_QUEUE_BATCH.
+ * Returns the number of requests completed, the driver leaves the ones it
+ * did not start at XRP_QUEUE_BATCH_NOT_RUN and they are untouched here.
+ */
+static int _xrp_run_batch(struct xrp_queue *queue,
+			  struct xrp_queue_item **q, size_t n)
+{
+	size_t n_buffers[n];
+	size_t total = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		n_buffers[i] = xrp_request_n_buffers((struct xrp_request *)q[i]);
+		total += n_buffers[i];
+	}
+	{
+		struct xrp_ioctl_buffer ioctl_buffer[total ? total : 1];
+		struct xrp_ioctl_queue ioctl_queue[n];
+		__s32 result[n];
+		size_t n_done = 0;
+		struct xrp_ioctl_queue_batch batch = {
+			.n_queues = n,
+			.queue_addr = (uintptr_t)ioctl_queue,
+			.status_addr = (uintptr_t)result,
+		};
+		struct xrp_ioctl_buffer *p = ioctl_buffer;
+		int ret;
+
+		for (i = 0; i < n; ++i) {
+			xrp_request_fill_ioctl(queue, (struct xrp_request *)q[i],
+					       n_buffers[i], p, ioctl_queue + i);
+			p += n_buffers[i];
+			result[i] = XRP_QUEUE_BATCH_NOT_RUN;
+		}
+
+		ret = ioctl(queue->device->impl.fd,
+			    XRP_IOCTL_QUEUE_BATCH, &batch);
+		/*
+		 * Only a driver without the ioctl latches the fallback,
+		 * EINVAL may just be this batch.
+		 */
+		if (ret < 0 && errno == ENOTTY) {
+			DSP_PRINT(INFO,"batched submission is not supported\n");
+			queue->device->impl.no_batch = 1;
+		}
+
+		/* the driver runs them in order and stops at the first it skips */
+		for (i = 0; i < n && result[i] != XRP_QUEUE_BATCH_NOT_RUN; ++i) {
+			xrp_request_complete(queue, (struct xrp_request *)q[i],
+					     result[i] < 0 ? XRP_STATUS_FAILURE :
+					     XRP_STATUS_SUCCESS);
+			++n_done;
+		}
+		return n_done;
+	}
+}
+
+static void xrp_request_batch_process(struct xrp_queue_item **q, size_t n,
+				      void *context)
+{
+	struct xrp_queue *queue = context;
+
+	while (n) {
+		size_t chunk = n < XRP_QUEUE_BATCH_MAX ? n : XRP_QUEUE_BATCH_MAX;
+		size_t i = 0;
+
+		/* whatever the batch did not start goes one by one */
+		if (chunk > 1 && !queue->device->impl.no_batch)
+			i = _xrp_run_batch(queue, q, chunk);
+		for (; i < chunk; ++i)
+			xrp_request_process(q[i], context);
+		q += chunk;
+		n -= chunk;
 	}
-	// printf("%s,get resp with event %p!\n",__func__,rq->event);
-	free(rq->in_data);
-	free(rq);
 }
 
 void xrp_impl_create_queue(struct xrp_queue *queue,
 			   enum xrp_status *status)
 {
-	xrp_queue_init(&queue->impl.queue, queue->priority,
-		       queue, xrp_request_process);
+	struct xrp_device *device = queue->device;
+	struct xrp_worker_pool *pool;
+	struct xrp_thread_sched sched;
+
+	xrp_mutex_init(&queue->impl.request_pool_lock);
+	queue->impl.request_pool = NULL;
+	queue->impl.n_pooled = 0;
+	atomic_init(&queue->impl.efd, -1);
+
+	xrp_mutex_lock(&device->impl.pool_lock);
+	sched = device->impl.sched;
+	/* the pool runs at normal priority, keep prioritized queues apart */
+	if (queue->priority > 0) {
+		pool = NULL;
+	} else {
+		if (!device->impl.pool && device->impl.n_workers) {
+			device->impl.pool =
+				xrp_worker_pool_create(device->impl.n_workers,
+						       0, &sched);
+			/* don't retry for every queue */
+			if (!device->impl.pool)
+				device->impl.n_workers = 0;
+		}
+		pool = device->impl.pool;
+	}
+	xrp_mutex_unlock(&device->impl.pool_lock);
+
+	if (pool)
+		xrp_queue_init_pool(&queue->impl.queue, pool,
+				    queue, xrp_request_batch_process);
+	else
+		xrp_queue_init_sched(&queue->impl.queue, queue->priority,
+				     &sched, queue, xrp_request_batch_process);
 	set_status(status, XRP_STATUS_SUCCESS);
 }
 
 void xrp_impl_release_queue(struct xrp_queue *queue)
 {
+	struct xrp_request *rq;
+
 	xrp_queue_destroy(&queue->impl.queue);
+
+	while ((rq = queue->impl.request_pool)) {
+		queue->impl.request_pool = rq->next_free;
+		free(rq);
+	}
+	queue->impl.n_pooled = 0;
+	xrp_mutex_destroy(&queue->impl.request_pool_lock);
+	if (atomic_load(&queue->impl.efd) >= 0)
+		close(atomic_load(&queue->impl.efd));
+}
+
+/*
+ * Issue a synchronous command straight from the caller's thread, saving
+ * the request copy and the two thread switches through the queue worker.
+ * Only done while the queue is idle, returns 0 if the command has to go
+ * through the queue instead. Ring submissions are ordered by the ring,
+ * so the ioctl can't be mixed with them.
+ */
+int xrp_impl_run_command_inline(struct xrp_queue *queue,
+				const void *in_data, size_t in_data_size,
+				void *out_data, size_t out_data_size,
+				struct xrp_buffer_group *buffer_group,
+				enum xrp_status *status)
+{
+	struct xrp_device_impl *impl = &queue->device->impl;
+
+	if (!impl->sync_inline || impl->ring ||
+	    !xrp_queue_claim(&queue->impl.queue))
+		return 0;
+	_xrp_run_command(queue, in_data, in_data_size,
+			 out_data, out_data_size, buffer_group, status);
+	xrp_queue_unclaim(&queue->impl.queue);
+	xrp_queue_signal(queue);
+	return 1;
 }
 
 /* Communication API */
 
-void xrp_enqueue_command(struct xrp_queue *queue,
-			 const void *in_data, size_t in_data_size,
-			 void *out_data, size_t out_data_size,
-			 struct xrp_buffer_group *buffer_group,
-			 struct xrp_event **evt,
-			 enum xrp_status *status)
+static struct xrp_request *xrp_request_create(struct xrp_queue *queue,
+					      const void *in_data,
+					      size_t in_data_size,
+					      void *out_data,
+					      size_t out_data_size,
+					      struct xrp_buffer_group *buffer_group,
+					      struct xrp_event **evt)
 {
 	struct xrp_request *rq;
-	void *in_data_copy;
-
-	rq = malloc(sizeof(*rq));
-	in_data_copy = malloc(in_data_size);
 
-	if (!rq || (in_data_size && !in_data_copy)) {
-		free(in_data_copy);
-		free(rq);
-		set_status(status, XRP_STATUS_FAILURE);
-		return;
-	}
+	rq = xrp_request_alloc(queue, in_data_size);
+	if (!rq)
+		return NULL;
 
-	memcpy(in_data_copy, in_data, in_data_size);
-	rq->in_data = in_data_copy;
+	memcpy(rq->in_data, in_data, in_data_size);
 	rq->in_data_size = in_data_size;
 	rq->out_data = out_data;
 	rq->out_data_size = out_data_size;
@@ -234,10 +725,8 @@ void xrp_enqueue_command(struct xrp_queue *queue,
 		struct xrp_event *event = xrp_event_create();
 
 		if (!event) {
-			free(rq->in_data);
-			free(rq);
-			set_status(status, XRP_STATUS_FAILURE);
-			return;
+			xrp_request_free(queue, rq);
+			return NULL;
 		}
 		xrp_retain_queue(queue);
 		event->queue = queue;
@@ -251,25 +740,590 @@ void xrp_enqueue_command(struct xrp_queue *queue,
 	if (buffer_group)
 		xrp_retain_buffer_group(buffer_group);
 	rq->buffer_group = buffer_group;
+	return rq;
+}
+
+/* Undo xrp_request_create for a request that was never queued */
+static void xrp_request_abort(struct xrp_queue *queue, struct xrp_request *rq)
+{
+	struct xrp_event *event = rq->event;
+
+	if (rq->buffer_group)
+		xrp_release_buffer_group(rq->buffer_group);
+	xrp_request_free(queue, rq);
+	if (event) {
+		xrp_release_event(event);
+		xrp_release_event(event);
+	}
+}
+
+/* Take a device reference unless the last one is already gone */
+static int xrp_device_tryget(struct xrp_device *device)
+{
+	unsigned long count = atomic_load(&device->ref.count);
+
+	while (count)
+		if (atomic_compare_exchange_weak(&device->ref.count,
+						 &count, count + 1))
+			return 1;
+	return 0;
+}
+
+/*
+ * Completion thread of a device, polls the device fd for async and ring
+ * completions and signals their events.
+ */
+static void *xrp_completion_thread(void *p)
+{
+	struct xrp_device *device = p;
+	struct pollfd fds[2] = {
+		{ .fd = device->impl.fd, .events = POLLRDNORM | POLLRDBAND, },
+		{ .fd = device->impl.completion_exit_fd, .events = POLLIN, },
+	};
+	int exit = 0;
+
+	device->impl.completion_exit_flag = &exit;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			DSP_PRINT(ERROR,"completion poll fail:%d\n", errno);
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		/*
+		 * Completing the last command may drop the last device
+		 * reference, hold one while reaping. If it's already gone
+		 * xrp_impl_release_device is about to join this thread.
+		 */
+		if (!xrp_device_tryget(device))
+			break;
+		xrp_device_process_completions(device, NULL);
+		xrp_release_device(device);
+		if (exit)
+			break;
+	}
+	return NULL;
+}
+
+static void xrp_start_completion_thread(struct xrp_device *device)
+{
+	struct xrp_device_impl *impl = &device->impl;
+
+	if (__atomic_load_n(&impl->completion_started, __ATOMIC_ACQUIRE))
+		return;
+	xrp_mutex_lock(&impl->completion_lock);
+	if (!impl->completion_started) {
+		impl->completion_exit_fd = eventfd(0, EFD_CLOEXEC);
+		if (impl->completion_exit_fd < 0 ||
+		    !xrp_thread_create_sched(&impl->completion_thread, 0,
+					     &impl->sched,
+					     xrp_completion_thread, device)) {
+			DSP_PRINT(ERROR,"completion thread create fail\n");
+			if (impl->completion_exit_fd >= 0)
+				close(impl->completion_exit_fd);
+		} else {
+			__atomic_store_n(&impl->completion_started, 1,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	xrp_mutex_unlock(&impl->completion_lock);
+}
+
+/* Ring API */
+
+void xrp_device_setup_ring(struct xrp_device *device, size_t entries,
+			   int sq_poll, enum xrp_status *status)
+{
+	struct xrp_device_impl *impl = &device->impl;
+	struct xrp_ioctl_ring_setup setup = {
+		.sq_entries = entries,
+		.flags = sq_poll ? XRP_RING_SETUP_SQPOLL : 0,
+	};
+	int ret;
+
+	if (impl->ring) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	ret = ioctl(impl->fd, XRP_IOCTL_RING_SETUP, &setup);
+	if (ret < 0) {
+		DSP_PRINT(INFO,"ring setup fail\n");
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	impl->ring_sqe = (void *)(uintptr_t)(setup.addr + setup.sq_off);
+	impl->ring_cqe = (void *)(uintptr_t)(setup.addr + setup.cq_off);
+	impl->ring_size = setup.size;
+	impl->ring_sq_entries = setup.sq_entries;
+	impl->ring_cq_entries = setup.cq_entries;
+	impl->ring_flags = setup.flags;
+	__atomic_store_n(&impl->ring, (void *)(uintptr_t)setup.addr,
+			 __ATOMIC_RELEASE);
+	xrp_start_completion_thread(device);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+static void xrp_ring_enter(struct xrp_device_impl *impl, uint32_t flags,
+			   uint32_t cq_target)
+{
+	struct xrp_ioctl_ring_enter enter = {
+		.flags = flags,
+		.cq_target = cq_target,
+	};
+
+	while (ioctl(impl->fd, XRP_IOCTL_RING_ENTER, &enter) < 0 &&
+	       errno == EINTR)
+		;
+}
+
+/*
+ * Consume all posted CQEs, appending their commands to *tail in completion
+ * order. They are completed with xrp_ring_complete once no ring lock is
+ * held, notify callbacks may submit again.
+ */
+static size_t xrp_ring_reap_list(struct xrp_device_impl *impl,
+				 struct xrp_request ***tail)
+{
+	struct xrp_ring_header *hdr = impl->ring;
+	uint32_t head, cq_tail;
+	size_t n;
+
+	xrp_mutex_lock(&impl->ring_cq_lock);
+	head = hdr->cq_head;
+	cq_tail = __atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != cq_tail) {
+		struct xrp_ring_cqe *cqe =
+			impl->ring_cqe + (head & (impl->ring_cq_entries - 1));
+		struct xrp_request *rq = (void *)(uintptr_t)cqe->user_data;
+
+		rq->cq_status = cqe->status;
+		rq->async_next = NULL;
+		**tail = rq;
+		*tail = &rq->async_next;
+		++head;
+	}
+	n = head - hdr->cq_head;
+	__atomic_store_n(&hdr->cq_head, head, __ATOMIC_RELEASE);
+	xrp_mutex_unlock(&impl->ring_cq_lock);
+	return n;
+}
+
+static void xrp_ring_complete(struct xrp_request *rq)
+{
+	while (rq) {
+		struct xrp_request *next = rq->async_next;
+		struct xrp_queue *queue = rq->queue;
+
+		xrp_request_complete(queue, rq,
+				     rq->cq_status < 0 ? XRP_STATUS_FAILURE :
+				     XRP_STATUS_SUCCESS);
+		xrp_release_queue(queue);
+		rq = next;
+	}
+}
+
+/* Complete all commands that have a CQE posted */
+static size_t xrp_ring_reap(struct xrp_device_impl *impl)
+{
+	struct xrp_request *done = NULL, **tail = &done;
+	size_t n = xrp_ring_reap_list(impl, &tail);
+
+	xrp_ring_complete(done);
+	return n;
+}
+
+/* Wait until the command behind a ring event is completed */
+static void xrp_ring_wait_ticket(struct xrp_device_impl *impl,
+				 struct xrp_event *event)
+{
+	for (;;) {
+		xrp_ring_reap(impl);
+		if (event->status != XRP_STATUS_PENDING)
+			break;
+		xrp_ring_enter(impl, XRP_RING_ENTER_WAIT,
+			       event->ring_ticket + 1);
+	}
+}
+
+void xrp_impl_ring_wait(struct xrp_event *event)
+{
+	if (event->status == XRP_STATUS_PENDING)
+		xrp_ring_wait_ticket(&event->queue->device->impl, event);
+}
+
+void xrp_impl_ring_wait_any(struct xrp_event **event, size_t n_events)
+{
+	struct xrp_event *first = NULL;
+	size_t i;
+
+	/* CQEs come in submission order, the oldest ring command ends first */
+	for (i = 0; i < n_events; ++i) {
+		if (event[i]->status != XRP_STATUS_PENDING)
+			return;
+		if (event[i]->ring &&
+		    (!first ||
+		     (int32_t)(event[i]->ring_ticket - first->ring_ticket) < 0))
+			first = event[i];
+	}
+	if (first)
+		xrp_ring_wait_ticket(&first->queue->device->impl, first);
+}
+
+static void xrp_ring_submit(struct xrp_queue *queue,
+			    struct xrp_queue_item **item, size_t n)
+{
+	struct xrp_device_impl *impl = &queue->device->impl;
+	struct xrp_ring_header *hdr = impl->ring;
+	struct xrp_request *done = NULL, **done_tail = &done;
+	struct xrp_request *failed = NULL, **failed_tail = &failed;
+	size_t i;
+
+	xrp_mutex_lock(&impl->ring_sq_lock);
+	for (i = 0; i < n; ++i) {
+		struct xrp_request *rq = (struct xrp_request *)item[i];
+		uint32_t tail = hdr->sq_tail;
+		size_t n_buffers = xrp_request_n_buffers(rq);
+		struct xrp_ring_sqe *sqe;
+
+		if (n_buffers > XRP_REQUEST_INLINE_BUFFERS) {
+			rq->ioctl_buffer = malloc(n_buffers *
+						  sizeof(*rq->ioctl_buffer));
+			if (!rq->ioctl_buffer) {
+				rq->ioctl_buffer = rq->ioctl_buffer_inline;
+				rq->async_next = NULL;
+				*failed_tail = rq;
+				failed_tail = &rq->async_next;
+				continue;
+			}
+		}
+
+		/* keep no more than cq_entries in flight, the driver relies on it */
+		for (;;) {
+			uint32_t sq_head = __atomic_load_n(&hdr->sq_head,
+							   __ATOMIC_ACQUIRE);
+			uint32_t cq_head = __atomic_load_n(&hdr->cq_head,
+							   __ATOMIC_ACQUIRE);
+
+			if (tail - sq_head < impl->ring_sq_entries &&
+			    tail - cq_head < impl->ring_cq_entries)
+				break;
+			if (cq_head == __atomic_load_n(&hdr->cq_tail,
+						       __ATOMIC_ACQUIRE))
+				xrp_ring_enter(impl, XRP_RING_ENTER_WAIT,
+					       cq_head + 1);
+			xrp_ring_reap_list(impl, &done_tail);
+		}
+
+		xrp_retain_queue(queue);
+		rq->queue = queue;
+		rq->seq = tail;
+		if (rq->event) {
+			rq->event->ring = 1;
+			rq->event->ring_ticket = tail;
+		}
+
+		sqe = impl->ring_sqe + (tail & (impl->ring_sq_entries - 1));
+		xrp_request_fill_ioctl(queue, rq, n_buffers,
+				       rq->ioctl_buffer, &sqe->queue);
+		sqe->user_data = (uintptr_t)rq;
+		__atomic_store_n(&hdr->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	xrp_mutex_unlock(&impl->ring_sq_lock);
+
+	if (impl->ring_flags & XRP_RING_SETUP_SQPOLL) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&hdr->sq_flags, __ATOMIC_RELAXED) &
+		    XRP_RING_SQ_NEED_WAKEUP)
+			xrp_ring_enter(impl, 0, 0);
+	} else {
+		xrp_ring_enter(impl, 0, 0);
+	}
+
+	xrp_ring_complete(done);
+	while (failed) {
+		struct xrp_request *rq = failed;
+
+		failed = rq->async_next;
+		xrp_request_complete(queue, rq, XRP_STATUS_FAILURE);
+	}
+}
+
+void xrp_enqueue_command(struct xrp_queue *queue,
+			 const void *in_data, size_t in_data_size,
+			 void *out_data, size_t out_data_size,
+			 struct xrp_buffer_group *buffer_group,
+			 struct xrp_event **evt,
+			 enum xrp_status *status)
+{
+	struct xrp_request *rq;
+
+	rq = xrp_request_create(queue, in_data, in_data_size,
+				out_data, out_data_size,
+				buffer_group, evt);
+	if (!rq) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
 
 	set_status(status, XRP_STATUS_SUCCESS);
-	xrp_queue_push(&queue->impl.queue, &rq->q);
+	if (queue->device->impl.ring) {
+		struct xrp_queue_item *item = &rq->q;
+
+		xrp_ring_submit(queue, &item, 1);
+	} else {
+		xrp_queue_push(&queue->impl.queue, &rq->q);
+	}
 }
 
-static struct xrp_report *reporter;
+void xrp_enqueue_commands(struct xrp_queue *queue,
+			  const struct xrp_command *cmd, size_t n_cmds,
+			  struct xrp_event **evt,
+			  enum xrp_status *status)
+{
+	struct xrp_queue_item *item[n_cmds ? n_cmds : 1];
+	size_t i;
+
+	for (i = 0; i < n_cmds; ++i) {
+		struct xrp_request *rq;
+
+		rq = xrp_request_create(queue, cmd[i].in_data,
+					cmd[i].in_data_size,
+					cmd[i].out_data, cmd[i].out_data_size,
+					cmd[i].buffer_group,
+					evt ? evt + i : NULL);
+		if (!rq)
+			break;
+		item[i] = &rq->q;
+	}
 
-void xrp_reporter_sig_handler()
+	if (i < n_cmds) {
+		while (i--)
+			xrp_request_abort(queue, (struct xrp_request *)item[i]);
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+
+	set_status(status, XRP_STATUS_SUCCESS);
+	if (queue->device->impl.ring)
+		xrp_ring_submit(queue, item, n_cmds);
+	else
+		xrp_queue_push_list(&queue->impl.queue, item, n_cmds);
+}
+
+void xrp_submit_command(struct xrp_queue *queue,
+			const void *in_data, size_t in_data_size,
+			void *out_data, size_t out_data_size,
+			struct xrp_buffer_group *buffer_group,
+			struct xrp_event **evt,
+			enum xrp_status *status)
 {
-	// printf("%s\n",__func__);
-	struct xrp_report_buffer *report_buffer;
-	if(!reporter || !reporter->report_buf)
+	struct xrp_device_impl *impl = &queue->device->impl;
+	struct xrp_request *rq;
+	size_t n_buffers;
+	int ret;
+
+	if (impl->no_async) {
+		xrp_enqueue_command(queue, in_data, in_data_size,
+				    out_data, out_data_size,
+				    buffer_group, evt, status);
+		return;
+	}
+
+	/* in_data may be shared with the DSP, so submit the request copy */
+	rq = xrp_request_create(queue, in_data, in_data_size,
+				out_data, out_data_size,
+				buffer_group, evt);
+	if (!rq) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+
+	n_buffers = xrp_request_n_buffers(rq);
 	{
+		struct xrp_ioctl_buffer ioctl_buffer[n_buffers ? n_buffers : 1];
+		struct xrp_ioctl_queue_async ioctl_async;
+
+		xrp_request_fill_ioctl(queue, rq, n_buffers, ioctl_buffer,
+				       &ioctl_async.queue);
+
+		/* keep async_head in the same order as driver sequence numbers */
+		xrp_mutex_lock(&impl->async_lock);
+		ret = ioctl(impl->fd, XRP_IOCTL_QUEUE_ASYNC, &ioctl_async);
+		if (ret == 0) {
+			xrp_retain_queue(queue);
+			rq->queue = queue;
+			rq->seq = ioctl_async.seq;
+			rq->async_next = NULL;
+			if (impl->async_tail)
+				impl->async_tail->async_next = rq;
+			else
+				impl->async_head = rq;
+			impl->async_tail = rq;
+		}
+		xrp_mutex_unlock(&impl->async_lock);
+	}
+
+	if (ret < 0) {
+		int err = errno;
+
+		/* EINVAL is this request, only a driver without the ioctl latches */
+		if (err == ENOTTY) {
+			DSP_PRINT(INFO,"async submission is not supported\n");
+			impl->no_async = 1;
+			set_status(status, XRP_STATUS_SUCCESS);
+			xrp_queue_push(&queue->impl.queue, &rq->q);
+			return;
+		}
+		xrp_request_abort(queue, rq);
+		errno = err;
+		set_status(status, XRP_STATUS_FAILURE);
 		return;
 	}
-	report_buffer = (struct xrp_report_buffer *)reporter->report_buf;
-	// printf("buffer:%lx,id:%d,data:%x,%x,%x,%x\n",report_buffer,report_buffer->report_id,report_buffer->data[0],report_buffer->data[1],report_buffer->data[2],report_buffer->data[3]);
+	xrp_start_completion_thread(queue->device);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
+size_t xrp_device_process_completions(struct xrp_device *device,
+				      enum xrp_status *status)
+{
+	struct xrp_device_impl *impl = &device->impl;
+	struct xrp_ioctl_completion completion[16];
+	size_t n_done = 0;
+
+	if (impl->ring)
+		n_done += xrp_ring_reap(impl);
+
+	/*
+	 * The fd is blocking, so only read once the driver reports async
+	 * completions with POLLRDNORM; ring completions only raise POLLRDBAND.
+	 * Holding async_read_lock keeps another reader from taking them
+	 * between the poll and the read.
+	 */
+	xrp_mutex_lock(&impl->async_read_lock);
+	for (;;) {
+		struct pollfd fds = { .fd = impl->fd, .events = POLLRDNORM, };
+		ssize_t sz;
+		size_t i;
+		int ret;
+
+		ret = poll(&fds, 1, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			xrp_mutex_unlock(&impl->async_read_lock);
+			set_status(status, XRP_STATUS_FAILURE);
+			return n_done;
+		}
+		if (!(fds.revents & POLLRDNORM))
+			break;
+
+		sz = read(impl->fd, completion, sizeof(completion));
+		if (sz < 0 && errno == EINTR)
+			continue;
+		if (sz <= 0) {
+			if (sz < 0) {
+				xrp_mutex_unlock(&impl->async_read_lock);
+				set_status(status, XRP_STATUS_FAILURE);
+				return n_done;
+			}
+			break;
+		}
+
+		for (i = 0; i < sz / sizeof(*completion); ++i) {
+			struct xrp_request *rq;
+			struct xrp_queue *queue;
+
+			xrp_mutex_lock(&impl->async_lock);
+			rq = impl->async_head;
+			if (rq && rq->seq == completion[i].seq) {
+				impl->async_head = rq->async_next;
+				if (!impl->async_head)
+					impl->async_tail = NULL;
+			} else {
+				rq = NULL;
+			}
+			xrp_mutex_unlock(&impl->async_lock);
+
+			if (!rq) {
+				DSP_PRINT(WARNING,"unexpected completion %llu\n",
+					  (unsigned long long)completion[i].seq);
+				continue;
+			}
+			queue = rq->queue;
+			xrp_request_complete(queue, rq,
+					     completion[i].status < 0 ?
+					     XRP_STATUS_FAILURE :
+					     XRP_STATUS_SUCCESS);
+			xrp_release_queue(queue);
+			++n_done;
+		}
+	}
+	xrp_mutex_unlock(&impl->async_read_lock);
+	set_status(status, XRP_STATUS_SUCCESS);
+	return n_done;
+}
+
+/*
+ * Run the handlers of every report queued in the ring. Entries are only
+ * handed back to the driver once their handler has returned.
+ */
+static void xrp_report_drain(struct xrp_report *report)
+{
+	struct xrp_report_ring *ring = report->report_buf;
+	uint32_t head, tail, dropped;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (; tail != head; ++tail) {
+		struct xrp_report_buffer *report_buffer =
+			(void *)((char *)ring + ring->entry_offset +
+				 (tail & ring->mask) * ring->entry_size);
 
-	xrp_process_report(&reporter->list,report_buffer->data,report_buffer->report_id);
+		xrp_process_report(&report->list,report_buffer->data,report_buffer->report_id);
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != report->dropped) {
+		DSP_PRINT(WARNING,"%u reports dropped, report ring full\n",
+			  dropped - report->dropped);
+		report->dropped = dropped;
+	}
+}
+
+/*
+ * Report dispatcher thread, one per reporter. The driver flags queued
+ * reports with POLLPRI on the device fd, exit_fd stops the thread.
+ */
+static void *xrp_report_thread(void *p)
+{
+	struct xrp_report *report = p;
+	struct pollfd fds[2] = {
+		{ .fd = report->device->impl.fd, .events = POLLPRI, },
+		{ .fd = report->exit_fd, .events = POLLIN, },
+	};
+
+	for (;;) {
+		xrp_report_drain(report);
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+			DSP_PRINT(ERROR,"report poll fail:%d\n", errno);
+			break;
+		}
+		if (fds[1].revents)
+			break;
+	}
+	return NULL;
+}
+
+size_t xrp_reporter_dropped(struct xrp_report *report)
+{
+	struct xrp_report_ring *ring;
+
+	if (!report || !report->report_buf)
+		return 0;
+	ring = report->report_buf;
+	return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
 }
 
 
@@ -294,15 +1348,9 @@ int xrp_add_report_item_with_id(struct xrp_report *report,
 		// set_status(status, XRP_STATUS_FAILURE);
 		return -1;
 	}
-	char *report_buf = malloc(data_size);
-	if(!report_buf)
-	{
-		// set_status(status, XRP_STATUS_FAILURE);
-		return -1;
-	}
 	struct xrp_report_item new_item={
 	     .report_id = report_id,
-		 .buf = report_buf,
+		 .buf = NULL,
 		 .size = data_size,
 		 .context = context,
 		 .fn = cb,
@@ -311,7 +1359,6 @@ int xrp_add_report_item_with_id(struct xrp_report *report,
 	DSP_PRINT(DEBUG,"add report id:%d\n", report_id);
 	if(xrp_add_report(&report->list,&new_item))
 	{
-		free(report_buf);
 		return -1;
 	}
 	DSP_PRINT(INFO,"the report item: %d is added sucessfully\n",report_id);
@@ -337,10 +1384,8 @@ int xrp_add_report_item(struct xrp_report *report,
 
 void xrp_remove_report_item(struct xrp_report *report,int report_id)
 {
-	int id;
-	struct xrp_report_item* item=xrp_get_report_entry(&report->list,report_id);
-	free(item->buf);
-	xrp_remove_report(&report->list,report_id);
+	xrp_remove_report(&report->list,report_id,
+			  !xrp_thread_is_self(&report->thread));
 }
 
 void xrp_impl_create_report(struct xrp_device *device,
@@ -358,14 +1403,18 @@ void xrp_impl_create_report(struct xrp_device *device,
 	struct xrp_ioctl_alloc ioctl_alloc = {
 		.addr = (uintptr_t)NULL,
 		.size = size,
+		.align = report->depth,
 	};
+	const char *env = getenv("XRP_REPORT_DEPTH");
 	int ret;
 
-	xrp_retain_device(device);
-	report->device = device;
-	ret = ioctl(report->device->impl.fd, XRP_IOCTL_REPORT_CREATE, &ioctl_alloc);
+	if (!ioctl_alloc.align && env)
+		ioctl_alloc.align = strtoul(env, NULL, 0);
+	ret = ioctl(device->impl.fd, XRP_IOCTL_REPORT_CREATE, &ioctl_alloc);
 	if (ret < 0) {
 		// free(report_buf);
+		/* EBUSY: the device has a reporter already */
+		DSP_PRINT(WARNING,"report create fail:%d\n", errno);
 		set_status(status, XRP_STATUS_FAILURE);
 		return;
 	}
@@ -375,15 +1424,27 @@ void xrp_impl_create_report(struct xrp_device *device,
         set_status(status, XRP_STATUS_FAILURE);
         return ;
 	}
+	/* the reporter holds the device until xrp_impl_release_report */
+	xrp_retain_device(device);
+	report->device = device;
 	report->report_buf = (void *)(uintptr_t)ioctl_alloc.addr;
 	// printf("buf:%lx,report:x\n",ioctl_alloc.addr,report);
 	report->buf_size = size;
-	report->list.queue.head=NULL;
-	reporter=report;
-	signal(SIGIO, xrp_reporter_sig_handler); /* sigaction() is better */
-	fcntl(report->device->impl.fd, F_SETOWN, getpid());
-	int oflags = fcntl(report->device->impl.fd, F_GETFL);
-	fcntl(report->device->impl.fd, F_SETFL, oflags | FASYNC);
+	report->dropped = 0;
+	xrp_report_list_init(&report->list);
+	report->exit_fd = eventfd(0, EFD_CLOEXEC);
+	if (report->exit_fd < 0 ||
+	    !xrp_thread_create_sched(&report->thread, 0, &device->impl.sched,
+				     xrp_report_thread, report)) {
+		DSP_PRINT(ERROR,"report dispatcher create fail\n");
+		if (report->exit_fd >= 0)
+			close(report->exit_fd);
+		xrp_report_list_destroy(&report->list);
+		ioctl(report->device->impl.fd, XRP_IOCTL_REPORT_RELEASE, &ioctl_alloc);
+		xrp_release_device(device);
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
 	set_status(status, XRP_STATUS_SUCCESS);
 	DSP_PRINT(INFO,"buf:%lx,user space report create\n",ioctl_alloc.addr);
 }
@@ -394,7 +1455,15 @@ void xrp_impl_release_report(struct xrp_device *device,
 		.addr = (uintptr_t)report->report_buf,
 		.size = report->buf_size,
 	};
-	int ret = ioctl(report->device->impl.fd, XRP_IOCTL_REPORT_RELEASE, &ioctl_alloc);
+	uint64_t v = 1;
+	int ret;
+
+	if (write(report->exit_fd, &v, sizeof(v)) != sizeof(v))
+		DSP_PRINT(WARNING,"report dispatcher wake fail\n");
+	xrp_thread_join(&report->thread);
+	close(report->exit_fd);
+	xrp_report_list_destroy(&report->list);
+	ret = ioctl(report->device->impl.fd, XRP_IOCTL_REPORT_RELEASE, &ioctl_alloc);
 	if (ret < 0) {
 		// free(report_buf);
 		set_status(status, XRP_STATUS_FAILURE);
@@ -418,7 +1487,9 @@ void xrp_import_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags
             return;
         }
         dma_buf.fd = fd;
-        dma_buf.flags = flag;
+        dma_buf.flags = (flag & XRP_FLAG_READ_WRITE) |
+                        ((flag & XRP_NO_CPU_MAP) ? XRP_FLAG_DMABUF_NO_MAP : 0) |
+                        ((flag & XRP_SG_LIST) ? XRP_FLAG_DMABUF_SG : 0);
         int ret = ioctl(device->impl.fd, XRP_IOCTL_DMABUF_IMPORT,&dma_buf);
 
         if (ret < 0) {
@@ -457,7 +1528,7 @@ void xrp_release_dma_buf(struct xrp_device *device, int fd,enum xrp_status *stat
 
 void xrp_flush_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags flag,enum xrp_status *status)
 {
-        struct xrp_dma_buf dma_buf;
+        struct xrp_dma_buf dma_buf = {0};
         dma_buf.fd = fd;
         dma_buf.flags = flag;
         if(fd < 0)
@@ -475,4 +1546,30 @@ void xrp_flush_dma_buf(struct xrp_device *device, int fd,enum xrp_access_flags f
         {
             set_status(status, XRP_STATUS_SUCCESS);
 	    }
+}
+
+void xrp_sync_dma_buf(struct xrp_device *device, int fd, enum xrp_access_flags flag,
+		      int to_device, size_t offset, size_t size,
+		      enum xrp_status *status)
+{
+	struct xrp_dma_buf dma_buf = {
+		.fd = fd,
+		.flags = (flag & XRP_FLAG_READ_WRITE) |
+			(to_device ? XRP_FLAG_DMABUF_SYNC_FOR_DEVICE :
+				     XRP_FLAG_DMABUF_SYNC_FOR_CPU),
+	};
+
+	if (fd < 0 || !(flag & XRP_FLAG_READ_WRITE) || size > UINT32_MAX) {
+		set_status(status, XRP_STATUS_FAILURE);
+		return;
+	}
+	if (size) {
+		dma_buf.flags |= XRP_FLAG_DMABUF_SYNC_RANGE;
+		dma_buf.addr = offset;
+		dma_buf.size = size;
+	}
+	if (ioctl(device->impl.fd, XRP_IOCTL_DMABUF_SYNC, &dma_buf) < 0)
+		set_status(status, XRP_STATUS_FAILURE);
+	else
+		set_status(status, XRP_STATUS_SUCCESS);
 }
\ No newline at end of file
@@ -24,7 +24,17 @@
 #ifndef _XRP_THREAD_PTHREAD_IMPL_H
 #define _XRP_THREAD_PTHREAD_IMPL_H
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* linux/futex.h clashes with the __u64 typedef from xrp_types.h */
+#ifndef FUTEX_WAIT_PRIVATE
+#define FUTEX_WAIT_PRIVATE	(0 | 128)
+#define FUTEX_WAKE_PRIVATE	(1 | 128)
+#endif
 
 typedef pthread_t xrp_thread;
 typedef pthread_mutex_t xrp_mutex;
@@ -75,6 +85,11 @@ static inline void xrp_cond_broadcast(xrp_cond *p)
 	pthread_cond_broadcast(&p->cond);
 }
 
+static inline void xrp_cond_signal(xrp_cond *p)
+{
+	pthread_cond_signal(&p->cond);
+}
+
 static inline void xrp_cond_wait(xrp_cond *p)
 {
 	pthread_cond_wait(&p->cond, &p->mutex);
@@ -86,12 +101,75 @@ static inline void xrp_cond_destroy(xrp_cond *p)
 	pthread_cond_destroy(&p->cond);
 }
 
+/*
+ * Scheduling of queue threads. Threads with priority > 0 run with the
+ * real-time policy at that many steps above its minimal priority,
+ * priority 0 threads stay SCHED_OTHER. cpu_mask == 0 means any CPU,
+ * the mask is only applied where _GNU_SOURCE is defined.
+ */
+struct xrp_thread_sched {
+	int policy;
+	unsigned long cpu_mask;
+};
+
+static inline int xrp_thread_attr_init(pthread_attr_t *attr, int priority,
+				       const struct xrp_thread_sched *sched)
+{
+	int policy = sched ? sched->policy : SCHED_FIFO;
+	struct sched_param param;
+	int min, max;
+
+	pthread_attr_init(attr);
+#ifdef CPU_SET
+	if (sched && sched->cpu_mask) {
+		cpu_set_t cpus;
+		unsigned i;
+
+		CPU_ZERO(&cpus);
+		for (i = 0; i < sizeof(sched->cpu_mask) * 8; ++i)
+			if (sched->cpu_mask & (1ul << i))
+				CPU_SET(i, &cpus);
+		pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	}
+#endif
+	if (priority <= 0 || policy == SCHED_OTHER)
+		return 0;
+
+	min = sched_get_priority_min(policy);
+	max = sched_get_priority_max(policy);
+	if (min < 0 || max < 0)
+		return 0;
+	param.sched_priority = min + priority > max ? max : min + priority;
+	pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(attr, policy);
+	pthread_attr_setschedparam(attr, &param);
+	return 1;
+}
+
+static inline int xrp_thread_create_sched(xrp_thread *thread, int priority,
+					  const struct xrp_thread_sched *sched,
+					  void *(*thread_func)(void *),
+					  void *p)
+{
+	pthread_attr_t attr;
+	int rt = xrp_thread_attr_init(&attr, priority, sched);
+	int ret = pthread_create(thread, &attr, thread_func, p);
+
+	pthread_attr_destroy(&attr);
+	if (ret == EPERM && rt) {
+		/* no CAP_SYS_NICE / RLIMIT_RTPRIO, run it as a normal thread */
+		xrp_thread_attr_init(&attr, 0, sched);
+		ret = pthread_create(thread, &attr, thread_func, p);
+		pthread_attr_destroy(&attr);
+	}
+	return ret == 0;
+}
+
 static inline int xrp_thread_create(xrp_thread *thread, int priority,
 				    void *(*thread_func)(void *),
 				    void *p)
 {
-	(void)priority;
-	return pthread_create(thread, NULL, thread_func, p) == 0;
+	return xrp_thread_create_sched(thread, priority, NULL, thread_func, p);
 }
 
 static inline int xrp_thread_join(xrp_thread *thread)
@@ -104,4 +182,22 @@ static inline int xrp_thread_detach(xrp_thread *thread)
 	return pthread_detach(*thread) == 0;
 }
 
+static inline int xrp_thread_is_self(xrp_thread *thread)
+{
+	return pthread_equal(*thread, pthread_self());
+}
+
+/* Sleep while *addr == val. Spurious wakeups are possible. */
+static inline void xrp_futex_wait(_Atomic int *addr, int val)
+{
+	syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, val,
+		NULL, NULL, 0);
+}
+
+static inline void xrp_futex_wake(_Atomic int *addr, int n)
+{
+	syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, n,
+		NULL, NULL, 0);
+}
+
 #endif
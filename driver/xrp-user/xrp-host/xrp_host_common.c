@@ -97,6 +97,7 @@ void xrp_release_buffer(struct xrp_buffer *buffer)
 	DSP_PRINT(DEBUG,"ref:%d\n",buffer->ref.count);
     if (last_release_refcounted(buffer)) {
         // printf("%s,ref:%d\n",__FUNCTION__,buffer->ref.count);
+		xrp_impl_unregister_buffer(buffer);
 		if (buffer->type == XRP_BUFFER_TYPE_DEVICE)
 			xrp_impl_release_device_buffer(buffer);
 		free(buffer);
@@ -413,6 +414,10 @@ void xrp_run_command_sync(struct xrp_queue *queue,
 	struct xrp_event *evt;
 	enum xrp_status s;
 
+	if (xrp_impl_run_command_inline(queue, in_data, in_data_size,
+					out_data, out_data_size,
+					buffer_group, status))
+		return;
 	xrp_enqueue_command(queue, in_data, in_data_size,
 			    out_data, out_data_size,
 			    buffer_group, &evt, &s);
@@ -425,8 +430,13 @@ void xrp_run_command_sync(struct xrp_queue *queue,
 	xrp_release_event(evt);
 }
 
-/*reproter 机制的buffer 需要从用户态去allocated 通知DSP ，并且需要pingpong*/
 struct xrp_report *xrp_create_reporter(struct xrp_device *device,size_t size)
+{
+	return xrp_create_reporter_ring(device, size, 0);
+}
+
+struct xrp_report *xrp_create_reporter_ring(struct xrp_device *device,
+					    size_t size, size_t depth)
 {
 	struct xrp_report *report;
  	enum xrp_status status;
@@ -438,6 +448,7 @@ struct xrp_report *xrp_create_reporter(struct xrp_device *device,size_t size)
 		return NULL;
 	}
 
+	report->depth = depth;
 	xrp_impl_create_report(device,report,size,&status);
 	if(XRP_STATUS_FAILURE ==status)
 	{
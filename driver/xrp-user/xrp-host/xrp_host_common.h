@@ -89,6 +89,12 @@ struct xrp_event {
 	struct xrp_event_impl impl;
 	struct xrp_event *group;
 	struct xrp_event_link *link;
+	/* command was submitted through the device rings */
+	int ring;
+	uint32_t ring_ticket;
+	/* completion callback set by xrp_event_set_notify */
+	void (*notify)(struct xrp_event *event, void *context);
+	void *notify_context;
 };
 
 struct xrp_report{
@@ -101,6 +107,13 @@ struct xrp_report{
 
 	int  buf_size;
 
+	/* requested ring depth, 0 for the default */
+	size_t depth;
+	/* ring drop count already reported */
+	uint32_t dropped;
+	/* dispatcher thread running the report handlers */
+	xrp_thread thread;
+	int exit_fd;
 };
 
 /* Helpers */
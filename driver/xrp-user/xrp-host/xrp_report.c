@@ -13,15 +13,42 @@
 
 
 
-// void xrp_reporter_init(struct xrp_report_list *list)
-// {
+static struct xrp_report_entry **xrp_report_bucket(struct xrp_report_list *list,int id)
+{
+	return &list->bucket[((unsigned int)id * 2654435761u) >> 26 &
+			     (XRP_REPORT_HASH_SIZE - 1)];
+}
+
+void xrp_report_list_init(struct xrp_report_list *list)
+{
+	memset(list->bucket, 0, sizeof(list->bucket));
+	list->current = NULL;
+	xrp_cond_init(&list->cond);
+}
 
-//    	g_list=list;
-// 	g_list->queue.head=NULL;
-// }
+void xrp_report_list_destroy(struct xrp_report_list *list)
+{
+	size_t i;
+
+	for (i = 0; i < XRP_REPORT_HASH_SIZE; ++i) {
+		struct xrp_report_entry *cur_entry = list->bucket[i];
+
+		while (cur_entry) {
+			struct xrp_report_entry *next = cur_entry->next;
+
+			free(((struct xrp_report_item *)cur_entry)->buf);
+			free(cur_entry);
+			cur_entry = next;
+		}
+		list->bucket[i] = NULL;
+	}
+	xrp_cond_destroy(&list->cond);
+}
+
+/* Called with list->cond locked */
 struct xrp_report_item* xrp_get_report_entry(struct xrp_report_list *list,int id)
 {
-	struct xrp_report_entry *cur_entry=list->queue.head;
+	struct xrp_report_entry *cur_entry=*xrp_report_bucket(list,id);
 	for(;cur_entry!=NULL;cur_entry=cur_entry->next)
 	{
 		if(((struct xrp_report_item *)cur_entry)->report_id == id)
@@ -33,30 +60,41 @@ struct xrp_report_item* xrp_get_report_entry(struct xrp_report_list *list,int id
 	return NULL;
 }
 
+/*
+ * data stays valid until the callback returns, it is handed to the
+ * callback directly instead of being copied.
+ */
 void xrp_process_report(struct xrp_report_list *list,void* data,unsigned int id)
 {
-	struct xrp_report_item* report_item= xrp_get_report_entry(list,id);
+	struct xrp_report_item* report_item;
+
+	xrp_cond_lock(&list->cond);
+	report_item = xrp_get_report_entry(list,id);
 	if(!report_item)
 	{
+		xrp_cond_unlock(&list->cond);
 		DSP_PRINT(WARNING,"No valid report item by id (%d)\n",id);
 		return;
 	}
-	if(!report_item->fn ||
-		(report_item->size&&!report_item->buf)){
+	if(!report_item->fn){
+		xrp_cond_unlock(&list->cond);
 		return;
 	}
-	memcpy(report_item->buf,data,report_item->size);
-    int *ptr=report_item->buf;
-  
-	report_item->fn(report_item->context,report_item->buf);
+	list->current = report_item;
+	xrp_cond_unlock(&list->cond);
+
+	report_item->fn(report_item->context,data);
+
+	xrp_cond_lock(&list->cond);
+	list->current = NULL;
+	xrp_cond_broadcast(&list->cond);
+	xrp_cond_unlock(&list->cond);
 }
 
 int xrp_add_report(struct xrp_report_list *list,
 					struct xrp_report_item *item)
 {
-	// xrp_cond_lock(&queue->request_queue_cond);
-	struct xrp_report_entry *entry_head=list->queue.head;
-    struct xrp_report_entry *entry_cur=NULL;
+	struct xrp_report_entry **bucket;
 	struct xrp_report_item *new_item;
 
 	new_item = malloc(sizeof(struct xrp_report_item));
@@ -65,75 +103,72 @@ int xrp_add_report(struct xrp_report_list *list,
 		return -1;
 	}
 	memcpy(new_item,item,sizeof(struct xrp_report_item));
-	new_item->entry.next=NULL;
-	if(NULL==entry_head)
-	{
-		list->queue.head= &new_item->entry;
-		return 0;
-	}
-	for(;entry_head!=NULL;entry_head=entry_head->next)
-	{	
-        entry_cur = entry_head;
-		if(((struct xrp_report_item *)entry_head)->report_id == new_item->report_id)
-		{
-			DSP_PRINT(WARNING,"the report is already exist\n");
-			return -1;
-		}
 
+	xrp_cond_lock(&list->cond);
+	if(xrp_get_report_entry(list,new_item->report_id))
+	{
+		xrp_cond_unlock(&list->cond);
+		DSP_PRINT(WARNING,"the report is already exist\n");
+		free(new_item);
+		return -1;
 	}
-	entry_cur->next=&new_item->entry;
+	bucket = xrp_report_bucket(list,new_item->report_id);
+	new_item->entry.next = *bucket;
+	*bucket = &new_item->entry;
+	xrp_cond_unlock(&list->cond);
     DSP_PRINT(INFO,"add new report item %d\n",new_item->report_id);
 	return 0;
-	// xrp_cond_unlock(&queue->request_queue_cond);
 }
 
-int xrp_remove_report(struct xrp_report_list *list,int id)
+/*
+ * Unlink and free the handler for id. With wait set a callback of that
+ * handler still running on the dispatcher is waited for; the dispatcher
+ * itself must pass 0.
+ */
+int xrp_remove_report(struct xrp_report_list *list,int id,int wait)
 {
-	struct xrp_report_entry *pre_entry=NULL;
-	struct xrp_report_entry *cur_entry=list->queue.head;
-	for(;cur_entry!=NULL;pre_entry=cur_entry,cur_entry=cur_entry->next)
+	struct xrp_report_entry **pre_entry;
+	struct xrp_report_item *item;
+
+	xrp_cond_lock(&list->cond);
+	pre_entry = xrp_report_bucket(list,id);
+	for(;*pre_entry!=NULL;pre_entry=&(*pre_entry)->next)
 	{
-		if(((struct xrp_report_item *)cur_entry)->report_id == id)
-		{
-			if(pre_entry==NULL)
-			{
-				list->queue.head = cur_entry->next;
-
-			}
-			else{
-				pre_entry->next=cur_entry->next;
-			}			
-			free(cur_entry);
-			return 0;
-		}
+		if(((struct xrp_report_item *)*pre_entry)->report_id == id)
+			break;
 	}
-	return -1;
+	item = (struct xrp_report_item *)*pre_entry;
+	if(!item)
+	{
+		xrp_cond_unlock(&list->cond);
+		return -1;
+	}
+	*pre_entry = item->entry.next;
+	while (wait && list->current == item)
+		xrp_cond_wait(&list->cond);
+	xrp_cond_unlock(&list->cond);
+	free(item->buf);
+	free(item);
+	return 0;
 }
 
 
 int xrp_alloc_report_id(struct xrp_report_list *list)
 {
 	int new_id;
-	int retry=0;
-	while(1)
+	int retry;
+
+	xrp_cond_lock(&list->cond);
+	for (retry = 0; retry <= 10; ++retry)
 	{
 		new_id= rand()&0x7fffffff;
-		struct xrp_report_entry *cur_entry=list->queue.head;
-		for(;cur_entry!=NULL;cur_entry=cur_entry->next)
+		if (!xrp_get_report_entry(list,new_id))
 		{
-			if(((struct xrp_report_item *)cur_entry)->report_id == new_id)
-			{			
-				retry++;
-				if(retry>10)
-				{
-					DSP_PRINT(WARNING,"alloc report id fail");
-					return -1;
-				}
-				break;
-			}
+			xrp_cond_unlock(&list->cond);
+			return new_id;
 		}
-		return new_id;
-		
 	}
-
-}
\ No newline at end of file
+	xrp_cond_unlock(&list->cond);
+	DSP_PRINT(WARNING,"alloc report id fail");
+	return -1;
+}
@@ -24,6 +24,10 @@
 #ifndef _XRP_REPORT_H
 #define _XRP_REPORT_H
 
+#include "xrp_thread_impl.h"
+
+/* Number of report_id hash buckets, a power of two */
+#define XRP_REPORT_HASH_SIZE 64
 
 struct xrp_report_entry {
 	struct xrp_report_entry * next;
@@ -42,20 +46,26 @@ struct xrp_report_item {
 
 };
 
+/*
+ * Report handlers hashed by report_id. current is the item whose
+ * callback is running, it is called without the lock held so that
+ * it may add or remove handlers itself.
+ */
 struct xrp_report_list{
 
-	struct {
-		struct xrp_report_entry *head;
-	} queue;
+	xrp_cond cond;
+	struct xrp_report_entry *bucket[XRP_REPORT_HASH_SIZE];
+	struct xrp_report_item *current;
 
 };
 
 
-
+extern void xrp_report_list_init(struct xrp_report_list *list);
+extern void xrp_report_list_destroy(struct xrp_report_list *list);
 extern void xrp_process_report(struct xrp_report_list *list,void* data,unsigned int id);
 extern int xrp_add_report(struct xrp_report_list *list,
 					struct xrp_report_item *item);
-extern int xrp_remove_report(struct xrp_report_list *list,int id);
+extern int xrp_remove_report(struct xrp_report_list *list,int id,int wait);
 extern int xrp_alloc_report_id(struct xrp_report_list *list);
 extern struct xrp_report_item* xrp_get_report_entry(struct xrp_report_list *list,int id);
 #endif
@@ -22,6 +22,8 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "xrp_host_common.h"
 #include "xrp_sync_queue.h"
 
@@ -32,6 +34,36 @@ void xrp_queue_init(struct xrp_request_queue *queue, int priority,
 	(void)priority;
 	queue->context = context;
 	queue->fn = fn;
+	queue->batch_fn = NULL;
+}
+
+void xrp_queue_init_batch(struct xrp_request_queue *queue, int priority,
+			  void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context))
+{
+	(void)priority;
+	queue->context = context;
+	queue->fn = NULL;
+	queue->batch_fn = batch_fn;
+}
+
+void xrp_queue_init_sched(struct xrp_request_queue *queue, int priority,
+			  const struct xrp_thread_sched *sched, void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context))
+{
+	(void)sched;
+	xrp_queue_init_batch(queue, priority, context, batch_fn);
+}
+
+void xrp_queue_init_pool(struct xrp_request_queue *queue,
+			 struct xrp_worker_pool *pool, void *context,
+			 void (*batch_fn)(struct xrp_queue_item **rq,
+					  size_t n, void *context))
+{
+	(void)pool;
+	xrp_queue_init_batch(queue, 0, context, batch_fn);
 }
 
 void xrp_queue_destroy(struct xrp_request_queue *queue)
@@ -39,10 +71,58 @@ void xrp_queue_destroy(struct xrp_request_queue *queue)
 	(void)queue;
 }
 
+struct xrp_worker_pool *xrp_worker_pool_create(size_t n_threads,
+					       int priority,
+					       const struct xrp_thread_sched *sched)
+{
+	(void)n_threads;
+	(void)priority;
+	(void)sched;
+	return NULL;
+}
+
+void xrp_worker_pool_retain(struct xrp_worker_pool *pool)
+{
+	(void)pool;
+}
+
+void xrp_worker_pool_release(struct xrp_worker_pool *pool)
+{
+	(void)pool;
+}
+
 void xrp_queue_push(struct xrp_request_queue *queue,
 		    struct xrp_queue_item *rq)
 {
-	queue->fn(rq, queue->context);
+	if (queue->batch_fn)
+		queue->batch_fn(&rq, 1, queue->context);
+	else
+		queue->fn(rq, queue->context);
+}
+
+void xrp_queue_push_list(struct xrp_request_queue *queue,
+			 struct xrp_queue_item **rq, size_t n)
+{
+	if (queue->batch_fn) {
+		queue->batch_fn(rq, n, queue->context);
+	} else {
+		size_t i;
+
+		for (i = 0; i < n; ++i)
+			queue->fn(rq[i], queue->context);
+	}
+}
+
+/* Everything already runs on the caller's thread, claiming always works */
+int xrp_queue_claim(struct xrp_request_queue *queue)
+{
+	(void)queue;
+	return 1;
+}
+
+void xrp_queue_unclaim(struct xrp_request_queue *queue)
+{
+	(void)queue;
 }
 
 struct xrp_event *xrp_event_create(void)
@@ -51,12 +131,40 @@ struct xrp_event *xrp_event_create(void)
 
 	if (!event)
 		return NULL;
+	event->impl.efd = -1;
 	event->status = XRP_STATUS_PENDING;
+	event->ring = 0;
+	event->notify = NULL;
 	return event;
 }
 
+int xrp_event_get_fd(struct xrp_event *event, enum xrp_status *status)
+{
+	if (event->impl.efd < 0)
+		event->impl.efd = eventfd(event->status != XRP_STATUS_PENDING,
+					  EFD_CLOEXEC | EFD_NONBLOCK);
+	set_status(status, event->impl.efd < 0 ?
+		   XRP_STATUS_FAILURE : XRP_STATUS_SUCCESS);
+	return event->impl.efd;
+}
+
+void xrp_event_set_notify(struct xrp_event *event,
+			  void (*notify)(struct xrp_event *event, void *context),
+			  void *context, enum xrp_status *status)
+{
+	if (event->status == XRP_STATUS_PENDING) {
+		event->notify_context = context;
+		event->notify = notify;
+	} else {
+		notify(event, context);
+	}
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
 void xrp_wait(struct xrp_event *event, enum xrp_status *status)
 {
+	if (event->ring)
+		xrp_impl_ring_wait(event);
 	if (event->status == XRP_STATUS_PENDING)
 		set_status(status, XRP_STATUS_FAILURE);
 	else
@@ -66,6 +174,7 @@ void xrp_wait(struct xrp_event *event, enum xrp_status *status)
 size_t xrp_wait_any(struct xrp_event **event, size_t n_events,
 		    enum xrp_status *status)
 {
+	xrp_impl_ring_wait_any(event, n_events);
 	if (n_events && event[0]->status != XRP_STATUS_PENDING)
 		set_status(status, XRP_STATUS_SUCCESS);
 	else
@@ -76,9 +185,19 @@ size_t xrp_wait_any(struct xrp_event **event, size_t n_events,
 void xrp_impl_broadcast_event(struct xrp_event *event, enum xrp_status status)
 {
 	event->status = status;
+	if (event->impl.efd >= 0)
+		eventfd_write(event->impl.efd, 1);
+	if (event->notify) {
+		void (*notify)(struct xrp_event *event, void *context) =
+			event->notify;
+
+		event->notify = NULL;
+		notify(event, event->notify_context);
+	}
 }
 
 void xrp_impl_release_event(struct xrp_event *event)
 {
-	(void)event;
+	if (event->impl.efd >= 0)
+		close(event->impl.efd);
 }
@@ -29,21 +29,51 @@
 struct xrp_queue_item {
 };
 
+#define XRP_REQUEST_QUEUE_DRAIN_MAX 1
+
 struct xrp_request_queue {
 	void *context;
 	void (*fn)(struct xrp_queue_item *rq, void *context);
+	void (*batch_fn)(struct xrp_queue_item **rq, size_t n, void *context);
 };
 
+/* No threads to share, xrp_worker_pool_create always fails */
+struct xrp_worker_pool;
+
 struct xrp_event_impl {
 	xrp_cond cond;
+	/* eventfd created by xrp_event_get_fd, -1 until then */
+	int efd;
 };
 
 void xrp_queue_init(struct xrp_request_queue *queue, int priority,
 		    void *context,
 		    void (*fn)(struct xrp_queue_item *rq, void *context));
+void xrp_queue_init_batch(struct xrp_request_queue *queue, int priority,
+			  void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context));
+void xrp_queue_init_sched(struct xrp_request_queue *queue, int priority,
+			  const struct xrp_thread_sched *sched, void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context));
+void xrp_queue_init_pool(struct xrp_request_queue *queue,
+			 struct xrp_worker_pool *pool, void *context,
+			 void (*batch_fn)(struct xrp_queue_item **rq,
+					  size_t n, void *context));
 void xrp_queue_destroy(struct xrp_request_queue *queue);
 void xrp_queue_push(struct xrp_request_queue *queue,
 		    struct xrp_queue_item *rq);
+void xrp_queue_push_list(struct xrp_request_queue *queue,
+			 struct xrp_queue_item **rq, size_t n);
+int xrp_queue_claim(struct xrp_request_queue *queue);
+void xrp_queue_unclaim(struct xrp_request_queue *queue);
+
+struct xrp_worker_pool *xrp_worker_pool_create(size_t n_threads,
+					       int priority,
+					       const struct xrp_thread_sched *sched);
+void xrp_worker_pool_retain(struct xrp_worker_pool *pool);
+void xrp_worker_pool_release(struct xrp_worker_pool *pool);
 
 struct xrp_event *xrp_event_create(void);
 void xrp_impl_broadcast_event(struct xrp_event *event, enum xrp_status status);
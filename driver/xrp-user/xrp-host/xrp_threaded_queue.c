@@ -21,22 +21,107 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+/* for thread affinity in xrp_thread_impl.h */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "xrp_debug.h"
 #include "xrp_host_common.h"
 #include "xrp_threaded_queue.h"
 #include "dsp_common.h"
+
+enum {
+	XRP_QUEUE_RUNNING,
+	XRP_QUEUE_IDLE,
+};
+
+static void _xrp_enqueue_request(struct xrp_request_queue *queue,
+				 struct xrp_queue_item *rq)
+{
+	struct xrp_queue_item *prev;
+
+	atomic_store_explicit(&rq->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange(&queue->request_queue.head, rq);
+	atomic_store_explicit(&prev->next, rq, memory_order_release);
+}
+
+/* Publish a chain of items with a single exchange on head */
+static void _xrp_enqueue_request_list(struct xrp_request_queue *queue,
+				      struct xrp_queue_item **rq, size_t n)
+{
+	struct xrp_queue_item *prev;
+	size_t i;
+
+	for (i = 0; i + 1 < n; ++i)
+		atomic_store_explicit(&rq[i]->next, rq[i + 1],
+				      memory_order_relaxed);
+	atomic_store_explicit(&rq[n - 1]->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange(&queue->request_queue.head, rq[n - 1]);
+	atomic_store_explicit(&prev->next, rq[0], memory_order_release);
+}
+
+/*
+ * Consumer side of the MPSC queue, only called from the queue thread.
+ * May return NULL while a producer is between swapping head and linking
+ * its item, use _xrp_queue_empty to tell that from a really empty queue.
+ */
 static struct xrp_queue_item *_xrp_dequeue_request(struct xrp_request_queue *queue)
 {
-	struct xrp_queue_item *rq = queue->request_queue.head;
+	struct xrp_queue_item *stub = &queue->request_queue.stub;
+	struct xrp_queue_item *tail = queue->request_queue.tail;
+	struct xrp_queue_item *next =
+		atomic_load_explicit(&tail->next, memory_order_acquire);
 
-	if (!rq)
+	if (tail == stub) {
+		if (!next)
+			return NULL;
+		queue->request_queue.tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next) {
+		queue->request_queue.tail = next;
+		return tail;
+	}
+	if (tail != atomic_load(&queue->request_queue.head))
 		return NULL;
 
-	if (rq == queue->request_queue.tail)
-		queue->request_queue.tail = NULL;
-	queue->request_queue.head = rq->next;
-	return rq;
+	_xrp_enqueue_request(queue, stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		queue->request_queue.tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static int _xrp_queue_empty(struct xrp_request_queue *queue)
+{
+	struct xrp_queue_item *tail = queue->request_queue.tail;
+
+	return tail == atomic_load(&queue->request_queue.head) &&
+		!atomic_load_explicit(&tail->next, memory_order_acquire);
+}
+
+/*
+ * Called after processing n items with run_lock held, unless the callback
+ * destroyed the queue.
+ */
+static void _xrp_queue_done(struct xrp_request_queue *queue, size_t n)
+{
+	atomic_fetch_sub(&queue->pending, (int)n);
+	xrp_mutex_unlock(&queue->run_lock);
+}
+
+static void _xrp_queue_kick(struct xrp_request_queue *queue)
+{
+	if (atomic_load(&queue->idle) == XRP_QUEUE_IDLE &&
+	    atomic_exchange(&queue->idle, XRP_QUEUE_RUNNING) == XRP_QUEUE_IDLE)
+		xrp_futex_wake(&queue->idle, 1);
 }
 
 static int xrp_queue_process(struct xrp_request_queue *queue)
@@ -45,20 +130,43 @@ static int xrp_queue_process(struct xrp_request_queue *queue)
 	int exit = 0;
 
 	queue->sync_exit = &exit;
-	xrp_cond_lock(&queue->request_queue_cond);
 	for (;;) {
 		rq = _xrp_dequeue_request(queue);
-		if (rq || queue->exit)
+		if (rq || atomic_load(&queue->exit))
 			break;
-		xrp_cond_wait(&queue->request_queue_cond);
+		if (!_xrp_queue_empty(queue)) {
+			/* a producer is half way through the push */
+			sched_yield();
+			continue;
+		}
+		atomic_store(&queue->idle, XRP_QUEUE_IDLE);
+		if (_xrp_queue_empty(queue) && !atomic_load(&queue->exit))
+			xrp_futex_wait(&queue->idle, XRP_QUEUE_IDLE);
+		atomic_store(&queue->idle, XRP_QUEUE_RUNNING);
 	}
-	xrp_cond_unlock(&queue->request_queue_cond);
 
 	if (!rq)
 		return 0;
         
     // printf("%s,queue:%p get item\n",__FUNCTION__,queue);
-	queue->fn(rq, queue->context);
+	xrp_mutex_lock(&queue->run_lock);
+	if (queue->batch_fn) {
+		struct xrp_queue_item *batch[XRP_REQUEST_QUEUE_DRAIN_MAX];
+		size_t n = 0;
+
+		/* take whatever else is already pending, don't wait for more */
+		do {
+			batch[n++] = rq;
+		} while (n < XRP_REQUEST_QUEUE_DRAIN_MAX &&
+			 (rq = _xrp_dequeue_request(queue)));
+		queue->batch_fn(batch, n, queue->context);
+		if (!exit)
+			_xrp_queue_done(queue, n);
+	} else {
+		queue->fn(rq, queue->context);
+		if (!exit)
+			_xrp_queue_done(queue, 1);
+	}
     // printf("%s,queue:%p done item\n",__FUNCTION__,queue);
 	return !exit;
 }
@@ -73,55 +181,385 @@ static void *xrp_queue_thread(void *p)
 	return NULL;
 }
 
+/* Called with pool->cond held */
+static void _xrp_pool_append(struct xrp_worker_pool *pool,
+			     struct xrp_request_queue *queue)
+{
+	queue->ready_next = NULL;
+	if (pool->ready_tail)
+		pool->ready_tail->ready_next = queue;
+	else
+		pool->ready_head = queue;
+	pool->ready_tail = queue;
+}
+
+/* Called with pool->cond held */
+static void _xrp_pool_unlink(struct xrp_worker_pool *pool,
+			     struct xrp_request_queue *queue)
+{
+	struct xrp_request_queue **p = &pool->ready_head;
+	struct xrp_request_queue *prev = NULL;
+
+	while (*p && *p != queue) {
+		prev = *p;
+		p = &prev->ready_next;
+	}
+	if (!*p)
+		return;
+	*p = queue->ready_next;
+	if (pool->ready_tail == queue)
+		pool->ready_tail = prev;
+}
+
+static void _xrp_pool_schedule(struct xrp_request_queue *queue)
+{
+	struct xrp_worker_pool *pool = queue->pool;
+
+	if (atomic_load(&queue->scheduled) ||
+	    atomic_exchange(&queue->scheduled, 1))
+		return;
+	xrp_cond_lock(&pool->cond);
+	_xrp_pool_append(pool, queue);
+	xrp_cond_signal(&pool->cond);
+	xrp_cond_unlock(&pool->cond);
+}
+
+/*
+ * Process up to XRP_REQUEST_QUEUE_DRAIN_MAX items of the queue and return
+ * the number of items taken. *exit is set if the queue got destroyed by
+ * the callback, the queue must not be touched after that.
+ */
+static size_t _xrp_pool_drain(struct xrp_request_queue *queue, int *exit)
+{
+	struct xrp_queue_item *batch[XRP_REQUEST_QUEUE_DRAIN_MAX];
+	struct xrp_queue_item *rq;
+	size_t n = 0;
+
+	queue->sync_exit = exit;
+	xrp_mutex_lock(&queue->run_lock);
+	if (queue->batch_fn) {
+		while (n < XRP_REQUEST_QUEUE_DRAIN_MAX &&
+		       (rq = _xrp_dequeue_request(queue)))
+			batch[n++] = rq;
+		if (n)
+			queue->batch_fn(batch, n, queue->context);
+	} else {
+		while (n < XRP_REQUEST_QUEUE_DRAIN_MAX && !*exit &&
+		       (rq = _xrp_dequeue_request(queue))) {
+			queue->fn(rq, queue->context);
+			++n;
+		}
+	}
+	if (!*exit)
+		_xrp_queue_done(queue, n);
+	return n;
+}
+
+static void *xrp_pool_thread(void *p)
+{
+	struct xrp_worker_pool *pool = p;
+	struct xrp_request_queue *queue;
+	size_t idx;
+	int orphaned;
+
+	xrp_cond_lock(&pool->cond);
+	for (idx = 0; !xrp_thread_is_self(&pool->thread[idx]); ++idx)
+		;
+	for (;;) {
+		int exit = 0;
+		size_t n;
+
+		while (!pool->exit && !pool->ready_head)
+			xrp_cond_wait(&pool->cond);
+		if (pool->exit)
+			break;
+
+		queue = pool->ready_head;
+		pool->ready_head = queue->ready_next;
+		if (!pool->ready_head)
+			pool->ready_tail = NULL;
+		pool->current[idx] = queue;
+		xrp_cond_unlock(&pool->cond);
+
+		n = _xrp_pool_drain(queue, &exit);
+		if (!n)
+			/* a producer is half way through the push */
+			sched_yield();
+
+		xrp_cond_lock(&pool->cond);
+		pool->current[idx] = NULL;
+		if (!exit) {
+			/*
+			 * Pairs with the head exchange in the producer: either
+			 * we see its item here or it sees scheduled cleared.
+			 */
+			atomic_store(&queue->scheduled, 0);
+			if (!atomic_load(&queue->exit) &&
+			    !_xrp_queue_empty(queue) &&
+			    !atomic_exchange(&queue->scheduled, 1))
+				_xrp_pool_append(pool, queue);
+		}
+		if (pool->n_waiters)
+			xrp_cond_broadcast(&pool->cond);
+	}
+	orphaned = pool->orphaned;
+	xrp_cond_unlock(&pool->cond);
+
+	if (orphaned) {
+		/* every other worker is joined, nobody else uses the pool */
+		xrp_cond_destroy(&pool->cond);
+		free(pool->current);
+		free(pool->thread);
+		free(pool);
+	}
+	return NULL;
+}
+
+struct xrp_worker_pool *xrp_worker_pool_create(size_t n_threads,
+					       int priority,
+					       const struct xrp_thread_sched *sched)
+{
+	struct xrp_worker_pool *pool = calloc(1, sizeof(*pool));
+	size_t i;
+
+	if (!pool)
+		return NULL;
+	pool->thread = calloc(n_threads, sizeof(*pool->thread));
+	pool->current = calloc(n_threads, sizeof(*pool->current));
+	if (!n_threads || !pool->thread || !pool->current) {
+		free(pool->thread);
+		free(pool->current);
+		free(pool);
+		return NULL;
+	}
+	xrp_cond_init(&pool->cond);
+	atomic_init(&pool->ref, 1);
+
+	/* workers look themselves up in pool->thread, hold them back */
+	xrp_cond_lock(&pool->cond);
+	for (i = 0; i < n_threads; ++i) {
+		if (!xrp_thread_create_sched(pool->thread + i, priority, sched,
+					     xrp_pool_thread, pool))
+			break;
+	}
+	pool->n_threads = i;
+	xrp_cond_unlock(&pool->cond);
+
+	if (!i) {
+		xrp_worker_pool_release(pool);
+		return NULL;
+	}
+	DSP_PRINT(DEBUG,"worker pool %p with %zu threads\n",pool,i);
+	return pool;
+}
+
+void xrp_worker_pool_retain(struct xrp_worker_pool *pool)
+{
+	atomic_fetch_add(&pool->ref, 1);
+}
+
+void xrp_worker_pool_release(struct xrp_worker_pool *pool)
+{
+	int orphaned = 0;
+	size_t i;
+
+	if (atomic_fetch_sub(&pool->ref, 1) != 1)
+		return;
+
+	xrp_cond_lock(&pool->cond);
+	pool->exit = 1;
+	xrp_cond_broadcast(&pool->cond);
+	xrp_cond_unlock(&pool->cond);
+
+	/*
+	 * The last queue may be released from its own completion callback,
+	 * i.e. on a worker. That worker frees the pool on its way out.
+	 */
+	for (i = 0; i < pool->n_threads; ++i) {
+		if (xrp_thread_is_self(pool->thread + i)) {
+			xrp_thread_detach(pool->thread + i);
+			orphaned = 1;
+		} else {
+			xrp_thread_join(pool->thread + i);
+		}
+	}
+	if (orphaned) {
+		xrp_cond_lock(&pool->cond);
+		pool->orphaned = 1;
+		xrp_cond_unlock(&pool->cond);
+		return;
+	}
+	xrp_cond_destroy(&pool->cond);
+	free(pool->current);
+	free(pool->thread);
+	free(pool);
+}
+
+static void xrp_pool_remove_queue(struct xrp_request_queue *queue)
+{
+	struct xrp_worker_pool *pool = queue->pool;
+	size_t i;
+
+	xrp_cond_lock(&pool->cond);
+	_xrp_pool_unlink(pool, queue);
+	++pool->n_waiters;
+	for (i = 0; i < pool->n_threads; ++i) {
+		if (pool->current[i] != queue)
+			continue;
+		if (xrp_thread_is_self(pool->thread + i)) {
+			/* released from its own callback */
+			*queue->sync_exit = 1;
+			pool->current[i] = NULL;
+			continue;
+		}
+		while (pool->current[i] == queue)
+			xrp_cond_wait(&pool->cond);
+	}
+	--pool->n_waiters;
+	xrp_cond_unlock(&pool->cond);
+	xrp_worker_pool_release(pool);
+}
+
+static void _xrp_queue_init_common(struct xrp_request_queue *queue,
+				   void *context)
+{
+	atomic_init(&queue->request_queue.stub.next, NULL);
+	atomic_init(&queue->request_queue.head, &queue->request_queue.stub);
+	queue->request_queue.tail = &queue->request_queue.stub;
+	atomic_init(&queue->idle, XRP_QUEUE_RUNNING);
+	atomic_init(&queue->exit, 0);
+	atomic_init(&queue->scheduled, 0);
+	atomic_init(&queue->pending, 0);
+	xrp_mutex_init(&queue->run_lock);
+	queue->pool = NULL;
+	queue->ready_next = NULL;
+	queue->sync_exit = NULL;
+	queue->context = context;
+}
+
+static void _xrp_queue_init(struct xrp_request_queue *queue, int priority,
+			    const struct xrp_thread_sched *sched,
+			    void *context)
+{
+	_xrp_queue_init_common(queue, context);
+	xrp_thread_create_sched(&queue->thread, priority, sched,
+				xrp_queue_thread, queue);
+}
+
 void xrp_queue_init(struct xrp_request_queue *queue, int priority,
 		    void *context,
 		    void (*fn)(struct xrp_queue_item *rq, void *context))
 {
-	xrp_cond_init(&queue->request_queue_cond);
-	queue->context = context;
 	queue->fn = fn;
-	xrp_thread_create(&queue->thread, priority, xrp_queue_thread, queue);
+	queue->batch_fn = NULL;
+	_xrp_queue_init(queue, priority, NULL, context);
+}
+
+void xrp_queue_init_batch(struct xrp_request_queue *queue, int priority,
+			  void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context))
+{
+	queue->fn = NULL;
+	queue->batch_fn = batch_fn;
+	_xrp_queue_init(queue, priority, NULL, context);
+}
+
+void xrp_queue_init_sched(struct xrp_request_queue *queue, int priority,
+			  const struct xrp_thread_sched *sched, void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context))
+{
+	queue->fn = NULL;
+	queue->batch_fn = batch_fn;
+	_xrp_queue_init(queue, priority, sched, context);
+}
+
+void xrp_queue_init_pool(struct xrp_request_queue *queue,
+			 struct xrp_worker_pool *pool, void *context,
+			 void (*batch_fn)(struct xrp_queue_item **rq,
+					  size_t n, void *context))
+{
+	_xrp_queue_init_common(queue, context);
+	queue->fn = NULL;
+	queue->batch_fn = batch_fn;
+	xrp_worker_pool_retain(pool);
+	queue->pool = pool;
 }
 
 void xrp_queue_destroy(struct xrp_request_queue *queue)
 {
-    xrp_cond_lock(&queue->request_queue_cond);
-	queue->exit = 1;
-	xrp_cond_broadcast(&queue->request_queue_cond);
-	xrp_cond_unlock(&queue->request_queue_cond);
+	atomic_store(&queue->exit, 1);
+	if (queue->pool) {
+		xrp_pool_remove_queue(queue);
+		if (!_xrp_queue_empty(queue))
+			DSP_PRINT(DEBUG,"releasing non-empty queue\n");
+		return;
+	}
+	atomic_store(&queue->idle, XRP_QUEUE_RUNNING);
+	xrp_futex_wake(&queue->idle, 1);
 	if (!xrp_thread_join(&queue->thread)) {
 		*queue->sync_exit = 1;
 		xrp_thread_detach(&queue->thread);
         DSP_PRINT(DEBUG,"queue thread release\n");
 	}
-	xrp_cond_lock(&queue->request_queue_cond);
-	if (queue->request_queue.head != NULL)
+	if (!_xrp_queue_empty(queue))
 		DSP_PRINT(DEBUG,"releasing non-empty queue\n");
-	xrp_cond_unlock(&queue->request_queue_cond);
-	xrp_cond_destroy(&queue->request_queue_cond);
 }
 
 void xrp_queue_push(struct xrp_request_queue *queue,
 		    struct xrp_queue_item *rq)
 {
-	xrp_cond_lock(&queue->request_queue_cond);
-	rq->next = NULL;
-	if (queue->request_queue.tail) {
-		queue->request_queue.tail->next = rq;
+	atomic_fetch_add(&queue->pending, 1);
+	_xrp_enqueue_request(queue, rq);
+	if (queue->pool)
+		_xrp_pool_schedule(queue);
+	else
+		_xrp_queue_kick(queue);
+}
 
-	} else {
-		queue->request_queue.head = rq;
-		xrp_cond_broadcast(&queue->request_queue_cond);
+void xrp_queue_push_list(struct xrp_request_queue *queue,
+			 struct xrp_queue_item **rq, size_t n)
+{
+	if (!n)
+		return;
+	atomic_fetch_add(&queue->pending, (int)n);
+	_xrp_enqueue_request_list(queue, rq, n);
+	if (queue->pool)
+		_xrp_pool_schedule(queue);
+	else
+		_xrp_queue_kick(queue);
+}
 
-	}
-	queue->request_queue.tail = rq;
-	xrp_cond_unlock(&queue->request_queue_cond);
+/*
+ * Take the queue for a command run on the caller's thread. Fails unless
+ * the queue is idle with nothing pending; once claimed, items pushed by
+ * others wait until xrp_queue_unclaim, so queue order is kept.
+ */
+int xrp_queue_claim(struct xrp_request_queue *queue)
+{
+	int expected = 0;
+
+	if (atomic_load(&queue->exit) ||
+	    atomic_load_explicit(&queue->pending, memory_order_relaxed) ||
+	    !atomic_compare_exchange_strong(&queue->pending, &expected, 1))
+		return 0;
+	xrp_mutex_lock(&queue->run_lock);
+	return 1;
+}
+
+void xrp_queue_unclaim(struct xrp_request_queue *queue)
+{
+	_xrp_queue_done(queue, 1);
 }
 
 static void xrp_impl_event_init(struct xrp_event *event)
 {
 	xrp_cond_init(&event->impl.cond);
+	event->impl.efd = -1;
 	event->status = XRP_STATUS_PENDING;
+	event->ring = 0;
+	event->notify = NULL;
 }
 
 struct xrp_event *xrp_event_create(void)
@@ -134,8 +572,47 @@ struct xrp_event *xrp_event_create(void)
 	return event;
 }
 
+int xrp_event_get_fd(struct xrp_event *event, enum xrp_status *status)
+{
+	int fd;
+
+	xrp_cond_lock(&event->impl.cond);
+	if (event->impl.efd < 0) {
+		event->impl.efd = eventfd(event->status != XRP_STATUS_PENDING,
+					  EFD_CLOEXEC | EFD_NONBLOCK);
+		if (event->impl.efd < 0)
+			DSP_PRINT(WARNING,"eventfd create fail\n");
+	}
+	fd = event->impl.efd;
+	xrp_cond_unlock(&event->impl.cond);
+
+	set_status(status, fd < 0 ? XRP_STATUS_FAILURE : XRP_STATUS_SUCCESS);
+	return fd;
+}
+
+void xrp_event_set_notify(struct xrp_event *event,
+			  void (*notify)(struct xrp_event *event, void *context),
+			  void *context, enum xrp_status *status)
+{
+	int pending;
+
+	xrp_cond_lock(&event->impl.cond);
+	pending = event->status == XRP_STATUS_PENDING;
+	if (pending) {
+		event->notify_context = context;
+		event->notify = notify;
+	}
+	xrp_cond_unlock(&event->impl.cond);
+
+	if (!pending)
+		notify(event, context);
+	set_status(status, XRP_STATUS_SUCCESS);
+}
+
 void xrp_wait(struct xrp_event *event, enum xrp_status *status)
 {
+	if (event->ring)
+		xrp_impl_ring_wait(event);
 
 	xrp_cond_lock(&event->impl.cond);
 	while (event->status == XRP_STATUS_PENDING)
@@ -157,6 +634,8 @@ size_t xrp_wait_any(struct xrp_event **event, size_t n_events,
 		return 0;
 	}
 
+	xrp_impl_ring_wait_any(event, n_events);
+
 	link = calloc(n_events, sizeof(struct xrp_event_link));
 
 	xrp_impl_event_init(&group);
@@ -217,10 +696,13 @@ void xrp_impl_broadcast_event(struct xrp_event *event, enum xrp_status status)
 {
 	struct xrp_event *group;
 	struct xrp_event_link *link;
+	void (*notify)(struct xrp_event *event, void *context);
     // printf("%s, event %p! entry\n",__func__,event);
 	xrp_cond_lock(&event->impl.cond);
 	event->status = status;
 	xrp_cond_broadcast(&event->impl.cond);
+	if (event->impl.efd >= 0)
+		eventfd_write(event->impl.efd, 1);
 
 	group = event->group;
 	link = event->link;
@@ -232,11 +714,18 @@ void xrp_impl_broadcast_event(struct xrp_event *event, enum xrp_status status)
 		group = link->group;
 		link = link->next;
 	}
+	notify = event->notify;
+	event->notify = NULL;
 	xrp_cond_unlock(&event->impl.cond);
+
+	if (notify)
+		notify(event, event->notify_context);
     // printf("%s, event %p! exit\n",__func__,event);
 }
 
 void xrp_impl_release_event(struct xrp_event *event)
 {
+	if (event->impl.efd >= 0)
+		close(event->impl.efd);
 	xrp_cond_destroy(&event->impl.cond);
 }
@@ -27,33 +27,101 @@
 #include "xrp_thread_impl.h"
 
 struct xrp_queue_item {
-	struct xrp_queue_item *next;
+	struct xrp_queue_item *_Atomic next;
 };
 
+/* Max number of items handed to batch_fn at once */
+#define XRP_REQUEST_QUEUE_DRAIN_MAX 32
+
+struct xrp_request_queue;
+
+/*
+ * Set of worker threads shared by request queues. A queue with pending
+ * items sits on the ready list until a worker picks it up; the scheduled
+ * flag keeps a queue on at most one worker at a time, so items of one
+ * queue are still processed in order.
+ */
+struct xrp_worker_pool {
+	xrp_cond cond;
+	struct xrp_request_queue *ready_head;
+	struct xrp_request_queue *ready_tail;
+	/* queue being processed by each worker, NULL when idle */
+	struct xrp_request_queue **current;
+	xrp_thread *thread;
+	size_t n_threads;
+	size_t n_waiters;
+	int exit;
+	/* set when the last reference was dropped from a worker thread */
+	int orphaned;
+	_Atomic int ref;
+};
+
+/*
+ * Intrusive multi-producer/single-consumer queue.
+ * Producers only touch request_queue.head (atomic exchange), the worker
+ * thread is the only user of request_queue.tail. The worker parks on the
+ * idle futex word when the queue is empty, producers only issue a wake
+ * syscall when they observe it parked.
+ * A queue created with xrp_queue_init_pool has no thread of its own and
+ * is drained by the pool workers instead.
+ */
 struct xrp_request_queue {
 	xrp_thread thread;
-	xrp_cond request_queue_cond;
+	struct xrp_worker_pool *pool;
+	struct xrp_request_queue *ready_next;
+	_Atomic int scheduled;
 	struct {
-		struct xrp_queue_item *head;
+		struct xrp_queue_item *_Atomic head;
 		struct xrp_queue_item *tail;
+		struct xrp_queue_item stub;
 	} request_queue;
-	int exit;
+	_Atomic int idle;
+	_Atomic int exit;
 	int *sync_exit;
+	/* items pushed but not processed yet, plus one while claimed */
+	_Atomic int pending;
+	/* held while items are processed, see xrp_queue_claim */
+	xrp_mutex run_lock;
 
 	void *context;
 	void (*fn)(struct xrp_queue_item *rq, void *context);
+	void (*batch_fn)(struct xrp_queue_item **rq, size_t n, void *context);
 };
 
 struct xrp_event_impl {
 	xrp_cond cond;
+	/* eventfd created by xrp_event_get_fd, -1 until then */
+	int efd;
 };
 
 void xrp_queue_init(struct xrp_request_queue *queue, int priority,
 		    void *context,
 		    void (*fn)(struct xrp_queue_item *rq, void *context));
+void xrp_queue_init_batch(struct xrp_request_queue *queue, int priority,
+			  void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context));
+void xrp_queue_init_sched(struct xrp_request_queue *queue, int priority,
+			  const struct xrp_thread_sched *sched, void *context,
+			  void (*batch_fn)(struct xrp_queue_item **rq,
+					   size_t n, void *context));
+void xrp_queue_init_pool(struct xrp_request_queue *queue,
+			 struct xrp_worker_pool *pool, void *context,
+			 void (*batch_fn)(struct xrp_queue_item **rq,
+					  size_t n, void *context));
 void xrp_queue_destroy(struct xrp_request_queue *queue);
 void xrp_queue_push(struct xrp_request_queue *queue,
 		    struct xrp_queue_item *rq);
+void xrp_queue_push_list(struct xrp_request_queue *queue,
+			 struct xrp_queue_item **rq, size_t n);
+int xrp_queue_claim(struct xrp_request_queue *queue);
+void xrp_queue_unclaim(struct xrp_request_queue *queue);
+
+struct xrp_worker_pool *xrp_worker_pool_create(size_t n_threads,
+					       int priority,
+					       const struct xrp_thread_sched *sched);
+void xrp_worker_pool_retain(struct xrp_worker_pool *pool);
+void xrp_worker_pool_release(struct xrp_worker_pool *pool);
 
 struct xrp_event *xrp_event_create(void);
 void xrp_impl_broadcast_event(struct xrp_event *event, enum xrp_status status);
@@ -1,12 +1,16 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include "csi_dsp_api.h"
 #include "csi_dsp_task_defs.h"
 #include "csi_dsp_post_process_defs.h"
+#include "xrp_api.h"
+#include "dsp_ps_ns.h"
 
 #include "CppUTest/TestHarness.h"
 #include "CppUTest/CommandLineTestRunner.h"
@@ -161,6 +165,37 @@ TEST_GROUP(DspPostProcessTestBasic)
         return 0;
     }
 
+    /* a request copying a with x height input plane to an output plane */
+    struct csi_sw_task_req* copyRequestHelper(int with,int height)
+    {
+        struct csi_sw_task_req* req =csi_dsp_task_create_request(task);
+        struct csi_dsp_buffer buf;
+        int i;
+
+        if(req==NULL)
+        {
+            return NULL;
+        }
+        for(i=0;i<2;i++)
+        {
+            memset(&buf,0,sizeof(buf));
+            buf.buf_id = i;
+            buf.dir = i ? CSI_DSP_BUFFER_OUT : CSI_DSP_BUFFER_IN;
+            buf.type = CSI_DSP_BUF_ALLOC_DRV;
+            buf.plane_count = 1;
+            buf.width =with;
+            buf.height =height;
+            buf.planes[0].stride= with;
+            buf.planes[0].size= with*height;
+            if(csi_dsp_request_add_buffer(req,&buf))
+            {
+                csi_dsp_task_release_request(req);
+                return NULL;
+            }
+        }
+        return req;
+    }
+
     // int task_thread_process(struct buf_param * param)
     // {
 
@@ -211,6 +246,345 @@ TEST(DspPostProcessTestBasic,oneProcessReq_multi_planes_1920_1080)
 
 }
 
+TEST(DspPostProcessTestBasic,PropertyGrowFromArenaToHeap)
+{
+    /* small properties go to the 64KB task arena, ones over 16KB get a buffer of their own */
+    static char small_prop[1024];
+    static char large_prop[32 * 1024];
+    uint64_t first_arena = 0;
+    int loop;
+
+    memset(small_prop,0x5a,sizeof(small_prop));
+    memset(large_prop,0xa5,sizeof(large_prop));
+    for(loop=0;loop<256;loop++)
+    {
+        struct csi_sw_task_req* req =csi_dsp_task_create_request(task);
+        uint64_t arena_ptr;
+
+        if(req==NULL)
+        {
+            FAIL_TEST("req create fail\n");
+        }
+        CHECK_EQUAL_ZERO(csi_dsp_request_set_property(req,small_prop,sizeof(small_prop)));
+        arena_ptr = req->sett_ptr;
+        if(!first_arena)
+            first_arena = arena_ptr;
+        /* the arena block must be returned when the property grows */
+        CHECK_EQUAL_ZERO(csi_dsp_request_set_property(req,large_prop,sizeof(large_prop)));
+        CHECK(req->sett_ptr != arena_ptr);
+        CHECK_EQUAL(sizeof(large_prop),req->sett_length);
+        CHECK_EQUAL_ZERO(csi_dsp_request_set_property(req,small_prop,sizeof(small_prop)));
+        csi_dsp_task_release_request(req);
+        /* a leaked block stalls the arena and later properties fall back to the heap */
+        CHECK(arena_ptr >= first_arena - 64 * 1024 && arena_ptr < first_arena + 64 * 1024);
+    }
+}
+
+static int txnReportCb(void *context,void *data)
+{
+    return 0;
+}
+
+TEST(DspPostProcessTestBasic,TxnCreateTaskCommit)
+{
+    csi_dsp_algo_load_req_t alog_config={
+        .algo_id=0,
+    };
+    int status[2];
+    void *txn_task[2];
+    void *txn;
+    int i;
+
+    txn = csi_dsp_txn_create(instance);
+    CHECK(txn != NULL);
+    for(i=0;i<2;i++)
+    {
+        txn_task[i] = csi_dsp_txn_create_task(txn,CSI_DSP_TASK_SW_TO_SW);
+        CHECK(txn_task[i] != NULL);
+    }
+    CHECK_EQUAL_ZERO(csi_dsp_txn_commit(txn,status,2));
+    CHECK_EQUAL(CSI_DSP_OK,status[0]);
+    CHECK_EQUAL(CSI_DSP_OK,status[1]);
+    /* a transaction is committed once */
+    CHECK(csi_dsp_txn_commit(txn,status,2) != 0);
+    csi_dsp_txn_destroy(txn);
+
+    /* the tasks are usable like ones from csi_dsp_create_task */
+    for(i=0;i<2;i++)
+    {
+        CHECK_EQUAL_ZERO(csi_dsp_task_load_algo(txn_task[i],&alog_config));
+        csi_dsp_destroy_task(txn_task[i]);
+    }
+}
+
+TEST(DspPostProcessTestBasic,TxnCompoundFallback)
+{
+    int status[1];
+    void *dsp;
+    void *txn_task;
+    void *txn;
+    int loop;
+
+    /* try PS_CMD_COMPOUND, a firmware without it must get the steps one by one */
+    setenv("CSI_DSP_COMPOUND","1",1);
+    dsp = csi_dsp_create_instance(0);
+    unsetenv("CSI_DSP_COMPOUND");
+    CHECK(dsp != NULL);
+    for(loop=0;loop<2;loop++)
+    {
+        txn = csi_dsp_txn_create(dsp);
+        CHECK(txn != NULL);
+        txn_task = csi_dsp_txn_create_task(txn,CSI_DSP_TASK_SW_TO_SW);
+        CHECK(txn_task != NULL);
+        CHECK_EQUAL_ZERO(csi_dsp_txn_commit(txn,status,1));
+        CHECK_EQUAL(CSI_DSP_OK,status[0]);
+        csi_dsp_txn_destroy(txn);
+        csi_dsp_destroy_task(txn_task);
+    }
+    csi_dsp_delete_instance(dsp);
+}
+
+TEST(DspPostProcessTestBasic,TxnRollback)
+{
+    struct csi_dsp_task_fe_para fe;
+    int status[2];
+    void *txn;
+
+    memset(&fe,0,sizeof(fe));
+    fe.frontend_type = CSI_DSP_FE_TYPE_INVALID;
+    fe.task_id = -1;
+    txn = csi_dsp_txn_create(instance);
+    CHECK(txn != NULL);
+    CHECK_EQUAL_ZERO(csi_dsp_txn_config_frontend(txn,task,&fe));
+    CHECK_EQUAL_ZERO(csi_dsp_txn_register_cb(txn,task,txnReportCb,NULL,64));
+    /* the caller's payload is copied, not patched */
+    CHECK_EQUAL(-1,fe.task_id);
+
+    CHECK(csi_dsp_txn_commit(txn,status,2) != 0);
+    CHECK(status[0] != CSI_DSP_OK);
+    CHECK_EQUAL(CSI_DSP_TXN_STEP_NOT_RUN,status[1]);
+    csi_dsp_txn_destroy(txn);
+
+    /* the report of the step that did not run was taken back */
+    CHECK_EQUAL_ZERO(csi_dsp_task_register_cb(task,txnReportCb,NULL,64));
+    CHECK_EQUAL_ZERO(csi_dsp_ps_task_unregister_cb(task));
+}
+
+TEST(DspPostProcessTestBasic,RearmRequestReuse)
+{
+    csi_dsp_algo_load_req_t alog_config={
+        .algo_id=0,
+    };
+    struct csi_sw_task_req* req=NULL;
+    int loop;
+    int i;
+
+    if(csi_dsp_task_load_algo(task,&alog_config))
+    {
+        FAIL_TEST("algo kernel load fail\n");
+    }
+    req =copyRequestHelper(640,480);
+    if(req==NULL)
+    {
+        FAIL_TEST("req create fail\n");
+    }
+
+    /* the same request, buffers and mappings go around several times */
+    for(loop=0;loop<4;loop++)
+    {
+        int *in = (int *)req->buffers[0].planes[0].buf_vir;
+        int *out = (int *)req->buffers[1].planes[0].buf_vir;
+
+        for(i=0;i<req->buffers[0].planes[0].size/4;i++)
+        {
+            in[i]=rand();
+        }
+        memset(out,0,req->buffers[1].planes[0].size);
+        CHECK_EQUAL_ZERO(csi_dsp_request_enqueue(req));
+        /* in flight until dequeued, neither enqueue nor rearm may touch it */
+        CHECK(csi_dsp_request_enqueue(req) != 0);
+        CHECK(csi_dsp_request_rearm(req) != 0);
+        CHECK(csi_dsp_request_dequeue(task) == req);
+        CHECK_EQUAL(CSI_DSP_SW_REQ_DONE,req->status);
+        CHECK_EQUAL_ZERO(memcmp(in,out,req->buffers[0].planes[0].size));
+        CHECK_EQUAL_ZERO(csi_dsp_request_rearm(req));
+        CHECK_EQUAL(CSI_DSP_SW_REQ_IDLE,req->status);
+    }
+    csi_dsp_task_release_request(req);
+}
+
+struct resultLog{
+    int num;
+    void *result[16];
+};
+
+static int resultCb(void *context,void *result,size_t size)
+{
+    struct resultLog *log = (struct resultLog *)context;
+    int n = __atomic_load_n(&log->num,__ATOMIC_RELAXED);
+
+    if(n < 16)
+        log->result[n] = result;
+    __atomic_store_n(&log->num,n + 1,__ATOMIC_RELEASE);
+    return 0;
+}
+
+TEST(DspPostProcessTestBasic,ResultRingInOrder)
+{
+    csi_dsp_algo_load_req_t alog_config={
+        .algo_id=0,
+    };
+    struct resultLog log;
+    struct csi_sw_task_req* req=NULL;
+    const int slot_num = 4;
+    const int frames = 12;
+    int loop;
+    int i;
+
+    memset(&log,0,sizeof(log));
+    CHECK_EQUAL_ZERO(csi_dsp_task_register_result_cb(task,256,slot_num,resultCb,&log));
+    CHECK_EQUAL_ZERO(csi_dsp_task_register_cb(task,txnReportCb,NULL,sizeof(csi_dsp_report_item_t)));
+    /* the ring is set before the report callback, not after */
+    CHECK(csi_dsp_task_register_result_cb(task,256,slot_num,resultCb,&log) != 0);
+    if(csi_dsp_task_load_algo(task,&alog_config))
+    {
+        FAIL_TEST("algo kernel load fail\n");
+    }
+    req =copyRequestHelper(640,480);
+    if(req==NULL)
+    {
+        FAIL_TEST("req create fail\n");
+    }
+
+    /* the DSP posts one result per frame, more frames than slots wrap the ring */
+    for(loop=0;loop<frames;loop++)
+    {
+        CHECK_EQUAL_ZERO(csi_dsp_request_enqueue(req));
+        CHECK(csi_dsp_request_dequeue(task) == req);
+        CHECK_EQUAL_ZERO(csi_dsp_request_rearm(req));
+    }
+    csi_dsp_task_release_request(req);
+    for(i=0;i<100 && __atomic_load_n(&log.num,__ATOMIC_ACQUIRE) < frames;i++)
+    {
+        usleep(10000);
+    }
+    CHECK_EQUAL(frames,__atomic_load_n(&log.num,__ATOMIC_ACQUIRE));
+
+    /* results are handed out in slot order, each slot is reused after slot_num results */
+    for(i=1;i<slot_num;i++)
+    {
+        CHECK((char *)log.result[i] > (char *)log.result[i-1]);
+    }
+    for(i=slot_num;i<frames;i++)
+    {
+        POINTERS_EQUAL(log.result[i-slot_num],log.result[i]);
+    }
+    CHECK_EQUAL_ZERO(csi_dsp_ps_task_unregister_cb(task));
+}
+
+TEST(DspPostProcessTestBasic,RegisteredBufferCommand)
+{
+    const int buf_num = 2;
+    unsigned char ns_id[] = XRP_PS_NSID_COMMON_CMD;
+    s_cmd_t cmd;
+    struct xrp_buffer *buf[buf_num];
+    struct xrp_buffer_group *group;
+    struct xrp_device *device;
+    struct xrp_queue *queue;
+    enum xrp_status status;
+    int i;
+
+    cmd.cmd = PS_CMD_HEART_BEAT_REQ;
+    device = xrp_open_device(0,&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+    queue = xrp_create_ns_queue(device,ns_id,&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+    group = xrp_create_buffer_group(&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+    for(i=0;i<buf_num;i++)
+    {
+        buf[i] = xrp_create_buffer(device,4096,NULL,&status);
+        CHECK(status == XRP_STATUS_SUCCESS);
+        xrp_add_buffer_to_group(group,buf[i],XRP_READ_WRITE,&status);
+        CHECK(status == XRP_STATUS_SUCCESS);
+    }
+
+    xrp_register_buffers(device,buf,buf_num,&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+    /* a buffer is registered once */
+    xrp_register_buffers(device,buf,1,&status);
+    CHECK(status == XRP_STATUS_FAILURE);
+
+    /* registered buffers go down by handle */
+    xrp_run_command_sync(queue,&cmd,sizeof(cmd.cmd),NULL,0,group,&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+
+    for(i=0;i<buf_num;i++)
+    {
+        xrp_unregister_buffer(buf[i],&status);
+        CHECK(status == XRP_STATUS_SUCCESS);
+        xrp_unregister_buffer(buf[i],&status);
+        CHECK(status == XRP_STATUS_FAILURE);
+    }
+
+    /* and by address again once unregistered */
+    xrp_run_command_sync(queue,&cmd,sizeof(cmd.cmd),NULL,0,group,&status);
+    CHECK(status == XRP_STATUS_SUCCESS);
+
+    for(i=0;i<buf_num;i++)
+    {
+        xrp_release_buffer(buf[i]);
+    }
+    xrp_release_buffer_group(group);
+    xrp_release_queue(queue);
+    xrp_release_device(device);
+}
+
+TEST(DspPostProcessTestBasic,ParamPublishTwice)
+{
+    csi_dsp_algo_load_req_t alog_config={
+        .algo_id=0,
+    };
+    uint32_t init[4] = {1,2,3,4};
+    uint32_t expect[4] = {1,2,3,4};
+    uint32_t coef[2] = {0x55,0x66};
+    uint32_t back[4];
+    uint32_t published;
+    uint32_t version;
+    uint32_t ver[2];
+
+    if(csi_dsp_task_load_algo(task,&alog_config))
+    {
+        FAIL_TEST("algo kernel load fail\n");
+    }
+    CHECK_EQUAL_ZERO(csi_dsp_task_create_param(task,init,sizeof(init)));
+    CHECK(csi_dsp_task_create_param(task,init,sizeof(init)) != 0);
+    CHECK_EQUAL_ZERO(csi_dsp_task_get_param_version(task,&version,NULL));
+    CHECK_EQUAL(1,version);
+
+    /* each publish goes to the other slot, the second must keep the first */
+    CHECK_EQUAL_ZERO(csi_dsp_task_update_param(task,sizeof(uint32_t),&coef[0],sizeof(coef[0]),&ver[0]));
+    CHECK_EQUAL_ZERO(csi_dsp_task_update_param(task,3*sizeof(uint32_t),&coef[1],sizeof(coef[1]),&ver[1]));
+    CHECK_EQUAL(2,ver[0]);
+    CHECK_EQUAL(3,ver[1]);
+    CHECK_EQUAL_ZERO(csi_dsp_task_get_param_version(task,&published,NULL));
+    CHECK_EQUAL(ver[1],published);
+
+    expect[1] = coef[0];
+    expect[3] = coef[1];
+    CHECK_EQUAL_ZERO(csi_dsp_task_read_param(task,0,back,sizeof(back)));
+    MEMCMP_EQUAL(expect,back,sizeof(expect));
+
+    /* an update past the end publishes nothing */
+    CHECK(csi_dsp_task_update_param(task,3*sizeof(uint32_t),coef,sizeof(coef),NULL) != 0);
+    CHECK(csi_dsp_task_read_param(task,3*sizeof(uint32_t),back,sizeof(coef)) != 0);
+    CHECK_EQUAL_ZERO(csi_dsp_task_get_param_version(task,&version,NULL));
+    CHECK_EQUAL(published,version);
+
+    CHECK_EQUAL_ZERO(csi_dsp_task_release_param(task));
+    CHECK(csi_dsp_task_get_param_version(task,&version,NULL) != 0);
+}
+
 TEST(DspPostProcessTestBasic,MultiProcessReq)
 {
     
@@ -44,20 +44,22 @@ TEST_GROUP(DspPostProcessTestLibLoader)
 
   int oneRequsetHelper(int with,int height,int stride,int plane_num,char *name)
   {
-        int i=0;
-        int j=0;
-        int ret =0 ;
-        struct timeval time_enqueue;
-        struct timeval time_dequeue;
-        csi_dsp_algo_load_req_t alog_config={
-            .algo_id=0,
-        };
-
         if(csi_dsp_task_acquire_algo(task,name))
         {
             FAIL_TEST("algo kernel load fail\n");
 
         }
+        return runRequestHelper(with,height,stride,plane_num);
+  }
+
+  /* run one copy request on a task that already has its library loaded */
+  int runRequestHelper(int with,int height,int stride,int plane_num)
+  {
+        int i=0;
+        int j=0;
+        int ret =0 ;
+        struct timeval time_enqueue;
+        struct timeval time_dequeue;
 
         struct csi_sw_task_req* req=NULL;
         req =csi_dsp_task_create_request(task);
@@ -195,6 +197,41 @@ TEST(DspPostProcessTestLibLoader,oneProcessReq_4096_2160_pi_lib)
 
 }
 
+TEST(DspPostProcessTestLibLoader,prefetchThenAttach)
+{
+    void *prefetch;
+    void *task2;
+
+    prefetch = csi_dsp_algo_prefetch(instance,"dsp_dummy_algo_flo");
+    CHECK(prefetch != NULL);
+    CHECK_EQUAL_ZERO(csi_dsp_task_attach_algo(task,prefetch));
+    CHECK_EQUAL_ZERO(runRequestHelper(640,480,640,1));
+
+    /* the handle stays valid for further tasks */
+    task2 = csi_dsp_create_task(instance,CSI_DSP_TASK_SW_TO_SW);
+    CHECK(task2 != NULL);
+    CHECK_EQUAL_ZERO(csi_dsp_task_attach_algo(task2,prefetch));
+    csi_dsp_destroy_task(task2);
+
+    /* and the task keeps its library once the handle is gone */
+    CHECK_EQUAL_ZERO(csi_dsp_algo_prefetch_release(prefetch));
+    CHECK_EQUAL_ZERO(runRequestHelper(640,480,640,1));
+}
+
+TEST(DspPostProcessTestLibLoader,prefetchMissingLib)
+{
+    void *prefetch;
+
+    /* the file is read in the background, a missing one fails the attach */
+    prefetch = csi_dsp_algo_prefetch(instance,"dsp_no_such_algo");
+    CHECK(prefetch != NULL);
+    CHECK(csi_dsp_task_attach_algo(task,prefetch) != 0);
+    CHECK_EQUAL_ZERO(csi_dsp_algo_prefetch_release(prefetch));
+
+    /* the task can still take a library afterwards */
+    CHECK_EQUAL_ZERO(oneRequsetHelper(640,480,640,1,"dsp_dummy_algo_flo"));
+}
+
 // TEST(DspPostProcessTestLibLoader,oneProcessReq_multi_planes_lib)
 // {
 
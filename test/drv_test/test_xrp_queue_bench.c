@@ -0,0 +1,123 @@
+/*
+ * Enqueue throughput of the xrp request queue under producer contention.
+ * Runs on the host only, no DSP device is needed.
+ *
+ *   ./test_xrp_queue_bench [max_producers] [items_per_producer]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "xrp_api.h"
+#include "xrp_host_common.h"
+#include "dsp_common.h"
+
+#define DEFAULT_MAX_PRODUCERS   8
+#define DEFAULT_ITEMS           200000
+
+struct bench_ctx {
+    struct xrp_request_queue queue;
+    struct xrp_queue_item *items;
+    int items_per_producer;
+    _Atomic long consumed;
+    _Atomic int go;
+};
+
+struct producer_arg {
+    struct bench_ctx *ctx;
+    int index;
+};
+
+static void bench_consume(struct xrp_queue_item *rq, void *context)
+{
+    struct bench_ctx *ctx = context;
+
+    (void)rq;
+    atomic_fetch_add_explicit(&ctx->consumed, 1, memory_order_relaxed);
+}
+
+static void *bench_producer(void *p)
+{
+    struct producer_arg *arg = p;
+    struct bench_ctx *ctx = arg->ctx;
+    struct xrp_queue_item *items = ctx->items + (size_t)arg->index * ctx->items_per_producer;
+    int i;
+
+    while (!atomic_load(&ctx->go))
+        ;
+    for (i = 0; i < ctx->items_per_producer; i++)
+        xrp_queue_push(&ctx->queue, items + i);
+    return NULL;
+}
+
+static double time_diff_s(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run_bench(int n_producers, int items_per_producer)
+{
+    struct bench_ctx *ctx = calloc(1, sizeof(*ctx));
+    pthread_t *threads = calloc(n_producers, sizeof(*threads));
+    struct producer_arg *args = calloc(n_producers, sizeof(*args));
+    long total = (long)n_producers * items_per_producer;
+    struct timespec start, end;
+    double secs;
+    int i;
+
+    if (!ctx || !threads || !args)
+        return -1;
+    ctx->items = calloc(total, sizeof(*ctx->items));
+    if (!ctx->items)
+        return -1;
+    ctx->items_per_producer = items_per_producer;
+    xrp_queue_init(&ctx->queue, 0, ctx, bench_consume);
+
+    for (i = 0; i < n_producers; i++) {
+        args[i].ctx = ctx;
+        args[i].index = i;
+        pthread_create(&threads[i], NULL, bench_producer, &args[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&ctx->go, 1);
+    for (i = 0; i < n_producers; i++)
+        pthread_join(threads[i], NULL);
+    while (atomic_load(&ctx->consumed) != total)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = time_diff_s(&start, &end);
+    printf("[queue bench] producers:%2d items:%8ld time:%8.3f ms  %8.2f Mops/s\n",
+           n_producers, total, secs * 1e3, total / secs / 1e6);
+
+    xrp_queue_destroy(&ctx->queue);
+    free(ctx->items);
+    free(args);
+    free(threads);
+    free(ctx);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_producers = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_PRODUCERS;
+    int items = argc > 2 ? atoi(argv[2]) : DEFAULT_ITEMS;
+    int n;
+
+    if (max_producers <= 0 || items <= 0) {
+        printf("usage: %s [max_producers] [items_per_producer]\n", argv[0]);
+        return -1;
+    }
+    dsp_InitEnv();
+    for (n = 1; n <= max_producers; n++) {
+        if (run_bench(n, items)) {
+            printf("[queue bench] run with %d producers fail\n", n);
+            return -1;
+        }
+    }
+    return 0;
+}
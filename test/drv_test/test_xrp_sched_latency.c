@@ -0,0 +1,144 @@
+/*
+ * Wakeup latency of an xrp queue thread under CPU contention, for a
+ * normal (priority 0) queue and for a real-time (priority > 0) one.
+ * Runs on the host only, no DSP device is needed. Real-time threads need
+ * root or RLIMIT_RTPRIO, without them both runs use normal threads.
+ *
+ *   ./test_xrp_sched_latency [samples] [hog_threads] [fifo|rr]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "xrp_api.h"
+#include "xrp_host_common.h"
+#include "dsp_common.h"
+
+#define DEFAULT_SAMPLES         2000
+#define SAMPLE_PERIOD_US        500
+#define RT_PRIORITY             10
+
+struct lat_item {
+    struct xrp_queue_item q;
+    struct timespec sent;
+};
+
+struct lat_ctx {
+    struct xrp_request_queue queue;
+    struct lat_item *items;
+    long *lat_ns;
+    _Atomic int done;
+};
+
+static _Atomic int hog_stop;
+
+static long time_diff_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static void lat_consume(struct xrp_queue_item **rq, size_t n, void *context)
+{
+    struct lat_ctx *ctx = context;
+    struct timespec now;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < n; i++) {
+        struct lat_item *item = (struct lat_item *)rq[i];
+
+        ctx->lat_ns[item - ctx->items] = time_diff_ns(&item->sent, &now);
+        atomic_fetch_add(&ctx->done, 1);
+    }
+}
+
+static void *hog_thread(void *p)
+{
+    volatile unsigned long spin = 0;
+
+    (void)p;
+    while (!atomic_load_explicit(&hog_stop, memory_order_relaxed))
+        spin++;
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_latency(const char *name, int priority, const struct xrp_thread_sched *sched,
+                       int samples)
+{
+    struct lat_ctx *ctx = calloc(1, sizeof(*ctx));
+    int i;
+
+    if (!ctx)
+        return -1;
+    ctx->items = calloc(samples, sizeof(*ctx->items));
+    ctx->lat_ns = calloc(samples, sizeof(*ctx->lat_ns));
+    if (!ctx->items || !ctx->lat_ns)
+        return -1;
+    xrp_queue_init_sched(&ctx->queue, priority, sched, ctx, lat_consume);
+
+    for (i = 0; i < samples; i++) {
+        usleep(SAMPLE_PERIOD_US);
+        clock_gettime(CLOCK_MONOTONIC, &ctx->items[i].sent);
+        xrp_queue_push(&ctx->queue, &ctx->items[i].q);
+    }
+    while (atomic_load(&ctx->done) != samples)
+        usleep(1000);
+
+    qsort(ctx->lat_ns, samples, sizeof(*ctx->lat_ns), cmp_long);
+    printf("[sched latency] %-8s p50:%8.1f us  p99:%8.1f us  max:%8.1f us\n", name,
+           ctx->lat_ns[samples / 2] / 1e3,
+           ctx->lat_ns[samples * 99 / 100] / 1e3,
+           ctx->lat_ns[samples - 1] / 1e3);
+
+    xrp_queue_destroy(&ctx->queue);
+    free(ctx->lat_ns);
+    free(ctx->items);
+    free(ctx);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = argc > 1 ? atoi(argv[1]) : DEFAULT_SAMPLES;
+    int n_hogs = argc > 2 ? atoi(argv[2]) : 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct xrp_thread_sched sched = {
+        .policy = argc > 3 && !strcmp(argv[3], "rr") ? SCHED_RR : SCHED_FIFO,
+    };
+    pthread_t *hogs;
+    int i, ret;
+
+    if (samples <= 0 || n_hogs < 0) {
+        printf("usage: %s [samples] [hog_threads] [fifo|rr]\n", argv[0]);
+        return -1;
+    }
+    dsp_InitEnv();
+    hogs = calloc(n_hogs ? n_hogs : 1, sizeof(*hogs));
+    if (!hogs)
+        return -1;
+    for (i = 0; i < n_hogs; i++)
+        pthread_create(&hogs[i], NULL, hog_thread, NULL);
+    printf("[sched latency] %d samples, %d busy threads\n", samples, n_hogs);
+
+    ret = run_latency("normal", 0, &sched, samples);
+    if (!ret)
+        ret = run_latency(sched.policy == SCHED_RR ? "rr" : "fifo", RT_PRIORITY, &sched, samples);
+
+    atomic_store(&hog_stop, 1);
+    for (i = 0; i < n_hogs; i++)
+        pthread_join(hogs[i], NULL);
+    free(hogs);
+    if (ret)
+        printf("[sched latency] run fail\n");
+    return ret;
+}
@@ -0,0 +1,178 @@
+/*
+ * Round trip latency of a synchronous command through the xrp request
+ * queue: handed to a pool worker and waited for, as xrp_run_command_sync
+ * did before, versus run on the caller's thread after xrp_queue_claim.
+ * The command itself is a cheap syscall standing in for the ioctl.
+ * Runs on the host only, no DSP device is needed.
+ *
+ *   ./test_xrp_sync_latency [samples] [background_producers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#include "xrp_api.h"
+#include "xrp_host_common.h"
+#include "dsp_common.h"
+
+#define DEFAULT_SAMPLES         20000
+#define BENCH_POOL_THREADS      2
+
+struct sync_item {
+    struct xrp_queue_item q;
+    xrp_cond cond;
+    int done;
+};
+
+struct sync_ctx {
+    struct xrp_request_queue queue;
+    long *lat_ns;
+    _Atomic long inline_runs;
+    _Atomic int stop;
+};
+
+static long time_diff_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+static void sync_command(void)
+{
+    syscall(SYS_getppid);
+}
+
+static void sync_consume(struct xrp_queue_item **rq, size_t n, void *context)
+{
+    size_t i;
+
+    (void)context;
+    for (i = 0; i < n; i++) {
+        struct sync_item *item = (struct sync_item *)rq[i];
+
+        sync_command();
+        xrp_cond_lock(&item->cond);
+        item->done = 1;
+        xrp_cond_broadcast(&item->cond);
+        xrp_cond_unlock(&item->cond);
+    }
+}
+
+static void sync_queued(struct sync_ctx *ctx)
+{
+    /* the request copy xrp_enqueue_command makes */
+    struct sync_item *item = malloc(sizeof(*item));
+
+    xrp_cond_init(&item->cond);
+    item->done = 0;
+    xrp_queue_push(&ctx->queue, &item->q);
+    xrp_cond_lock(&item->cond);
+    while (!item->done)
+        xrp_cond_wait(&item->cond);
+    xrp_cond_unlock(&item->cond);
+    xrp_cond_destroy(&item->cond);
+    free(item);
+}
+
+static void sync_inline(struct sync_ctx *ctx)
+{
+    if (!xrp_queue_claim(&ctx->queue)) {
+        sync_queued(ctx);
+        return;
+    }
+    sync_command();
+    xrp_queue_unclaim(&ctx->queue);
+    atomic_fetch_add(&ctx->inline_runs, 1);
+}
+
+/* Other users of the queue, so claims also see a busy queue now and then */
+static void *background_producer(void *p)
+{
+    struct sync_ctx *ctx = p;
+
+    while (!atomic_load(&ctx->stop)) {
+        sync_queued(ctx);
+        usleep(200);
+    }
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_latency(const char *name, struct xrp_worker_pool *pool,
+                       void (*run)(struct sync_ctx *ctx), int samples, int n_background)
+{
+    struct sync_ctx *ctx = calloc(1, sizeof(*ctx));
+    pthread_t *threads = calloc(n_background ? n_background : 1, sizeof(*threads));
+    struct timespec start, end;
+    int i;
+
+    if (!ctx || !threads)
+        return -1;
+    ctx->lat_ns = calloc(samples, sizeof(*ctx->lat_ns));
+    if (!ctx->lat_ns)
+        return -1;
+    xrp_queue_init_pool(&ctx->queue, pool, ctx, sync_consume);
+    for (i = 0; i < n_background; i++)
+        pthread_create(&threads[i], NULL, background_producer, ctx);
+
+    for (i = 0; i < samples; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(ctx);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ctx->lat_ns[i] = time_diff_ns(&start, &end);
+    }
+
+    atomic_store(&ctx->stop, 1);
+    for (i = 0; i < n_background; i++)
+        pthread_join(threads[i], NULL);
+
+    qsort(ctx->lat_ns, samples, sizeof(*ctx->lat_ns), cmp_long);
+    printf("[sync latency] %-7s p50:%8.2f us  p99:%8.2f us  max:%9.2f us  inline:%3ld%%\n", name,
+           ctx->lat_ns[samples / 2] / 1e3,
+           ctx->lat_ns[samples * 99 / 100] / 1e3,
+           ctx->lat_ns[samples - 1] / 1e3,
+           atomic_load(&ctx->inline_runs) * 100 / samples);
+
+    xrp_queue_destroy(&ctx->queue);
+    free(ctx->lat_ns);
+    free(threads);
+    free(ctx);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = argc > 1 ? atoi(argv[1]) : DEFAULT_SAMPLES;
+    int n_background = argc > 2 ? atoi(argv[2]) : 0;
+    struct xrp_worker_pool *pool;
+    int ret;
+
+    if (samples <= 0 || n_background < 0) {
+        printf("usage: %s [samples] [background_producers]\n", argv[0]);
+        return -1;
+    }
+    dsp_InitEnv();
+    pool = xrp_worker_pool_create(BENCH_POOL_THREADS, 0, NULL);
+    if (!pool)
+        return -1;
+    printf("[sync latency] %d samples, %d background producers\n", samples, n_background);
+
+    ret = run_latency("queued", pool, sync_queued, samples, n_background);
+    if (!ret)
+        ret = run_latency("inline", pool, sync_inline, samples, n_background);
+
+    xrp_worker_pool_release(pool);
+    if (ret)
+        printf("[sync latency] run fail\n");
+    return ret;
+}